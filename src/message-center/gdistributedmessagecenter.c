@@ -20,61 +20,2327 @@
  * Author: Rodrigo Moya <rodrigo@gnome.org>
  */
 
-#include "config.h"
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <gio/gio.h>
+
+#include "gdistributedmessagecenter.h"
+#include "gmessagering.h"
+#include "gmessagewire.h"
+#include "gtopictrie.h"
 
 /**
- * SECTION:gmessagecenter
- * @title: GMessageCenter
- * @short_description: Application-wide message passing interface
+ * SECTION:gdistributedmessagecenter
+ * @title: GDistributedMessageCenter
+ * @short_description: Host-wide message passing interface
+ *
+ * A #GDistributedMessageCenter is a #GMessageCenter whose messages, when
+ * sent with g_distributed_message_center_send(), are also delivered to the
+ * distributed message centers of the other processes on the same host
+ * using the same rendezvous directory, if they have filters for them.
+ *
+ * Messages received from other processes are sent to the local filters
+ * with the distributed message center as their sender. Only their name and
+ * payload, see g_message_new_with_payload(), are transmitted, along with
+ * the UUID of the sending process, see
+ * g_distributed_message_center_get_message_origin().
+ */
+
+/* Every process listens on its own Unix socket in the rendezvous directory,
+ * and is connected to every other process directly, so that messages don't
+ * go through anybody else.
+ *
+ * Processes find each other through the rendezvous socket, owned by
+ * whichever process got hold of the lock file first. A process joining
+ * registers the address of its own socket there, and gets back the
+ * addresses of the processes already there, which it connects to. When the
+ * owner of the rendezvous socket goes away, the other processes elect a
+ * new one the same way, and register again.
+ *
+ * Everything is sent as frames: a FrameHeader followed by a body, in host
+ * byte order, as processes are always on the same host. Frames going
+ * through a socket are queued in its output buffer, which is written in
+ * batches when frames come close together. The body of
+ * message frames is encoded by gmessagewire.c, with message names sent once
+ * per channel, the socket and the ring being channels of their own.
+ *
+ * Once connected, each side of a peer connection creates a GMessageRing
+ * in shared memory, and passes it to the other side, after which messages
+ * are written straight into the ring instead of the socket. The receiver
+ * copies them out as it delivers them, since ring space is only reused in
+ * order, and a single payload kept by a filter would otherwise stop the
+ * ring. Payloads too big for that to be cheap are written in a memfd of
+ * their own instead, sealed and passed through the socket, with a marker
+ * in the ring to keep messages in order, and are used in place.
+ *
+ * The space in a ring is the credit the receiving side grants, given back
+ * as it delivers the messages it got. Messages which don't fit wait in memory,
+ * up to a limit per peer, over which the flow control policy applies.
+ *
+ * Messages are only sent to the processes listening to them: each process
+ * tells its peers the names and patterns of its filters matching messages
+ * from other processes, and the sending side matches messages against
+ * those of each peer.
  */
 
-struct _GDistributedMessageCenterPrivate
+#define RENDEZVOUS_SOCKET "rendezvous"
+#define RENDEZVOUS_LOCK   "rendezvous.lock"
+
+/* How long to wait before trying to join again, in milliseconds, when the
+ * rendezvous socket is being taken over */
+#define REJOIN_DELAY 10
+
+/* Frames bigger than this are a protocol error */
+#define MAX_FRAME_SIZE (64 * 1024 * 1024)
+
+#define READ_CHUNK_SIZE 65536
+
+/* Frames written to a socket less than BATCH_DELAY microseconds after the
+ * previous write wait for more frames, until the delay passes or until
+ * there are BATCH_SIZE bytes to write, so that bursts take a single
+ * system call. The main loop wakes up with a millisecond precision, so
+ * the wait can be a little longer */
+#define BATCH_DELAY 50
+#define BATCH_SIZE  (64 * 1024)
+
+/* Size of the rings, each peer connection has one in each direction */
+#define RING_SIZE (1024 * 1024)
+
+/* Biggest record written in a ring, bigger messages go in a blob */
+#define RING_MAX_RECORD (64 * 1024)
+
+/* Most file descriptors waiting to be written to a socket, most of them
+ * being blobs, over which messages wait like when the ring is full */
+#define MAX_OUTPUT_FDS 64
+
+/* Default limit of the memory taken by the messages waiting to be sent to
+ * a peer */
+#define PEER_BUFFER_LIMIT (16 * 1024 * 1024)
+
+/* How long a sender blocked by peers waits at once, in milliseconds, before
+ * looking at them again */
+#define BLOCK_POLL_INTERVAL 10
+
+/* Maximum number of messages read from a ring at once, so that a busy
+ * peer doesn't hold the main loop */
+#define RING_BATCH 256
+
+typedef enum
+{
+  /* body: the address of the process connecting */
+  FRAME_HELLO = 1,
+  /* body: a message, see gmessagewire.c */
+  FRAME_MESSAGE,
+  /* body: the address of a process joining */
+  FRAME_REGISTER,
+  /* body: the nul-terminated addresses of the processes already there */
+  FRAME_PEERS,
+  /* body: none, with the memfd and the eventfds of a GMessageRing */
+  FRAME_RING,
+  /* body: a message without its payload, with a memfd holding the
+   * serialized payload. In a ring, without a body, it marks where the
+   * message goes */
+  FRAME_BLOB,
+  /* body: a message name or pattern the sending process listens to, or
+   * stops listening to */
+  FRAME_SUBSCRIBE,
+  FRAME_UNSUBSCRIBE
+} FrameType;
+
+/* Values of the route cache of connections */
+#define ROUTE_WANTED   GINT_TO_POINTER (1)
+#define ROUTE_UNWANTED GINT_TO_POINTER (2)
+
+typedef struct
+{
+  /* of the whole frame, header included */
+  guint32 size;
+  guint32 type;
+} FrameHeader;
+
+typedef enum
+{
+  /* to another process, carrying messages */
+  CONNECTION_PEER,
+  /* to the owner of the rendezvous socket */
+  CONNECTION_RENDEZVOUS,
+  /* from a process registering, when we own the rendezvous socket */
+  CONNECTION_MEMBER
+} ConnectionKind;
+
+typedef gboolean (* FdSourceFunc) (gpointer user_data, GIOCondition condition);
+
+typedef struct
+{
+  GSource source;
+  gpointer tag;
+} FdSource;
+
+typedef struct
+{
+  GDistributedMessageCenter *message_center;
+  ConnectionKind kind;
+  gint fd;
+  GSource *source;
+  /* The address the process at the other end listens on, once known */
+  gchar *address;
+  /* Whether we connected to it, or it connected to us */
+  gboolean initiated;
+  GByteArray *input;
+  /* Received file descriptors, until the frame they come with is handled */
+  GQueue fds;
+  /* Protected by the message center lock, with the file descriptors to
+   * send along with it as OutputFd, the memory the blobs among them take,
+   * and when it was last written to the socket. The source has a ready
+   * time while a batch waits */
+  GByteArray *output;
+  GArray *output_fds;
+  gsize output_blobs_size;
+  gint64 last_write;
+
+  /* The topics of the messages going through the socket, each way */
+  GMessageWireTable *in_topics;
+  GMessageWireTable *out_topics;
+
+  /* The UUID of the process at the other end, as last seen in a message,
+   * and its interned string */
+  guint8 origin_uuid[G_MESSAGE_WIRE_UUID_SIZE];
+  const gchar *origin;
+
+  /* Messages from the ring of the other side, and the blobs which came
+   * before their marker in the ring, or whether the ring waits for the
+   * blob of the marker it stopped at */
+  GMessageRing *in_ring;
+  GSource *in_ring_source;
+  GMessageWireTable *in_ring_topics;
+  GQueue blobs;
+  gboolean waiting_blob;
+
+  /* The names and patterns the other side listens to, and whether it
+   * wants messages with a given name quark, computed from those as needed */
+  GTopicTrie *interests;
+  GHashTable *routes;
+
+  /* Messages to the other side, and the PendingMessage waiting for space
+   * in the ring, or in the socket output before the ring is there, with
+   * the memory their payloads take, protected by the message center lock */
+  GMessageRing *out_ring;
+  GSource *out_ring_source;
+  GMessageWireTable *out_ring_topics;
+  GQueue pending;
+  gsize pending_size;
+
+  /* The temporary file payloads are spilled to, the end of what is there,
+   * and how many pending messages are spilled */
+  gint spill_fd;
+  guint64 spill_end;
+  guint n_spilled_pending;
+
+  guint64 n_dropped;
+  guint64 n_spilled;
+  /* Whether a sender blocked on it saw the socket closed, until it is
+   * removed */
+  gboolean hung_up;
+} Connection;
+
+typedef struct
+{
+  /* Offset in the output of the first byte of the frame it goes with */
+  guint offset;
+  gint fd;
+  /* The size of the blob it is, if any */
+  gsize size;
+} OutputFd;
+
+typedef struct
+{
+  GQuark name;
+  /* NULL while spilled, the payload being spill_size bytes at spill_offset
+   * in the spill file, of the type whose string has the quark type, or 0
+   * for no payload */
+  GVariant *payload;
+  gboolean spilled;
+  GQuark type;
+  guint64 spill_offset;
+  gsize spill_size;
+} PendingMessage;
+
+struct _GDistributedMessageCenterPrivate
+{
+  GMutex lock;
+  GMainContext *context;
+  gchar *directory;
+
+  /* Identifies the process in the messages it sends, with its interned
+   * string */
+  guint8 uuid[G_MESSAGE_WIRE_UUID_SIZE];
+  const gchar *uuid_string;
+
+  /* Our own socket */
+  gchar *address;
+  gint listen_fd;
+  GSource *listen_source;
+
+  /* While we own the rendezvous socket */
+  gint lock_fd;
+  gint rendezvous_fd;
+  GSource *rendezvous_source;
+
+  /* Flow control, see g_distributed_message_center_set_flow_control() */
+  gsize peer_buffer_limit;
+  GDistributedMessageCenterFlowPolicy flow_policy;
+
+  /* Name or pattern -> number of local filters for messages from other
+   * processes */
+  GHashTable *interests;
+
+  /* Connections to peers, to the owner of the rendezvous socket, and from
+   * members if we are the owner */
+  GPtrArray *connections;
+  GSource *rejoin_source;
+};
+
+G_DEFINE_TYPE_WITH_PRIVATE (GDistributedMessageCenter, g_distributed_message_center, G_TYPE_MESSAGE_CENTER)
+
+static void g_distributed_message_center_join (GDistributedMessageCenter *message_center);
+
+static gboolean
+fd_source_dispatch (GSource *source, GSourceFunc callback, gpointer user_data)
+{
+  FdSource *fd_source = (FdSource *) source;
+
+  return ((FdSourceFunc) callback) (user_data, g_source_query_unix_fd (source, fd_source->tag));
+}
+
+static GSourceFuncs fd_source_funcs = {
+  NULL,
+  NULL,
+  fd_source_dispatch,
+  NULL
+};
+
+static GSource *
+fd_source_new (gint fd, FdSourceFunc func, gpointer user_data, GMainContext *context)
+{
+  GSource *source = g_source_new (&fd_source_funcs, sizeof (FdSource));
+
+  ((FdSource *) source)->tag = g_source_add_unix_fd (source, fd, G_IO_IN | G_IO_HUP | G_IO_ERR);
+  g_source_set_callback (source, (GSourceFunc) func, user_data, NULL);
+  g_source_set_name (source, "GDistributedMessageCenter");
+  g_source_attach (source, context);
+
+  return source;
+}
+
+static void
+fd_source_set_writable (GSource *source, gboolean writable)
+{
+  g_source_modify_unix_fd (source,
+                           ((FdSource *) source)->tag,
+                           G_IO_IN | G_IO_HUP | G_IO_ERR | (writable ? G_IO_OUT : 0));
+}
+
+static gboolean
+socket_address_init (struct sockaddr_un *sun, const gchar *path, GError **error)
+{
+  memset (sun, 0, sizeof (*sun));
+  sun->sun_family = AF_UNIX;
+  if (strlen (path) >= sizeof (sun->sun_path))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FILENAME_TOO_LONG,
+                   "Socket path %s is too long", path);
+      return FALSE;
+    }
+  strcpy (sun->sun_path, path);
+
+  return TRUE;
+}
+
+static gint
+socket_listen (const gchar *path, GError **error)
+{
+  struct sockaddr_un sun;
+  gint fd;
+
+  if (!socket_address_init (&sun, path, error))
+    return -1;
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0 || bind (fd, (struct sockaddr *) &sun, sizeof (sun)) < 0 || listen (fd, SOMAXCONN) < 0)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Could not listen on %s: %s", path, g_strerror (saved_errno));
+      if (fd >= 0)
+        close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+static gint
+socket_connect (const gchar *path, GError **error)
+{
+  struct sockaddr_un sun;
+  gint fd;
+
+  if (!socket_address_init (&sun, path, error))
+    return -1;
+
+  /* Connecting to a Unix socket doesn't block, it fails right away if the
+   * other end can't take it */
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect (fd, (struct sockaddr *) &sun, sizeof (sun)) < 0)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Could not connect to %s: %s", path, g_strerror (saved_errno));
+      if (fd >= 0)
+        close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+static gboolean connection_dispatch (gpointer user_data, GIOCondition condition);
+
+/* Must be called with the lock held */
+static Connection *
+g_distributed_message_center_add_connection (GDistributedMessageCenter *message_center,
+                                             ConnectionKind kind,
+                                             gint fd,
+                                             const gchar *address,
+                                             gboolean initiated)
+{
+  Connection *connection = g_new0 (Connection, 1);
+
+  connection->message_center = message_center;
+  connection->kind = kind;
+  connection->fd = fd;
+  connection->address = g_strdup (address);
+  connection->initiated = initiated;
+  connection->input = g_byte_array_new ();
+  connection->output = g_byte_array_new ();
+  connection->output_fds = g_array_new (FALSE, FALSE, sizeof (OutputFd));
+  connection->in_topics = g_message_wire_table_new ();
+  connection->out_topics = g_message_wire_table_new ();
+  connection->in_ring_topics = g_message_wire_table_new ();
+  connection->out_ring_topics = g_message_wire_table_new ();
+  connection->interests = g_topic_trie_new (NULL);
+  connection->routes = g_hash_table_new (NULL, NULL);
+  connection->spill_fd = -1;
+  connection->source = fd_source_new (fd, connection_dispatch, connection, message_center->priv->context);
+
+  g_ptr_array_add (message_center->priv->connections, connection);
+
+  return connection;
+}
+
+static void
+close_fd (gpointer data)
+{
+  close (GPOINTER_TO_INT (data));
+}
+
+static void
+destroy_source (GSource *source)
+{
+  g_source_destroy (source);
+  g_source_unref (source);
+}
+
+static void
+pending_message_free (PendingMessage *pending)
+{
+  if (pending->payload != NULL)
+    g_variant_unref (pending->payload);
+  g_free (pending);
+}
+
+static void
+connection_free (Connection *connection)
+{
+  guint i;
+
+  destroy_source (connection->source);
+  close (connection->fd);
+  g_free (connection->address);
+  g_byte_array_unref (connection->input);
+  g_byte_array_unref (connection->output);
+  for (i = 0; i < connection->output_fds->len; i++)
+    {
+      close (g_array_index (connection->output_fds, OutputFd, i).fd);
+    }
+  g_array_unref (connection->output_fds);
+  g_queue_foreach (&connection->fds, (GFunc) close_fd, NULL);
+  g_queue_clear (&connection->fds);
+  g_topic_trie_free (connection->interests);
+  g_hash_table_unref (connection->routes);
+  g_message_wire_table_free (connection->in_topics);
+  g_message_wire_table_free (connection->out_topics);
+  g_message_wire_table_free (connection->in_ring_topics);
+  g_message_wire_table_free (connection->out_ring_topics);
+
+  if (connection->in_ring != NULL)
+    {
+      destroy_source (connection->in_ring_source);
+      g_message_ring_unref (connection->in_ring);
+    }
+  g_queue_foreach (&connection->blobs, (GFunc) g_object_unref, NULL);
+  g_queue_clear (&connection->blobs);
+  if (connection->out_ring != NULL)
+    {
+      destroy_source (connection->out_ring_source);
+      g_message_ring_unref (connection->out_ring);
+    }
+  g_queue_foreach (&connection->pending, (GFunc) pending_message_free, NULL);
+  g_queue_clear (&connection->pending);
+  if (connection->spill_fd >= 0)
+    close (connection->spill_fd);
+
+  g_free (connection);
+}
+
+/* Must be called with the lock held */
+static void
+g_distributed_message_center_remove_connection (GDistributedMessageCenter *message_center,
+                                                Connection *connection)
+{
+  g_ptr_array_remove_fast (message_center->priv->connections, connection);
+  connection_free (connection);
+}
+
+/* Writes as much of the pending output as the socket takes. Must be called
+ * with the lock held. Returns FALSE if the connection is broken */
+static gboolean
+connection_flush (Connection *connection)
+{
+  GArray *output_fds = connection->output_fds;
+
+  g_source_set_ready_time (connection->source, -1);
+
+  while (connection->output->len > 0)
+    {
+      union {
+        struct cmsghdr header;
+        gchar buffer[CMSG_SPACE (sizeof (gint) * 4)];
+      } control;
+      struct iovec iov;
+      struct msghdr msg = { 0, };
+      guint i, n_fds = 0;
+      gssize written;
+
+      iov.iov_base = connection->output->data;
+      iov.iov_len = connection->output->len;
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+
+      /* File descriptors go with the first byte of their frame, which is
+       * written separately from the frames before and after it */
+      while (n_fds < output_fds->len && n_fds < 4 &&
+             g_array_index (output_fds, OutputFd, n_fds).offset == 0)
+        n_fds++;
+      if (n_fds < output_fds->len)
+        iov.iov_len = MAX (g_array_index (output_fds, OutputFd, n_fds).offset, 1);
+
+      if (n_fds > 0)
+        {
+          memset (&control, 0, sizeof (control));
+          msg.msg_control = control.buffer;
+          msg.msg_controllen = CMSG_SPACE (sizeof (gint) * n_fds);
+          control.header.cmsg_level = SOL_SOCKET;
+          control.header.cmsg_type = SCM_RIGHTS;
+          control.header.cmsg_len = CMSG_LEN (sizeof (gint) * n_fds);
+          for (i = 0; i < n_fds; i++)
+            {
+              ((gint *) CMSG_DATA (&control.header))[i] = g_array_index (output_fds, OutputFd, i).fd;
+            }
+        }
+
+      /* Without a SIGPIPE if the other side went away */
+      written = sendmsg (connection->fd, &msg, MSG_NOSIGNAL);
+      if (written < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+          return FALSE;
+        }
+      connection->last_write = g_get_monotonic_time ();
+
+      for (i = 0; i < n_fds; i++)
+        {
+          close (g_array_index (output_fds, OutputFd, i).fd);
+          connection->output_blobs_size -= g_array_index (output_fds, OutputFd, i).size;
+        }
+      g_array_remove_range (output_fds, 0, n_fds);
+      for (i = 0; i < output_fds->len; i++)
+        {
+          g_array_index (output_fds, OutputFd, i).offset -= written;
+        }
+      g_byte_array_remove_range (connection->output, 0, written);
+    }
+
+  fd_source_set_writable (connection->source, connection->output->len > 0);
+
+  return TRUE;
+}
+
+/* Writes the pending output right away, or once the current batch is
+ * complete. Must be called with the lock held, after queueing frames */
+static void
+connection_flush_batch (Connection *connection)
+{
+  /* File descriptors go right away, as they are mostly blobs, which the
+   * ring of the other side waits for. Errors show up as G_IO_HUP or
+   * G_IO_ERR, and are handled from there */
+  if (connection->output->len >= BATCH_SIZE ||
+      connection->output_fds->len > 0 ||
+      g_get_monotonic_time () - connection->last_write >= BATCH_DELAY)
+    connection_flush (connection);
+  else if (g_source_get_ready_time (connection->source) == -1)
+    g_source_set_ready_time (connection->source, connection->last_write + BATCH_DELAY);
+}
+
+/* Queues a frame with a body of @size bytes, along with @n_fds file
+ * descriptors which are closed once sent, and returns where its body goes.
+ * Must be called with the lock held, and followed by
+ * connection_flush_batch() */
+static guint8 *
+connection_append_frame (Connection *connection,
+                         FrameType type,
+                         gsize size,
+                         const gint *fds,
+                         guint n_fds)
+{
+  FrameHeader header;
+  guint offset = connection->output->len;
+  guint i;
+
+  for (i = 0; i < n_fds; i++)
+    {
+      OutputFd output_fd = { offset, fds[i], 0 };
+
+      g_array_append_val (connection->output_fds, output_fd);
+    }
+
+  header.size = sizeof (header) + size;
+  header.type = type;
+  g_byte_array_set_size (connection->output, offset + header.size);
+  memcpy (connection->output->data + offset, &header, sizeof (header));
+
+  return connection->output->data + offset + sizeof (header);
+}
+
+/* Queues a frame made of @n_parts parts, along with @n_fds file
+ * descriptors which are closed once sent. Must be called with the lock
+ * held */
+static void
+connection_send_frame_with_fds (Connection *connection,
+                                FrameType type,
+                                const GBytes **parts,
+                                guint n_parts,
+                                const gint *fds,
+                                guint n_fds)
+{
+  guint8 *body;
+  gsize size = 0;
+  guint i;
+
+  for (i = 0; i < n_parts; i++)
+    {
+      size += g_bytes_get_size ((GBytes *) parts[i]);
+    }
+
+  body = connection_append_frame (connection, type, size, fds, n_fds);
+  for (i = 0; i < n_parts; i++)
+    {
+      gconstpointer data = g_bytes_get_data ((GBytes *) parts[i], &size);
+
+      memcpy (body, data, size);
+      body += size;
+    }
+
+  connection_flush_batch (connection);
+}
+
+static void
+connection_send_frame (Connection *connection, FrameType type, const GBytes **parts, guint n_parts)
+{
+  connection_send_frame_with_fds (connection, type, parts, n_parts, NULL, 0);
+}
+
+/* Sends a frame whose body is a nul-terminated string */
+static void
+connection_send_string (Connection *connection, FrameType type, const gchar *string)
+{
+  GBytes *body = g_bytes_new_static (string, strlen (string) + 1);
+
+  connection_send_frame (connection, type, (const GBytes **) &body, 1);
+  g_bytes_unref (body);
+}
+
+/* Tells the other side what we listen to. Must be called with the lock
+ * held */
+static void
+connection_send_interests (Connection *connection)
+{
+  GHashTableIter iter;
+  const gchar *pattern;
+
+  g_hash_table_iter_init (&iter, connection->message_center->priv->interests);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &pattern, NULL))
+    {
+      connection_send_string (connection, FRAME_SUBSCRIBE, pattern);
+    }
+}
+
+static void
+route_match_cb (gpointer value, gpointer user_data)
+{
+  gboolean *wanted = user_data;
+
+  *wanted = TRUE;
+}
+
+/* Whether the other side listens to messages named @message_name. Must be
+ * called with the lock held */
+static gboolean
+connection_wants (Connection *connection, GQuark message_name)
+{
+  gpointer route = g_hash_table_lookup (connection->routes, GUINT_TO_POINTER (message_name));
+
+  if (route == NULL)
+    {
+      gboolean wanted = FALSE;
+
+      g_topic_trie_match (connection->interests, g_quark_to_string (message_name), route_match_cb, &wanted);
+      route = wanted ? ROUTE_WANTED : ROUTE_UNWANTED;
+      g_hash_table_insert (connection->routes, GUINT_TO_POINTER (message_name), route);
+    }
+
+  return route == ROUTE_WANTED;
+}
+
+/* Must be called with the lock held */
+static Connection *
+g_distributed_message_center_find_peer (GDistributedMessageCenter *message_center,
+                                        const gchar *address,
+                                        Connection *except)
+{
+  guint i;
+
+  for (i = 0; i < message_center->priv->connections->len; i++)
+    {
+      Connection *connection = g_ptr_array_index (message_center->priv->connections, i);
+
+      if (connection != except &&
+          connection->kind == CONNECTION_PEER &&
+          g_strcmp0 (connection->address, address) == 0)
+        return connection;
+    }
+
+  return NULL;
+}
+
+/* Connects to the processes listening at @addresses, if not connected
+ * already. Must be called with the lock held */
+static void
+g_distributed_message_center_connect_peers (GDistributedMessageCenter *message_center,
+                                            const gchar *addresses,
+                                            gsize length)
+{
+  GDistributedMessageCenterPrivate *priv = message_center->priv;
+  const gchar *address = addresses;
+
+  while (address < addresses + length)
+    {
+      if (strcmp (address, priv->address) != 0 &&
+          g_distributed_message_center_find_peer (message_center, address, NULL) == NULL)
+        {
+          gint fd = socket_connect (address, NULL);
+
+          /* Processes which went away in the meantime are just skipped */
+          if (fd >= 0)
+            {
+              Connection *peer = g_distributed_message_center_add_connection (message_center,
+                                                                              CONNECTION_PEER,
+                                                                              fd,
+                                                                              address,
+                                                                              TRUE);
+              connection_send_string (peer, FRAME_HELLO, priv->address);
+              connection_send_interests (peer);
+            }
+        }
+      address += strlen (address) + 1;
+    }
+}
+
+/* Answers a process registering with the addresses of the other ones.
+ * Must be called with the lock held */
+static void
+g_distributed_message_center_send_peers (GDistributedMessageCenter *message_center, Connection *member)
+{
+  GDistributedMessageCenterPrivate *priv = message_center->priv;
+  GString *addresses = g_string_new (NULL);
+  GBytes *body;
+  guint i;
+
+  g_string_append_len (addresses, priv->address, strlen (priv->address) + 1);
+  for (i = 0; i < priv->connections->len; i++)
+    {
+      Connection *connection = g_ptr_array_index (priv->connections, i);
+
+      if (connection != member && connection->kind == CONNECTION_MEMBER && connection->address != NULL)
+        g_string_append_len (addresses, connection->address, strlen (connection->address) + 1);
+    }
+
+  body = g_bytes_new_take (addresses->str, addresses->len);
+  g_string_free (addresses, FALSE);
+  connection_send_frame (member, FRAME_PEERS, (const GBytes **) &body, 1);
+  g_bytes_unref (body);
+}
+
+/* Where received messages keep the UUID of the process they come from */
+static GQuark
+message_origin_quark (void)
+{
+  static GQuark quark = 0;
+
+  if (G_UNLIKELY (quark == 0))
+    quark = g_quark_from_static_string ("g-distributed-message-center-origin");
+
+  return quark;
+}
+
+/* Decodes the message in @body, received on @connection through the
+ * channel of @table. See g_message_wire_decode() for @owner and @blob.
+ * Must be called with the lock held */
+static GMessage *
+connection_decode_message (Connection *connection,
+                           GMessageWireTable *table,
+                           const guint8 *body,
+                           gsize size,
+                           GBytes *owner,
+                           GBytes *blob)
+{
+  GMessage *message;
+  GVariant *payload;
+  guint8 sender[G_MESSAGE_WIRE_UUID_SIZE];
+  GQuark name;
+
+  if (!g_message_wire_decode (table, body, size, owner, blob, &name, &payload, sender))
+    return NULL;
+
+  if (connection->origin == NULL || memcmp (connection->origin_uuid, sender, G_MESSAGE_WIRE_UUID_SIZE) != 0)
+    {
+      gchar *origin = g_message_wire_uuid_to_string (sender);
+
+      memcpy (connection->origin_uuid, sender, G_MESSAGE_WIRE_UUID_SIZE);
+      connection->origin = g_intern_string (origin);
+      g_free (origin);
+    }
+
+  if (payload != NULL)
+    message = g_message_new_with_payload (G_OBJECT (connection->message_center), g_quark_to_string (name), payload);
+  else
+    message = g_message_new_quark (G_OBJECT (connection->message_center), name, NULL);
+  g_object_set_qdata (G_OBJECT (message), message_origin_quark (), (gpointer) connection->origin);
+
+  return message;
+}
+
+/* Sends a message through the socket of @connection. Must be called with
+ * the lock held */
+static void
+connection_send_message_frame (Connection *connection, GQuark name, GVariant *payload)
+{
+  gsize size = g_message_wire_get_size (connection->out_topics, name, payload, TRUE);
+  guint8 *body;
+
+  if (size == 0 || sizeof (FrameHeader) + size > MAX_FRAME_SIZE)
+    {
+      g_warning ("Could not send message %s: too big", g_quark_to_string (name));
+      return;
+    }
+
+  body = connection_append_frame (connection, FRAME_MESSAGE, size, NULL, 0);
+  g_message_wire_encode (connection->out_topics,
+                         connection->message_center->priv->uuid,
+                         name,
+                         payload,
+                         TRUE,
+                         body);
+  connection_flush_batch (connection);
+}
+
+/* Writes @payload in a sealed memfd, so that the other side can map it
+ * without fearing it changes. Returns -1 on error */
+static gint
+blob_new (GVariant *payload)
+{
+  gsize size = g_variant_get_size (payload);
+  gpointer map;
+  gint fd;
+
+  fd = memfd_create ("gpattern-message-blob", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return -1;
+
+  if (ftruncate (fd, size) < 0 ||
+      (map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+      close (fd);
+      return -1;
+    }
+  g_variant_store (payload, map);
+  munmap (map, size);
+
+  if (fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+    {
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+/* Maps a blob written with blob_new(), and takes ownership of @fd */
+static GBytes *
+blob_map (gint fd)
+{
+  GMappedFile *mapped_file = NULL;
+  GBytes *bytes = NULL;
+  gint seals = fcntl (fd, F_GET_SEALS);
+
+  if (seals >= 0 && (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) == (F_SEAL_SHRINK | F_SEAL_WRITE))
+    mapped_file = g_mapped_file_new_from_fd (fd, FALSE, NULL);
+  close (fd);
+
+  if (mapped_file != NULL)
+    {
+      bytes = g_mapped_file_get_bytes (mapped_file);
+      g_mapped_file_unref (mapped_file);
+    }
+
+  return bytes;
+}
+
+/* Returns the memory a message waiting to be sent takes */
+static gsize
+pending_message_size (GVariant *payload)
+{
+  return payload != NULL ? g_variant_get_size (payload) : 0;
+}
+
+/* Returns the memory taken by what waits to be sent to the other side of
+ * @connection. Must be called with the lock held */
+static gsize
+connection_get_buffered (Connection *connection)
+{
+  return connection->pending_size + connection->output->len + connection->output_blobs_size;
+}
+
+/* Writes the message in the ring of @connection, or in a blob if it is too
+ * big, or in the socket if there is no ring yet. Must be called with the
+ * lock held. Returns FALSE if there is no space for it */
+static gboolean
+connection_write_message (Connection *connection, GQuark name, GVariant *payload)
+{
+  GMessageRing *ring = connection->out_ring;
+  const guint8 *uuid = connection->message_center->priv->uuid;
+  FrameHeader *header;
+  gsize size;
+
+  /* Until the ring is there, messages go through the socket, as long as
+   * the other side keeps up */
+  if (ring == NULL)
+    {
+      if (connection->output->len > 0 &&
+          connection->output->len + pending_message_size (payload) > connection->message_center->priv->peer_buffer_limit)
+        return FALSE;
+
+      connection_send_message_frame (connection, name, payload);
+      return TRUE;
+    }
+
+  size = g_message_wire_get_size (connection->out_ring_topics, name, payload, TRUE);
+  if (size == 0)
+    {
+      g_warning ("Could not send message %s: name too long", g_quark_to_string (name));
+      return TRUE;
+    }
+  size += sizeof (FrameHeader);
+
+  if (size > MIN (RING_MAX_RECORD, g_message_ring_get_max_record (ring)))
+    {
+      gsize output_size = connection->output->len + connection->output_blobs_size;
+      gsize blob_size = pending_message_size (payload);
+      guint8 *body;
+      gint fd;
+
+      /* Blobs only take a marker in the ring, so what limits them is the
+       * socket output, in memory and in file descriptors */
+      if (connection->output_fds->len >= MAX_OUTPUT_FDS ||
+          (output_size > 0 && output_size + blob_size > connection->message_center->priv->peer_buffer_limit))
+        return FALSE;
+
+      /* Only a marker goes in the ring, with the payload in a blob, which
+       * the other side keeps until it finds the marker */
+      header = g_message_ring_reserve (ring, sizeof (FrameHeader));
+      if (header == NULL)
+        return FALSE;
+
+      fd = blob_new (payload);
+      if (fd < 0)
+        {
+          g_warning ("Could not send message %s: %s", g_quark_to_string (name), g_strerror (errno));
+          return TRUE;
+        }
+      body = connection_append_frame (connection,
+                                      FRAME_BLOB,
+                                      g_message_wire_get_size (connection->out_topics, name, payload, FALSE),
+                                      &fd,
+                                      1);
+      g_array_index (connection->output_fds, OutputFd, connection->output_fds->len - 1).size = blob_size;
+      connection->output_blobs_size += blob_size;
+      g_message_wire_encode (connection->out_topics, uuid, name, payload, FALSE, body);
+      connection_flush_batch (connection);
+
+      header->size = sizeof (FrameHeader);
+      header->type = FRAME_BLOB;
+      g_message_ring_commit (ring);
+      return TRUE;
+    }
+
+  header = g_message_ring_reserve (ring, size);
+  if (header == NULL)
+    return FALSE;
+
+  header->size = size;
+  header->type = FRAME_MESSAGE;
+  /* Written once, straight into the shared memory */
+  g_message_wire_encode (connection->out_ring_topics, uuid, name, payload, TRUE, header + 1);
+  g_message_ring_commit (ring);
+
+  return TRUE;
+}
+
+/* Writes the payload of @pending to the spill file, which is created as
+ * needed. Must be called with the lock held */
+static gboolean
+connection_spill (Connection *connection, PendingMessage *pending, GVariant *payload)
+{
+  const guint8 *data;
+  gsize written = 0;
+
+  if (connection->spill_fd < 0)
+    {
+      gchar *path;
+
+      /* Only reachable through the file descriptor */
+      connection->spill_fd = g_file_open_tmp ("gpattern-spill-XXXXXX", &path, NULL);
+      if (connection->spill_fd < 0)
+        return FALSE;
+      unlink (path);
+      g_free (path);
+    }
+
+  pending->spilled = TRUE;
+  pending->spill_offset = connection->spill_end;
+  if (payload == NULL)
+    return TRUE;
+
+  pending->type = g_quark_from_string (g_variant_get_type_string (payload));
+  pending->spill_size = g_variant_get_size (payload);
+  data = g_variant_get_data (payload);
+  while (written < pending->spill_size)
+    {
+      gssize n = pwrite (connection->spill_fd,
+                         data + written,
+                         pending->spill_size - written,
+                         pending->spill_offset + written);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return FALSE;
+      written += n;
+    }
+  connection->spill_end += pending->spill_size;
+
+  return TRUE;
+}
+
+/* Reads back the payload of @pending from the spill file, which is emptied
+ * once nothing pending is there. Must be called with the lock held */
+static gboolean
+connection_unspill (Connection *connection, PendingMessage *pending)
+{
+  gboolean success = TRUE;
+
+  if (pending->type != 0)
+    {
+      guint8 *data = g_malloc (pending->spill_size);
+      gsize read_size = 0;
+
+      while (read_size < pending->spill_size)
+        {
+          gssize n = pread (connection->spill_fd,
+                            data + read_size,
+                            pending->spill_size - read_size,
+                            pending->spill_offset + read_size);
+
+          if (n < 0 && errno == EINTR)
+            continue;
+          if (n <= 0)
+            break;
+          read_size += n;
+        }
+
+      if (read_size == pending->spill_size)
+        {
+          pending->payload = g_variant_ref_sink (g_variant_new_from_data (G_VARIANT_TYPE (g_quark_to_string (pending->type)),
+                                                                          data,
+                                                                          pending->spill_size,
+                                                                          FALSE,
+                                                                          g_free,
+                                                                          data));
+          connection->pending_size += pending_message_size (pending->payload);
+        }
+      else
+        {
+          g_free (data);
+          success = FALSE;
+        }
+    }
+
+  pending->spilled = FALSE;
+  if (--connection->n_spilled_pending == 0)
+    {
+      connection->spill_end = 0;
+      if (ftruncate (connection->spill_fd, 0) < 0)
+        g_debug ("Could not truncate spill file: %s", g_strerror (errno));
+    }
+
+  return success;
+}
+
+/* Keeps a message which doesn't fit in the ring yet, as long as the limit
+ * allows it, or applies the flow control policy. Must be called with the
+ * lock held */
+static void
+connection_buffer_message (Connection *connection, GQuark name, GVariant *payload)
+{
+  GDistributedMessageCenterPrivate *priv = connection->message_center->priv;
+  gsize size = pending_message_size (payload);
+  PendingMessage *pending;
+  gboolean over_limit;
+
+  /* Senders blocked until there was space, unless the message is too big
+   * on its own, in which case it goes alone */
+  over_limit = connection_get_buffered (connection) + size > priv->peer_buffer_limit;
+  if (priv->flow_policy == G_DISTRIBUTED_MESSAGE_CENTER_FLOW_BLOCK)
+    over_limit = connection->hung_up;
+
+  /* Only what goes through the ring is kept, not the message, as
+   * releasing its sender with the lock held is not an option */
+  pending = g_new0 (PendingMessage, 1);
+  pending->name = name;
+
+  if (!over_limit)
+    {
+      pending->payload = payload != NULL ? g_variant_ref (payload) : NULL;
+      connection->pending_size += size;
+    }
+  else if (priv->flow_policy == G_DISTRIBUTED_MESSAGE_CENTER_FLOW_SPILL &&
+           connection_spill (connection, pending, payload))
+    {
+      connection->n_spilled_pending++;
+      connection->n_spilled++;
+    }
+  else
+    {
+      connection->n_dropped++;
+      g_free (pending);
+      return;
+    }
+
+  g_queue_push_tail (&connection->pending, pending);
+}
+
+/* Sends a message to the other side of @connection, through its ring if it
+ * has one. Must be called with the lock held */
+static void
+connection_send_message (Connection *connection, GQuark name, GVariant *payload)
+{
+  /* Messages waiting for space go first */
+  if (g_queue_is_empty (&connection->pending) && connection_write_message (connection, name, payload))
+    return;
+
+  connection_buffer_message (connection, name, payload);
+}
+
+/* Writes the messages waiting for space, as long as there is space. Must
+ * be called with the lock held */
+static void
+connection_flush_pending (Connection *connection)
+{
+  PendingMessage *pending;
+
+  while ((pending = g_queue_peek_head (&connection->pending)) != NULL)
+    {
+      if (pending->spilled && !connection_unspill (connection, pending))
+        {
+          g_warning ("Could not read back spilled message %s: %s",
+                     g_quark_to_string (pending->name),
+                     g_strerror (errno));
+          connection->n_dropped++;
+        }
+      else if (!connection_write_message (connection, pending->name, pending->payload))
+        {
+          break;
+        }
+
+      g_queue_pop_head (&connection->pending);
+      connection->pending_size -= pending_message_size (pending->payload);
+      pending_message_free (pending);
+    }
+}
+
+/* Delivers a message received on @connection. Must be called with the lock
+ * held, which is released meanwhile as filters might send messages
+ * themselves */
+static void
+connection_deliver (Connection *connection, GMessage *message)
 {
-};
+  GDistributedMessageCenter *message_center = connection->message_center;
+
+  g_mutex_unlock (&message_center->priv->lock);
+  g_message_center_send (G_MESSAGE_CENTER (message_center), message);
+  g_object_unref (message);
+  g_mutex_lock (&message_center->priv->lock);
+}
+
+/* Delivers the messages in the ring from the other side, in order with
+ * the blobs. Must be called with the lock held. Returns FALSE on protocol
+ * errors */
+static gboolean
+connection_read_ring (Connection *connection)
+{
+  guint n_messages = 0;
+
+  while (!connection->waiting_blob)
+    {
+      GMessage *message = NULL;
+      GBytes *record;
+      const guint8 *data;
+      FrameHeader header;
+      gsize size;
+
+      if (n_messages++ == RING_BATCH)
+        {
+          g_message_ring_wakeup (connection->in_ring);
+          break;
+        }
+
+      if (!g_message_ring_read (connection->in_ring, &record))
+        return FALSE;
+      if (record == NULL)
+        break;
+
+      data = g_bytes_get_data (record, &size);
+      if (size >= sizeof (header))
+        memcpy (&header, data, sizeof (header));
+      if (size < sizeof (header) || header.size != size)
+        {
+          g_bytes_unref (record);
+          return FALSE;
+        }
+
+      if (header.type == FRAME_MESSAGE)
+        {
+          /* The payload is copied, so that the record can be released */
+          message = connection_decode_message (connection,
+                                               connection->in_ring_topics,
+                                               data + sizeof (header),
+                                               size - sizeof (header),
+                                               NULL,
+                                               NULL);
+          g_bytes_unref (record);
+          if (message == NULL)
+            return FALSE;
+        }
+      else if (header.type == FRAME_BLOB && size == sizeof (header))
+        {
+          g_bytes_unref (record);
+          message = g_queue_pop_head (&connection->blobs);
+          if (message == NULL)
+            connection->waiting_blob = TRUE;
+        }
+      else
+        {
+          g_bytes_unref (record);
+          return FALSE;
+        }
+
+      if (message != NULL)
+        connection_deliver (connection, message);
+    }
+
+  return TRUE;
+}
+
+static gboolean
+connection_ring_dispatch (gpointer user_data, GIOCondition condition)
+{
+  Connection *connection = user_data;
+  GDistributedMessageCenter *message_center = g_object_ref (connection->message_center);
+  GDistributedMessageCenterPrivate *priv = message_center->priv;
+  gint memfd, data_fd, space_fd;
+
+  g_mutex_lock (&priv->lock);
+
+  /* The same function handles free space in our ring, and new messages in
+   * the ring of the other side, which are told apart by the source */
+  if (g_main_current_source () == connection->out_ring_source)
+    {
+      g_message_ring_get_fds (connection->out_ring, &memfd, &data_fd, &space_fd);
+      g_message_ring_clear_event (space_fd);
+      connection_flush_pending (connection);
+    }
+  else
+    {
+      g_message_ring_get_fds (connection->in_ring, &memfd, &data_fd, &space_fd);
+      g_message_ring_clear_event (data_fd);
+      if (!connection_read_ring (connection) && g_ptr_array_find (priv->connections, connection, NULL))
+        g_distributed_message_center_remove_connection (message_center, connection);
+    }
+
+  g_mutex_unlock (&priv->lock);
+  g_object_unref (message_center);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Creates the ring messages to the other side go through, and passes it
+ * to it. Must be called with the lock held */
+static void
+connection_start_ring (Connection *connection)
+{
+  GError *error = NULL;
+  gint fds[3];
+  guint i;
+
+  connection->out_ring = g_message_ring_new (RING_SIZE, &error);
+  if (connection->out_ring == NULL)
+    {
+      /* Messages keep going through the socket */
+      g_debug ("%s", error->message);
+      g_error_free (error);
+      return;
+    }
+
+  g_message_ring_get_fds (connection->out_ring, &fds[0], &fds[1], &fds[2]);
+  connection->out_ring_source = fd_source_new (fds[2],
+                                               connection_ring_dispatch,
+                                               connection,
+                                               connection->message_center->priv->context);
+
+  /* The ring keeps its own file descriptors */
+  for (i = 0; i < G_N_ELEMENTS (fds); i++)
+    {
+      fds[i] = fcntl (fds[i], F_DUPFD_CLOEXEC, 0);
+    }
+  if (fds[0] < 0 || fds[1] < 0 || fds[2] < 0)
+    {
+      for (i = 0; i < G_N_ELEMENTS (fds); i++)
+        {
+          if (fds[i] >= 0)
+            close (fds[i]);
+        }
+      g_clear_pointer (&connection->out_ring_source, destroy_source);
+      g_clear_pointer (&connection->out_ring, g_message_ring_unref);
+      return;
+    }
+
+  connection_send_frame_with_fds (connection, FRAME_RING, NULL, 0, fds, G_N_ELEMENTS (fds));
+
+  /* Messages which waited for the socket go through the ring from now on */
+  connection_flush_pending (connection);
+}
+
+/* Attaches to the ring of the other side. Must be called with the lock
+ * held */
+static gboolean
+connection_attach_ring (Connection *connection)
+{
+  gint fds[3];
+  guint i;
+
+  if (connection->kind != CONNECTION_PEER ||
+      connection->in_ring != NULL ||
+      g_queue_get_length (&connection->fds) < G_N_ELEMENTS (fds))
+    return FALSE;
+
+  for (i = 0; i < G_N_ELEMENTS (fds); i++)
+    {
+      fds[i] = GPOINTER_TO_INT (g_queue_pop_head (&connection->fds));
+    }
+  connection->in_ring = g_message_ring_attach (fds[0], fds[1], fds[2], NULL);
+  if (connection->in_ring == NULL)
+    return FALSE;
+
+  connection->in_ring_source = fd_source_new (fds[1],
+                                              connection_ring_dispatch,
+                                              connection,
+                                              connection->message_center->priv->context);
+
+  /* When the other side connected to us, it waited for our ring */
+  if (connection->out_ring == NULL)
+    connection_start_ring (connection);
+
+  return connection_read_ring (connection);
+}
+
+/* Handles a frame. Returns FALSE on protocol errors, or if the connection
+ * was closed. Must be called with the lock held, and might release it */
+static gboolean
+connection_handle_frame (Connection *connection, FrameType type, const guint8 *body, gsize size)
+{
+  GDistributedMessageCenter *message_center = connection->message_center;
+  GDistributedMessageCenterPrivate *priv = message_center->priv;
+  GMessage *message;
+  GBytes *blob;
+
+  /* Addresses are nul-terminated strings */
+  if ((type == FRAME_HELLO || type == FRAME_REGISTER || type == FRAME_PEERS ||
+       type == FRAME_SUBSCRIBE || type == FRAME_UNSUBSCRIBE) &&
+      (size == 0 || body[size - 1] != '\0'))
+    return FALSE;
+
+  switch (type)
+    {
+    case FRAME_HELLO:
+      if (connection->kind != CONNECTION_PEER || connection->address != NULL)
+        return FALSE;
+      connection->address = g_strdup ((const gchar *) body);
+      {
+        Connection *other = g_distributed_message_center_find_peer (message_center, connection->address, connection);
+
+        /* Both processes connected to each other at the same time, keep
+         * the connection made by the one with the smallest address, which
+         * both of them pick the same */
+        if (other != NULL)
+          {
+            if (strcmp (connection->address, priv->address) < 0)
+              {
+                g_distributed_message_center_remove_connection (message_center, other);
+              }
+            else
+              {
+                g_distributed_message_center_remove_connection (message_center, connection);
+                return FALSE;
+              }
+          }
+      }
+      connection_send_interests (connection);
+      connection_start_ring (connection);
+      return TRUE;
+
+    case FRAME_MESSAGE:
+      if (connection->kind != CONNECTION_PEER)
+        return FALSE;
+      message = connection_decode_message (connection, connection->in_topics, body, size, NULL, NULL);
+      if (message == NULL)
+        return FALSE;
+      connection_deliver (connection, message);
+      return TRUE;
+
+    case FRAME_REGISTER:
+      if (connection->kind != CONNECTION_MEMBER || connection->address != NULL)
+        return FALSE;
+      connection->address = g_strdup ((const gchar *) body);
+      g_distributed_message_center_send_peers (message_center, connection);
+      return TRUE;
+
+    case FRAME_PEERS:
+      if (connection->kind != CONNECTION_RENDEZVOUS)
+        return FALSE;
+      g_distributed_message_center_connect_peers (message_center, (const gchar *) body, size);
+      return TRUE;
+
+    case FRAME_RING:
+      return connection_attach_ring (connection);
+
+    case FRAME_BLOB:
+      if (connection->in_ring == NULL || g_queue_is_empty (&connection->fds))
+        return FALSE;
+      blob = blob_map (GPOINTER_TO_INT (g_queue_pop_head (&connection->fds)));
+      if (blob == NULL)
+        return FALSE;
+      message = connection_decode_message (connection, connection->in_topics, body, size, NULL, blob);
+      g_bytes_unref (blob);
+      if (message == NULL)
+        return FALSE;
+
+      /* The ring waits for it, or it waits for its marker */
+      if (connection->waiting_blob)
+        {
+          connection->waiting_blob = FALSE;
+          connection_deliver (connection, message);
+          return connection_read_ring (connection);
+        }
+      g_queue_push_tail (&connection->blobs, message);
+      return TRUE;
+
+    case FRAME_SUBSCRIBE:
+    case FRAME_UNSUBSCRIBE:
+      if (connection->kind != CONNECTION_PEER)
+        return FALSE;
+      if (type == FRAME_SUBSCRIBE)
+        g_topic_trie_insert (connection->interests, (const gchar *) body, ROUTE_WANTED);
+      else
+        g_topic_trie_remove (connection->interests, (const gchar *) body);
+      g_hash_table_remove_all (connection->routes);
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Reads what is available, and handles the complete frames. Must be called
+ * with the lock held. Returns FALSE if the connection is to be closed */
+static gboolean
+connection_read (Connection *connection)
+{
+  GByteArray *input = connection->input;
+  gboolean closed = FALSE;
+  gsize offset = 0;
+  gboolean ret = TRUE;
+
+  for (;;)
+    {
+      union {
+        struct cmsghdr header;
+        gchar buffer[CMSG_SPACE (sizeof (gint) * 4)];
+      } control;
+      struct iovec iov;
+      struct msghdr msg = { 0, };
+      struct cmsghdr *cmsg;
+      guint len = input->len;
+      gssize n_read;
+
+      g_byte_array_set_size (input, len + READ_CHUNK_SIZE);
+      iov.iov_base = input->data + len;
+      iov.iov_len = READ_CHUNK_SIZE;
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control.buffer;
+      msg.msg_controllen = sizeof (control.buffer);
+      n_read = recvmsg (connection->fd, &msg, MSG_CMSG_CLOEXEC);
+      g_byte_array_set_size (input, len + MAX (n_read, 0));
+
+      if (n_read == 0)
+        {
+          /* Still handle what came before */
+          closed = TRUE;
+          break;
+        }
+      if (n_read < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+          return FALSE;
+        }
+
+      for (cmsg = CMSG_FIRSTHDR (&msg); cmsg != NULL; cmsg = CMSG_NXTHDR (&msg, cmsg))
+        {
+          if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            {
+              guint i, n_fds = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (gint);
+
+              for (i = 0; i < n_fds; i++)
+                {
+                  g_queue_push_tail (&connection->fds, GINT_TO_POINTER (((gint *) CMSG_DATA (cmsg))[i]));
+                }
+            }
+        }
+    }
+
+  /* The input buffer is only touched from this thread, so it is safe to
+   * use it while the lock is released to deliver messages */
+  while (ret && input->len - offset >= sizeof (FrameHeader))
+    {
+      FrameHeader header;
 
-G_DEFINE_TYPE (GDistributedMessageCenter, g_distributed_message_center, G_TYPE_MESSAGE_CENTER);
+      memcpy (&header, input->data + offset, sizeof (header));
+      if (header.size < sizeof (header) || header.size > MAX_FRAME_SIZE)
+        return FALSE;
+      if (input->len - offset < header.size)
+        break;
+
+      ret = connection_handle_frame (connection,
+                                     header.type,
+                                     input->data + offset + sizeof (header),
+                                     header.size - sizeof (header));
+      offset += header.size;
+    }
+
+  if (ret)
+    g_byte_array_remove_range (input, 0, offset);
+
+  return ret && !closed;
+}
+
+static gboolean
+rejoin_cb (gpointer user_data)
+{
+  GDistributedMessageCenter *message_center = user_data;
+
+  g_mutex_lock (&message_center->priv->lock);
+  g_clear_pointer (&message_center->priv->rejoin_source, g_source_unref);
+  g_mutex_unlock (&message_center->priv->lock);
+
+  g_distributed_message_center_join (message_center);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Must be called with the lock held */
+static void
+g_distributed_message_center_schedule_rejoin (GDistributedMessageCenter *message_center)
+{
+  GDistributedMessageCenterPrivate *priv = message_center->priv;
+
+  if (priv->rejoin_source != NULL)
+    return;
+
+  priv->rejoin_source = g_timeout_source_new (REJOIN_DELAY);
+  g_source_set_callback (priv->rejoin_source, rejoin_cb, message_center, NULL);
+  g_source_attach (priv->rejoin_source, priv->context);
+}
+
+static gboolean
+connection_dispatch (gpointer user_data, GIOCondition condition)
+{
+  Connection *connection = user_data;
+  GDistributedMessageCenter *message_center = g_object_ref (connection->message_center);
+  GDistributedMessageCenterPrivate *priv = message_center->priv;
+  gboolean alive = TRUE;
+
+  g_mutex_lock (&priv->lock);
+
+  /* The socket takes more, or a batch is complete */
+  if ((condition & G_IO_OUT) || g_source_get_ready_time (connection->source) != -1)
+    {
+      alive = connection_flush (connection);
+      /* Messages wait for the socket before the ring is there, and blobs
+       * always do */
+      if (alive)
+        connection_flush_pending (connection);
+    }
+  /* Read even on G_IO_HUP, to get what was sent before */
+  if (alive && (condition & (G_IO_IN | G_IO_HUP | G_IO_ERR)))
+    alive = connection_read (connection);
+
+  /* Frames might have closed it already, then it is not in the list */
+  if (!alive && g_ptr_array_find (priv->connections, connection, NULL))
+    {
+      /* The owner of the rendezvous socket went away */
+      if (connection->kind == CONNECTION_RENDEZVOUS)
+        g_distributed_message_center_schedule_rejoin (message_center);
+
+      g_distributed_message_center_remove_connection (message_center, connection);
+    }
+
+  g_mutex_unlock (&priv->lock);
+  g_object_unref (message_center);
+
+  /* The source is destroyed along with the connection */
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+listener_dispatch (gpointer user_data, GIOCondition condition)
+{
+  GDistributedMessageCenter *message_center = user_data;
+  GDistributedMessageCenterPrivate *priv = message_center->priv;
+  gboolean is_rendezvous;
+  gint listen_fd, fd;
+
+  g_mutex_lock (&priv->lock);
+
+  /* The same function accepts peers on our socket, and members on the
+   * rendezvous socket, which are told apart by the source */
+  is_rendezvous = priv->rendezvous_source != NULL && g_main_current_source () == priv->rendezvous_source;
+  listen_fd = is_rendezvous ? priv->rendezvous_fd : priv->listen_fd;
+
+  while ((fd = accept (listen_fd, NULL, NULL)) >= 0)
+    {
+      fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+      fcntl (fd, F_SETFD, FD_CLOEXEC);
+      g_distributed_message_center_add_connection (message_center,
+                                                   is_rendezvous ? CONNECTION_MEMBER : CONNECTION_PEER,
+                                                   fd,
+                                                   NULL,
+                                                   FALSE);
+    }
+
+  g_mutex_unlock (&priv->lock);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Registers with the owner of the rendezvous socket, or becomes it */
+static void
+g_distributed_message_center_join (GDistributedMessageCenter *message_center)
+{
+  GDistributedMessageCenterPrivate *priv = message_center->priv;
+  gchar *lock_path, *rendezvous_path;
+  gint fd;
+
+  lock_path = g_build_filename (priv->directory, RENDEZVOUS_LOCK, NULL);
+  rendezvous_path = g_build_filename (priv->directory, RENDEZVOUS_SOCKET, NULL);
+
+  g_mutex_lock (&priv->lock);
+
+  fd = open (lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd >= 0 && flock (fd, LOCK_EX | LOCK_NB) == 0)
+    {
+      GError *error = NULL;
+
+      /* The socket of a previous owner might still be there */
+      unlink (rendezvous_path);
+      priv->rendezvous_fd = socket_listen (rendezvous_path, &error);
+      if (priv->rendezvous_fd >= 0)
+        {
+          priv->lock_fd = fd;
+          priv->rendezvous_source = fd_source_new (priv->rendezvous_fd, listener_dispatch, message_center, priv->context);
+        }
+      else
+        {
+          g_warning ("%s", error->message);
+          g_error_free (error);
+          close (fd);
+        }
+    }
+  else
+    {
+      if (fd >= 0)
+        close (fd);
+
+      fd = socket_connect (rendezvous_path, NULL);
+      if (fd >= 0)
+        {
+          Connection *rendezvous = g_distributed_message_center_add_connection (message_center,
+                                                                                CONNECTION_RENDEZVOUS,
+                                                                                fd,
+                                                                                NULL,
+                                                                                TRUE);
+          connection_send_string (rendezvous, FRAME_REGISTER, priv->address);
+        }
+      else
+        {
+          /* The owner is going away, or hasn't started listening yet */
+          g_distributed_message_center_schedule_rejoin (message_center);
+        }
+    }
+
+  g_mutex_unlock (&priv->lock);
+
+  g_free (rendezvous_path);
+  g_free (lock_path);
+}
+
+static void
+g_distributed_message_center_dispose (GObject *object)
+{
+  GDistributedMessageCenter *message_center = G_DISTRIBUTED_MESSAGE_CENTER (object);
+  GDistributedMessageCenterPrivate *priv = message_center->priv;
+
+  g_mutex_lock (&priv->lock);
+
+  while (priv->connections->len > 0)
+    {
+      g_distributed_message_center_remove_connection (message_center, g_ptr_array_index (priv->connections, 0));
+    }
+
+  if (priv->rejoin_source != NULL)
+    {
+      g_source_destroy (priv->rejoin_source);
+      g_clear_pointer (&priv->rejoin_source, g_source_unref);
+    }
+
+  if (priv->listen_source != NULL)
+    {
+      g_source_destroy (priv->listen_source);
+      g_clear_pointer (&priv->listen_source, g_source_unref);
+      close (priv->listen_fd);
+      unlink (priv->address);
+    }
+
+  /* Give up the rendezvous socket, removing it before releasing the lock
+   * so that the next owner doesn't remove its own */
+  if (priv->rendezvous_source != NULL)
+    {
+      gchar *rendezvous_path = g_build_filename (priv->directory, RENDEZVOUS_SOCKET, NULL);
+
+      g_source_destroy (priv->rendezvous_source);
+      g_clear_pointer (&priv->rendezvous_source, g_source_unref);
+      close (priv->rendezvous_fd);
+      unlink (rendezvous_path);
+      close (priv->lock_fd);
+      g_free (rendezvous_path);
+    }
+
+  g_mutex_unlock (&priv->lock);
+
+  G_OBJECT_CLASS (g_distributed_message_center_parent_class)->dispose (object);
+}
 
 static void
 g_distributed_message_center_finalize (GObject *object)
 {
+  GDistributedMessageCenter *message_center = G_DISTRIBUTED_MESSAGE_CENTER (object);
+  GDistributedMessageCenterPrivate *priv = message_center->priv;
+
+  g_ptr_array_unref (priv->connections);
+  g_hash_table_unref (priv->interests);
+  g_free (priv->address);
+  g_free (priv->directory);
+  g_main_context_unref (priv->context);
+  g_mutex_clear (&priv->lock);
+
   G_OBJECT_CLASS (g_distributed_message_center_parent_class)->finalize (object);
 }
 
+/* Keeps track of the local filters for messages from other processes,
+ * which are sent by the distributed message center, and tells the peers
+ * when the first one for a given name or pattern is added, and when the
+ * last one is removed */
+static void
+g_distributed_message_center_filter_changed (GMessageCenter *center,
+                                             GObject *sender,
+                                             const gchar *message_name,
+                                             gboolean added)
+{
+  GDistributedMessageCenter *message_center = G_DISTRIBUTED_MESSAGE_CENTER (center);
+  GDistributedMessageCenterPrivate *priv = message_center->priv;
+  gchar *pattern;
+  gpointer key, value;
+  gint count = 0;
+
+  if (sender != NULL && sender != G_OBJECT (message_center))
+    return;
+
+  /* The tries of the peers don't tell apart patterns which only differ by
+   * repeated '#', so neither must the counts */
+  pattern = g_topic_normalize (message_name != NULL ? message_name : "#");
+
+  g_mutex_lock (&priv->lock);
+
+  if (g_hash_table_lookup_extended (priv->interests, pattern, &key, &value))
+    count = GPOINTER_TO_INT (value);
+  else
+    key = g_strdup (pattern);
+
+  /* Adding and removing a filter from different threads might be notified
+   * in any order, so the count can be negative for a while */
+  count += added ? 1 : -1;
+  if (count != 0)
+    g_hash_table_replace (priv->interests, key, GINT_TO_POINTER (count));
+  else
+    g_hash_table_remove (priv->interests, key);
+
+  if ((added && count == 1) || (!added && count == 0))
+    {
+      guint i;
+
+      for (i = 0; i < priv->connections->len; i++)
+        {
+          Connection *connection = g_ptr_array_index (priv->connections, i);
+
+          /* The others get all of them once they said hello */
+          if (connection->kind == CONNECTION_PEER && connection->address != NULL)
+            connection_send_string (connection, added ? FRAME_SUBSCRIBE : FRAME_UNSUBSCRIBE, pattern);
+        }
+    }
+
+  g_mutex_unlock (&priv->lock);
+
+  g_free (pattern);
+}
+
 static void
 g_distributed_message_center_class_init (GDistributedMessageCenterClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GMessageCenterClass *message_center_class = G_MESSAGE_CENTER_CLASS (klass);
 
+  object_class->dispose = g_distributed_message_center_dispose;
   object_class->finalize = g_distributed_message_center_finalize;
+  message_center_class->filter_changed = g_distributed_message_center_filter_changed;
 }
 
 static void
 g_distributed_message_center_init (GDistributedMessageCenter *message_center)
 {
+  gchar *uuid_string;
+
   message_center->priv = g_distributed_message_center_get_instance_private (message_center);
+  g_mutex_init (&message_center->priv->lock);
+  message_center->priv->context = g_main_context_ref_thread_default ();
+  message_center->priv->connections = g_ptr_array_new ();
+  message_center->priv->interests = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  message_center->priv->listen_fd = -1;
+  message_center->priv->lock_fd = -1;
+  message_center->priv->rendezvous_fd = -1;
+  message_center->priv->peer_buffer_limit = PEER_BUFFER_LIMIT;
+  message_center->priv->flow_policy = G_DISTRIBUTED_MESSAGE_CENTER_FLOW_DROP;
+
+  g_message_wire_uuid_generate (message_center->priv->uuid);
+  uuid_string = g_message_wire_uuid_to_string (message_center->priv->uuid);
+  message_center->priv->uuid_string = g_intern_string (uuid_string);
+  g_free (uuid_string);
+}
+
+/**
+ * g_distributed_message_center_new:
+ * @directory: the rendezvous directory
+ * @error: return location for a #GError, or %NULL
+ *
+ * Creates a distributed message center exchanging messages with the ones
+ * of the other processes using @directory, which is created if needed.
+ * Sockets are watched from the thread-default main context of the calling
+ * thread, which must be running for messages to be received.
+ *
+ * Returns: (transfer full): a new #GDistributedMessageCenter, or %NULL on
+ * error
+ */
+GDistributedMessageCenter *
+g_distributed_message_center_new (const gchar *directory, GError **error)
+{
+  GDistributedMessageCenter *message_center;
+  GDistributedMessageCenterPrivate *priv;
+  gchar *name;
+
+  g_return_val_if_fail (directory != NULL, NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  if (g_mkdir_with_parents (directory, 0700) < 0)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Could not create %s: %s", directory, g_strerror (saved_errno));
+      return NULL;
+    }
+
+  message_center = g_object_new (G_TYPE_DISTRIBUTED_MESSAGE_CENTER, NULL);
+  priv = message_center->priv;
+  priv->directory = g_strdup (directory);
+
+  name = g_strdup_printf ("peer-%d-%08x", (gint) getpid (), g_random_int ());
+  priv->address = g_build_filename (directory, name, NULL);
+  g_free (name);
+
+  priv->listen_fd = socket_listen (priv->address, error);
+  if (priv->listen_fd < 0)
+    {
+      g_object_unref (message_center);
+      return NULL;
+    }
+  priv->listen_source = fd_source_new (priv->listen_fd, listener_dispatch, message_center, priv->context);
+
+  g_distributed_message_center_join (message_center);
+
+  return message_center;
 }
 
 /**
  * g_distributed_message_center_get:
+ *
+ * Gets the distributed message center of the process, which uses a
+ * rendezvous directory in the user runtime directory.
+ *
+ * Returns: (transfer none): the #GDistributedMessageCenter of the process
  */
 GDistributedMessageCenter *
-g_distributed_message_center_get ()
+g_distributed_message_center_get (void)
 {
   static GDistributedMessageCenter *message_center = NULL;
 
-  if (message_center == NULL) {
-    message_center = g_object_new (G_TYPE_DISTRIBUTED_MESSAGE_CENTER, NULL);
-  }
+  if (g_once_init_enter (&message_center))
+    {
+      GDistributedMessageCenter *center;
+      GError *error = NULL;
+      gchar *directory;
+
+      directory = g_build_filename (g_get_user_runtime_dir (), "gpattern-message-center", NULL);
+      center = g_distributed_message_center_new (directory, &error);
+      if (center == NULL)
+        {
+          /* Still usable for messages within the process */
+          g_warning ("%s", error->message);
+          g_error_free (error);
+          center = g_object_new (G_TYPE_DISTRIBUTED_MESSAGE_CENTER, NULL);
+        }
+      g_free (directory);
+
+      g_once_init_leave (&message_center, center);
+    }
 
   return message_center;
 }
 
+/**
+ * g_distributed_message_center_get_n_peers:
+ * @message_center: a #GDistributedMessageCenter
+ *
+ * Gets the number of processes @message_center is connected to.
+ *
+ * Returns: the number of peers
+ */
+guint
+g_distributed_message_center_get_n_peers (GDistributedMessageCenter *message_center)
+{
+  guint i, n_peers = 0;
+
+  g_return_val_if_fail (G_IS_DISTRIBUTED_MESSAGE_CENTER (message_center), 0);
+
+  g_mutex_lock (&message_center->priv->lock);
+  for (i = 0; i < message_center->priv->connections->len; i++)
+    {
+      Connection *connection = g_ptr_array_index (message_center->priv->connections, i);
+
+      if (connection->kind == CONNECTION_PEER && connection->address != NULL)
+        n_peers++;
+    }
+  g_mutex_unlock (&message_center->priv->lock);
+
+  return n_peers;
+}
+
+/**
+ * g_distributed_message_center_get_n_listeners:
+ * @message_center: a #GDistributedMessageCenter
+ * @message_name: the name of a message
+ *
+ * Gets the number of other processes with filters for messages named
+ * @message_name sent by their distributed message center, which are the
+ * ones g_distributed_message_center_send() sends them to. This can be used
+ * to avoid building messages nobody listens to.
+ *
+ * Returns: the number of peers listening to @message_name
+ */
+guint
+g_distributed_message_center_get_n_listeners (GDistributedMessageCenter *message_center,
+                                              const gchar *message_name)
+{
+  GQuark quark;
+  guint i, n_listeners = 0;
+
+  g_return_val_if_fail (G_IS_DISTRIBUTED_MESSAGE_CENTER (message_center), 0);
+  g_return_val_if_fail (message_name != NULL, 0);
+
+  quark = g_quark_from_string (message_name);
+
+  g_mutex_lock (&message_center->priv->lock);
+  for (i = 0; i < message_center->priv->connections->len; i++)
+    {
+      Connection *connection = g_ptr_array_index (message_center->priv->connections, i);
+
+      if (connection->kind == CONNECTION_PEER && connection_wants (connection, quark))
+        n_listeners++;
+    }
+  g_mutex_unlock (&message_center->priv->lock);
+
+  return n_listeners;
+}
+
+/**
+ * g_distributed_message_center_flush:
+ * @message_center: a #GDistributedMessageCenter
+ *
+ * Writes right away the frames waiting to be written in a batch with the
+ * next ones. Those are written within a millisecond anyway, this is only
+ * useful when the messages just sent are known to be the last ones for a
+ * while. This can be called from any thread.
+ */
+void
+g_distributed_message_center_flush (GDistributedMessageCenter *message_center)
+{
+  GDistributedMessageCenterPrivate *priv;
+  guint i;
+
+  g_return_if_fail (G_IS_DISTRIBUTED_MESSAGE_CENTER (message_center));
+
+  priv = message_center->priv;
+
+  g_mutex_lock (&priv->lock);
+  for (i = 0; i < priv->connections->len; i++)
+    {
+      Connection *connection = g_ptr_array_index (priv->connections, i);
+
+      if (connection->output->len > 0)
+        connection_flush (connection);
+    }
+  g_mutex_unlock (&priv->lock);
+}
+
+/**
+ * g_distributed_message_center_set_flow_control:
+ * @message_center: a #GDistributedMessageCenter
+ * @peer_buffer_limit: the maximum memory, in bytes, taken by the messages
+ * waiting to be sent to a given process
+ * @policy: what happens to the messages over @peer_buffer_limit
+ *
+ * Sets how @message_center copes with processes not keeping up with the
+ * messages it sends them. Messages wait in memory while they can't be sent
+ * to a process, up to @peer_buffer_limit, after which @policy applies. The
+ * default is a limit of 16 MiB, with %G_DISTRIBUTED_MESSAGE_CENTER_FLOW_DROP.
+ * Big messages, which are written in a file of their own, count against the
+ * limit until they are passed to the other process.
+ *
+ * With %G_DISTRIBUTED_MESSAGE_CENTER_FLOW_BLOCK, the processes blocking a
+ * sender must not be waiting for it themselves.
+ */
+void
+g_distributed_message_center_set_flow_control (GDistributedMessageCenter *message_center,
+                                               gsize peer_buffer_limit,
+                                               GDistributedMessageCenterFlowPolicy policy)
+{
+  g_return_if_fail (G_IS_DISTRIBUTED_MESSAGE_CENTER (message_center));
+  g_return_if_fail (peer_buffer_limit > 0);
+
+  g_mutex_lock (&message_center->priv->lock);
+  message_center->priv->peer_buffer_limit = peer_buffer_limit;
+  message_center->priv->flow_policy = policy;
+  g_mutex_unlock (&message_center->priv->lock);
+}
+
+/**
+ * g_distributed_message_center_get_peer_stats:
+ * @message_center: a #GDistributedMessageCenter
+ *
+ * Gets the flow control statistics of the processes @message_center is
+ * connected to, as an array of tuples of type (sttttt), one per process,
+ * with its address, the memory taken by the messages waiting to be sent to
+ * it, the numbers of messages dropped and spilled for it, how long
+ * @message_center waited for it to make space for messages, and how long
+ * it waited for @message_center, both in microseconds.
+ *
+ * Returns: (transfer full): a #GVariant of type a(sttttt)
+ */
+GVariant *
+g_distributed_message_center_get_peer_stats (GDistributedMessageCenter *message_center)
+{
+  GVariantBuilder builder;
+  guint i;
+
+  g_return_val_if_fail (G_IS_DISTRIBUTED_MESSAGE_CENTER (message_center), NULL);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sttttt)"));
+  g_mutex_lock (&message_center->priv->lock);
+  for (i = 0; i < message_center->priv->connections->len; i++)
+    {
+      Connection *connection = g_ptr_array_index (message_center->priv->connections, i);
+
+      if (connection->kind != CONNECTION_PEER || connection->address == NULL)
+        continue;
+
+      g_variant_builder_add (&builder, "(sttttt)",
+                             connection->address,
+                             (guint64) connection_get_buffered (connection),
+                             connection->n_dropped,
+                             connection->n_spilled,
+                             (guint64) (connection->out_ring != NULL ? g_message_ring_get_stalled_time (connection->out_ring) : 0),
+                             (guint64) (connection->in_ring != NULL ? g_message_ring_get_stalled_time (connection->in_ring) : 0));
+    }
+  g_mutex_unlock (&message_center->priv->lock);
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+/**
+ * g_distributed_message_center_get_uuid:
+ * @message_center: a #GDistributedMessageCenter
+ *
+ * Gets the UUID identifying @message_center in the messages it sends to
+ * other processes, see g_distributed_message_center_get_message_origin().
+ *
+ * Returns: (transfer none): an interned string
+ */
+const gchar *
+g_distributed_message_center_get_uuid (GDistributedMessageCenter *message_center)
+{
+  g_return_val_if_fail (G_IS_DISTRIBUTED_MESSAGE_CENTER (message_center), NULL);
+
+  return message_center->priv->uuid_string;
+}
+
+/**
+ * g_distributed_message_center_get_message_origin:
+ * @message: a #GMessage
+ *
+ * Gets the UUID of the distributed message center @message was received
+ * from, see g_distributed_message_center_get_uuid().
+ *
+ * Returns: (transfer none): an interned string, or %NULL if @message
+ * doesn't come from another process
+ */
+const gchar *
+g_distributed_message_center_get_message_origin (GMessage *message)
+{
+  g_return_val_if_fail (G_IS_MESSAGE (message), NULL);
+
+  return g_object_get_qdata (G_OBJECT (message), message_origin_quark ());
+}
+
+/* Waits until the peers listening to @message_name have space for @size
+ * more bytes, or nothing waiting to be sent to them. As the main loop of
+ * the calling thread might be the one watching them, the sockets and the
+ * rings are watched from here. Must be called with the lock held, which is
+ * released meanwhile */
+static void
+g_distributed_message_center_wait_for_peers (GDistributedMessageCenter *message_center,
+                                             GQuark message_name,
+                                             gsize size)
+{
+  GDistributedMessageCenterPrivate *priv = message_center->priv;
+  GArray *fds = g_array_new (FALSE, FALSE, sizeof (struct pollfd));
+  GPtrArray *blocked = g_ptr_array_new ();
+  guint i;
+
+  for (;;)
+    {
+      g_array_set_size (fds, 0);
+      g_ptr_array_set_size (blocked, 0);
+
+      for (i = 0; i < priv->connections->len; i++)
+        {
+          Connection *connection = g_ptr_array_index (priv->connections, i);
+          struct pollfd pollfd = { connection->fd, 0, 0 };
+          gint memfd, data_fd;
+          gsize buffered;
+
+          if (connection->kind != CONNECTION_PEER || connection->hung_up || !connection_wants (connection, message_name))
+            continue;
+
+          connection_flush_pending (connection);
+          buffered = connection_get_buffered (connection);
+          if (buffered == 0 || buffered + size <= priv->peer_buffer_limit)
+            continue;
+
+          /* The socket tells when it is closed, or takes more */
+          if (connection->output->len > 0)
+            pollfd.events = POLLOUT;
+          g_array_append_val (fds, pollfd);
+          g_ptr_array_add (blocked, connection);
+
+          if (connection->out_ring != NULL)
+            {
+              g_message_ring_get_fds (connection->out_ring, &memfd, &data_fd, &pollfd.fd);
+              pollfd.events = POLLIN;
+              g_array_append_val (fds, pollfd);
+              g_ptr_array_add (blocked, connection);
+            }
+        }
+
+      if (blocked->len == 0)
+        break;
+
+      g_mutex_unlock (&priv->lock);
+      poll ((struct pollfd *) fds->data, fds->len, BLOCK_POLL_INTERVAL);
+      g_mutex_lock (&priv->lock);
+
+      /* Connections might have gone away meanwhile */
+      for (i = 0; i < blocked->len; i++)
+        {
+          Connection *connection = g_ptr_array_index (blocked, i);
+          struct pollfd *pollfd = &g_array_index (fds, struct pollfd, i);
+          gint memfd, data_fd, space_fd = -1;
+
+          if (pollfd->revents == 0 || !g_ptr_array_find (priv->connections, connection, NULL))
+            continue;
+
+          if (connection->out_ring != NULL)
+            g_message_ring_get_fds (connection->out_ring, &memfd, &data_fd, &space_fd);
+
+          if (pollfd->fd == connection->fd)
+            {
+              if (pollfd->revents & (POLLHUP | POLLERR | POLLNVAL))
+                connection->hung_up = TRUE;
+              else if (pollfd->revents & POLLOUT)
+                connection_flush (connection);
+            }
+          else if (pollfd->fd == space_fd)
+            {
+              g_message_ring_clear_event (space_fd);
+            }
+        }
+    }
+
+  g_array_unref (fds);
+  g_ptr_array_unref (blocked);
+}
+
 /**
  * g_distributed_message_center_send:
+ * @message_center: a #GDistributedMessageCenter
+ * @message: the message to send
+ *
+ * Sends @message to the filters of @message_center, like
+ * g_message_center_send(), and to the distributed message centers of the
+ * other processes with filters for it. This can be called from any thread.
  */
 void
 g_distributed_message_center_send (GDistributedMessageCenter *message_center,
                                    GMessage *message)
 {
+  GDistributedMessageCenterPrivate *priv;
+  GQuark name;
+  guint i;
+
   g_return_if_fail (G_IS_DISTRIBUTED_MESSAGE_CENTER (message_center));
+  g_return_if_fail (G_IS_MESSAGE (message));
+
+  priv = message_center->priv;
+  name = g_message_get_name_quark (message);
+
+  g_mutex_lock (&priv->lock);
+  if (priv->flow_policy == G_DISTRIBUTED_MESSAGE_CENTER_FLOW_BLOCK)
+    g_distributed_message_center_wait_for_peers (message_center, name, pending_message_size (g_message_get_payload (message)));
+  for (i = 0; i < priv->connections->len; i++)
+    {
+      Connection *connection = g_ptr_array_index (priv->connections, i);
+
+      /* Nothing is serialized unless some peer listens */
+      if (connection->kind != CONNECTION_PEER || !connection_wants (connection, name))
+        continue;
+
+      connection_send_message (connection, name, g_message_get_payload (message));
+    }
+  g_mutex_unlock (&priv->lock);
+
+  g_message_center_send (G_MESSAGE_CENTER (message_center), message);
 }
@@ -27,7 +27,7 @@
 
 G_BEGIN_DECLS
 
-#define G_TYPE_DISTRIBUTED_MESSAGE_CENTER         (g_message_center_get_type ())
+#define G_TYPE_DISTRIBUTED_MESSAGE_CENTER         (g_distributed_message_center_get_type ())
 #define G_DISTRIBUTED_MESSAGE_CENTER(o)           (G_TYPE_CHECK_INSTANCE_CAST ((o), G_TYPE_DISTRIBUTED_MESSAGE_CENTER, GDistributedMessageCenter))
 #define G_DISTRIBUTED_MESSAGE_CENTER_CLASS(k)     (G_TYPE_CHECK_CLASS_CAST((k), G_TYPE_DISTRIBUTED_MESSAGE_CENTER, GDistributedMessageCenterClass))
 #define G_IS_DISTRIBUTED_MESSAGE_CENTER(o)        (G_TYPE_CHECK_INSTANCE_TYPE ((o), G_TYPE_DISTRIBUTED_MESSAGE_CENTER))
@@ -38,6 +38,24 @@ typedef struct _GDistributedMessageCenter        GDistributedMessageCenter;
 typedef struct _GDistributedMessageCenterClass   GDistributedMessageCenterClass;
 typedef struct _GDistributedMessageCenterPrivate GDistributedMessageCenterPrivate;
 
+/**
+ * GDistributedMessageCenterFlowPolicy:
+ * @G_DISTRIBUTED_MESSAGE_CENTER_FLOW_BLOCK: g_distributed_message_center_send()
+ * waits until the processes the message goes to have space for it
+ * @G_DISTRIBUTED_MESSAGE_CENTER_FLOW_DROP: messages are dropped for the
+ * processes which have no space for them
+ * @G_DISTRIBUTED_MESSAGE_CENTER_FLOW_SPILL: messages are written to a
+ * temporary file, and sent from there in order once there is space
+ *
+ * Policies for g_distributed_message_center_set_flow_control().
+ */
+typedef enum
+{
+  G_DISTRIBUTED_MESSAGE_CENTER_FLOW_BLOCK,
+  G_DISTRIBUTED_MESSAGE_CENTER_FLOW_DROP,
+  G_DISTRIBUTED_MESSAGE_CENTER_FLOW_SPILL
+} GDistributedMessageCenterFlowPolicy;
+
 /**
  * GDistributedMessageCenter;
  *
@@ -59,11 +77,22 @@ typedef struct _GDistributedMessageCenterPrivate GDistributedMessageCenterPrivat
    GMessageCenterClass parent_class;
  };
 
-GType                      g_distributed_message_center_get_type (void) G_GNUC_CONST;
-GDistributedMessageCenter *g_distributed_message_center_get      (void);
+GType                      g_distributed_message_center_get_type           (void) G_GNUC_CONST;
+GDistributedMessageCenter *g_distributed_message_center_get                (void);
+GDistributedMessageCenter *g_distributed_message_center_new                (const gchar *directory, GError **error);
 
-void                       g_distributed_message_center_send     (GDistributedMessageCenter *message_center,
-                                                                  GMessage *message);
+void                       g_distributed_message_center_send               (GDistributedMessageCenter *message_center,
+                                                                            GMessage *message);
+void                       g_distributed_message_center_flush              (GDistributedMessageCenter *message_center);
+guint                      g_distributed_message_center_get_n_peers        (GDistributedMessageCenter *message_center);
+guint                      g_distributed_message_center_get_n_listeners    (GDistributedMessageCenter *message_center,
+                                                                            const gchar *message_name);
+void                       g_distributed_message_center_set_flow_control   (GDistributedMessageCenter *message_center,
+                                                                            gsize peer_buffer_limit,
+                                                                            GDistributedMessageCenterFlowPolicy policy);
+GVariant                  *g_distributed_message_center_get_peer_stats     (GDistributedMessageCenter *message_center);
+const gchar               *g_distributed_message_center_get_uuid           (GDistributedMessageCenter *message_center);
+const gchar               *g_distributed_message_center_get_message_origin (GMessage *message);
 
 G_END_DECLS
 
@@ -20,7 +20,7 @@
  * Author: Rodrigo Moya <rodrigo@gnome.org>
  */
 
-#include "gmessage.h"
+#include "gmessageprivate.h"
 
 /**
  * SECTION:gmessage
@@ -31,21 +31,68 @@
 struct _GMessagePrivate
 {
   GObject *sender;
-  gchar   *name;
+  GQuark   name;
   gpointer user_data;
+  GVariant *payload;
+  guint    coalesced_count;
+  guint64  correlation_id;
+
+  /* pooled messages don't hold a reference on their sender while they
+   * are being dispatched, see g_message_pool_release() */
+  gboolean borrowed_sender;
+  /* set when a pooled message is referenced by anybody but the pool */
+  gint escaped;
 };
 
-G_DEFINE_TYPE (GMessage, g_message, G_TYPE_OBJECT);
+G_DEFINE_TYPE_WITH_PRIVATE (GMessage, g_message, G_TYPE_OBJECT);
+
+/* Per-thread cache of messages, so that sending doesn't need any
+ * allocation once it is warm. The pool holds pooled messages through a
+ * toggle reference, which tells it when somebody else references them */
+#define MESSAGE_POOL_SIZE 32
+
+typedef struct
+{
+  guint n_messages;
+  GMessage *messages[MESSAGE_POOL_SIZE];
+} MessagePool;
+
+/* A message referenced by anybody while it is out of the pool is never
+ * reused, even if the reference was dropped again: the last reference
+ * going away can be notified from another thread while the pool drops its
+ * own, so the message must not be touched then */
+static void
+message_pool_toggle_cb (gpointer data, GObject *object, gboolean is_last_ref)
+{
+  if (!is_last_ref)
+    g_atomic_int_set (&G_MESSAGE (object)->priv->escaped, TRUE);
+}
+
+static void
+message_pool_free (gpointer data)
+{
+  MessagePool *pool = data;
+
+  while (pool->n_messages > 0)
+    {
+      g_object_remove_toggle_ref (G_OBJECT (pool->messages[--pool->n_messages]), message_pool_toggle_cb, NULL);
+    }
+  g_free (pool);
+}
+
+static GPrivate message_pool_key = G_PRIVATE_INIT (message_pool_free);
 
 static void
 g_message_finalize (GObject *object)
 {
   GMessage *message = G_MESSAGE (object);
 
-  if (message->priv != NULL) {
-    g_clear_object (&message->priv->sender);
-    g_clear_pointer (&message->priv->name, g_free);
-  }
+  if (message->priv->borrowed_sender)
+    {
+      message->priv->sender = NULL;
+    }
+  g_clear_object (&message->priv->sender);
+  g_clear_pointer (&message->priv->payload, g_variant_unref);
 
   G_OBJECT_CLASS (g_message_parent_class)->finalize (object);
 }
@@ -61,7 +108,8 @@ g_message_class_init (GMessageClass *klass)
 static void
 g_message_init (GMessage *message)
 {
-  message->priv = g_new0 (GMessagePrivate, 1);
+  message->priv = g_message_get_instance_private (message);
+  message->priv->coalesced_count = 1;
 }
 
 /**
@@ -84,6 +132,182 @@ g_message_new (GObject *sender, const gchar *message_name, gpointer user_data)
   return message;
 }
 
+/**
+ * g_message_new_static:
+ * @sender: the object sending the message
+ * @message_name: a static string, which must remain valid for the lifetime
+ * of the program
+ * @user_data: data to attach to the message
+ *
+ * Creates a new #GMessage, like g_message_new(), but without copying
+ * @message_name, which is used as is for interning the message name.
+ *
+ * Returns: a new #GMessage
+ */
+GMessage *
+g_message_new_static (GObject *sender, const gchar *message_name, gpointer user_data)
+{
+  g_return_val_if_fail (message_name != NULL, NULL);
+
+  return g_message_new_quark (sender, g_quark_from_static_string (message_name), user_data);
+}
+
+/**
+ * g_message_new_quark:
+ * @sender: the object sending the message
+ * @message_name: the name of the message, as a #GQuark
+ * @user_data: data to attach to the message
+ *
+ * Creates a new #GMessage from an already interned message name. This is
+ * the cheapest way to create messages, as no string handling at all is
+ * involved.
+ *
+ * Returns: a new #GMessage
+ */
+GMessage *
+g_message_new_quark (GObject *sender, GQuark message_name, gpointer user_data)
+{
+  GMessage *message;
+
+  g_return_val_if_fail (G_IS_OBJECT (sender), NULL);
+  g_return_val_if_fail (message_name != 0, NULL);
+
+  message = g_object_new (G_TYPE_MESSAGE, NULL);
+
+  g_message_set_sender (message, sender);
+  message->priv->name = message_name;
+  g_message_set_user_data (message, user_data);
+
+  return message;
+}
+
+/**
+ * g_message_new_with_payload:
+ * @sender: the object sending the message
+ * @message_name: the name of the message
+ * @payload: the contents of the message
+ *
+ * Creates a new #GMessage carrying @payload. Unlike user data, the payload
+ * is owned by the message, and as a #GVariant it is immutable, so all the
+ * filters share it without copying, and it can be serialized as is.
+ *
+ * If @payload is floating, the message takes ownership of it.
+ *
+ * Returns: a new #GMessage
+ */
+GMessage *
+g_message_new_with_payload (GObject *sender, const gchar *message_name, GVariant *payload)
+{
+  GMessage *message;
+
+  g_return_val_if_fail (payload != NULL, NULL);
+
+  message = g_message_new (sender, message_name, NULL);
+  if (message != NULL)
+    {
+      message->priv->payload = g_variant_ref_sink (payload);
+    }
+
+  return message;
+}
+
+/* Returns a message for dispatching from the calling thread's pool. The
+ * message doesn't take a reference on @sender, so it must be given back
+ * with g_message_pool_release() before the caller drops its own.
+ */
+GMessage *
+g_message_pool_acquire (GObject *sender, GQuark message_name, gpointer user_data)
+{
+  MessagePool *pool = g_private_get (&message_pool_key);
+  GMessage *message;
+
+  if (pool != NULL && pool->n_messages > 0)
+    {
+      message = pool->messages[--pool->n_messages];
+    }
+  else
+    {
+      message = g_object_new (G_TYPE_MESSAGE, NULL);
+      g_object_add_toggle_ref (G_OBJECT (message), message_pool_toggle_cb, NULL);
+      g_object_unref (message);
+    }
+
+  message->priv->sender = sender;
+  message->priv->borrowed_sender = TRUE;
+  message->priv->name = message_name;
+  message->priv->user_data = user_data;
+  message->priv->coalesced_count = 1;
+
+  return message;
+}
+
+/* Gives back a message obtained with g_message_pool_acquire(). If anybody
+ * referenced it, it can't be reused, and it takes a real reference on its
+ * sender, since it might outlive it.
+ */
+void
+g_message_pool_release (GMessage *message)
+{
+  MessagePool *pool;
+
+  if (g_atomic_int_get (&message->priv->escaped))
+    {
+      if (message->priv->borrowed_sender)
+        {
+          message->priv->borrowed_sender = FALSE;
+          g_object_ref (message->priv->sender);
+        }
+      g_object_remove_toggle_ref (G_OBJECT (message), message_pool_toggle_cb, NULL);
+      return;
+    }
+
+  message->priv->sender = NULL;
+  message->priv->borrowed_sender = FALSE;
+  message->priv->name = 0;
+  message->priv->user_data = NULL;
+  message->priv->coalesced_count = 1;
+  message->priv->correlation_id = 0;
+
+  pool = g_private_get (&message_pool_key);
+  if (pool == NULL)
+    {
+      pool = g_new0 (MessagePool, 1);
+      g_private_set (&message_pool_key, pool);
+    }
+
+  if (pool->n_messages < MESSAGE_POOL_SIZE)
+    {
+      pool->messages[pool->n_messages++] = message;
+    }
+  else
+    {
+      g_object_remove_toggle_ref (G_OBJECT (message), message_pool_toggle_cb, NULL);
+    }
+}
+
+/* Returns a new message with the same contents as @message */
+GMessage *
+g_message_copy (GMessage *message)
+{
+  GMessage *copy;
+
+  copy = g_message_new_quark (message->priv->sender, message->priv->name, message->priv->user_data);
+  copy->priv->coalesced_count = message->priv->coalesced_count;
+  copy->priv->correlation_id = message->priv->correlation_id;
+  if (message->priv->payload != NULL)
+    {
+      copy->priv->payload = g_variant_ref (message->priv->payload);
+    }
+
+  return copy;
+}
+
+void
+g_message_set_coalesced_count (GMessage *message, guint count)
+{
+  message->priv->coalesced_count = count;
+}
+
 /**
  *g_message_get_sender:
  */
@@ -103,12 +327,14 @@ g_message_set_sender (GMessage *message, GObject *sender)
 {
   g_return_if_fail (G_IS_MESSAGE (message));
 
-  if (message->priv->sender != NULL)
+  g_object_ref (sender);
+  if (message->priv->sender != NULL && !message->priv->borrowed_sender)
     {
       g_object_unref (message->priv->sender);
     }
 
-  message->priv->sender = g_object_ref (sender);
+  message->priv->sender = sender;
+  message->priv->borrowed_sender = FALSE;
 }
 
 /**
@@ -119,7 +345,21 @@ g_message_get_name (GMessage *message)
 {
   g_return_val_if_fail (G_IS_MESSAGE (message), NULL);
 
-  return (const gchar *) message->priv->name;
+  return g_quark_to_string (message->priv->name);
+}
+
+/**
+ * g_message_get_name_quark:
+ * @message: a #GMessage
+ *
+ * Returns: the name of @message, as a #GQuark
+ */
+GQuark
+g_message_get_name_quark (GMessage *message)
+{
+  g_return_val_if_fail (G_IS_MESSAGE (message), 0);
+
+  return message->priv->name;
 }
 
 /**
@@ -130,8 +370,9 @@ g_message_set_name (GMessage *message, const gchar *name)
 {
   g_return_if_fail (G_IS_MESSAGE (message));
 
-  g_clear_pointer (&message->priv->name, g_free);
-  message->priv->name = g_strdup (name);
+  /* Message names are interned, so that only the first message with a
+   * given name pays for copying it */
+  message->priv->name = name != NULL ? g_quark_from_string (name) : 0;
 }
 
 /**
@@ -155,3 +396,73 @@ g_message_set_user_data (GMessage *message, gpointer user_data)
 
   message->priv->user_data = user_data;
 }
+
+/**
+ * g_message_get_coalesced_count:
+ * @message: a #GMessage
+ *
+ * Gets the number of messages @message stands for, when it is delivered
+ * in place of other messages with the same sender and name, as done by
+ * g_message_center_send_coalesced() and coalescing filters.
+ *
+ * Returns: the number of messages coalesced into @message, 1 if none
+ */
+guint
+g_message_get_coalesced_count (GMessage *message)
+{
+  g_return_val_if_fail (G_IS_MESSAGE (message), 0);
+
+  return message->priv->coalesced_count;
+}
+
+/**
+ * g_message_get_payload:
+ * @message: a #GMessage
+ *
+ * Gets the payload of a message created with g_message_new_with_payload().
+ *
+ * Returns: (transfer none) (nullable): the payload of @message, which
+ * must be referenced to be kept after @message is destroyed
+ */
+GVariant *
+g_message_get_payload (GMessage *message)
+{
+  g_return_val_if_fail (G_IS_MESSAGE (message), NULL);
+
+  return message->priv->payload;
+}
+
+/**
+ * g_message_get_correlation_id:
+ * @message: a #GMessage
+ *
+ * Gets the ID linking a request sent with g_message_center_request_async()
+ * and its reply, which is the same for both.
+ *
+ * Returns: the correlation ID of @message, or 0 if it is not part of a
+ * request
+ */
+guint64
+g_message_get_correlation_id (GMessage *message)
+{
+  g_return_val_if_fail (G_IS_MESSAGE (message), 0);
+
+  return message->priv->correlation_id;
+}
+
+/**
+ * g_message_set_correlation_id:
+ * @message: a #GMessage
+ * @correlation_id: the correlation ID
+ *
+ * Sets the correlation ID of @message. This is done by the message center
+ * for requests and replies, and is only needed to implement other ways of
+ * matching replies to requests.
+ */
+void
+g_message_set_correlation_id (GMessage *message, guint64 correlation_id)
+{
+  g_return_if_fail (G_IS_MESSAGE (message));
+
+  message->priv->correlation_id = correlation_id;
+}
@@ -51,16 +51,24 @@ struct _GMessageClass
   GObjectClass parent_class;
 };
 
-GType        g_message_get_type      (void) G_GNUC_CONST;
+GType        g_message_get_type            (void) G_GNUC_CONST;
 
-GMessage    *g_message_new           (GObject *sender, const gchar *message_name, gpointer user_data);
+GMessage    *g_message_new                 (GObject *sender, const gchar *message_name, gpointer user_data);
+GMessage    *g_message_new_static          (GObject *sender, const gchar *message_name, gpointer user_data);
+GMessage    *g_message_new_quark           (GObject *sender, GQuark message_name, gpointer user_data);
+GMessage    *g_message_new_with_payload    (GObject *sender, const gchar *message_name, GVariant *payload);
 
-GObject     *g_message_get_sender    (GMessage *message);
-void         g_message_set_sender    (GMessage *message, GObject *sender);
-const gchar *g_message_get_name      (GMessage *message);
-void         g_message_set_name      (GMessage *message, const gchar *name);
-gpointer     g_message_get_user_data (GMessage *message);
-void         g_message_set_user_data (GMessage *message, gpointer user_data);
+GObject     *g_message_get_sender          (GMessage *message);
+void         g_message_set_sender          (GMessage *message, GObject *sender);
+const gchar *g_message_get_name            (GMessage *message);
+void         g_message_set_name            (GMessage *message, const gchar *name);
+GQuark       g_message_get_name_quark      (GMessage *message);
+gpointer     g_message_get_user_data       (GMessage *message);
+void         g_message_set_user_data       (GMessage *message, gpointer user_data);
+GVariant    *g_message_get_payload         (GMessage *message);
+guint        g_message_get_coalesced_count (GMessage *message);
+guint64      g_message_get_correlation_id  (GMessage *message);
+void         g_message_set_correlation_id  (GMessage *message, guint64 correlation_id);
 
 G_END_DECLS
 
@@ -20,231 +20,3439 @@
  * Author: Rodrigo Moya <rodrigo@gnome.org>
  */
 
+#include <string.h>
+
 #include "gmessagecenter.h"
+#include "gmessagejournal.h"
+#include "gmessageprivate.h"
+#include "gtimerwheel.h"
+#include "gtopictrie.h"
 
 /**
  * SECTION:gmessagecenter
  * @title: GMessageCenter
  * @short_description: Application-wide message passing interface
+ *
+ * All #GMessageCenter functions can be called from any thread. Filter
+ * callbacks are run on the thread sending the message, unless they were
+ * registered with %G_MESSAGE_CENTER_FILTER_INVOKE_IN_CONTEXT.
+ */
+
+/* Filters are indexed by the (sender, message name) pair they were
+ * registered for, so that sending a message only needs to look at the
+ * buckets that can possibly match it, instead of walking every registered
+ * filter. A NULL sender or a 0 message name in the key act as wildcards.
+ *
+ * Filters for wildcard patterns ("test.message.*", "test.#") are kept
+ * apart, in a trie indexed by the pattern segments.
+ *
+ * Senders never take the lock to find the filters to call. Registering a
+ * filter never modifies what a sender might be reading: the array of
+ * filters of a bucket is replaced as a whole by a copy with the new filter,
+ * new buckets are fully set up before being linked in their chain, and the
+ * pattern trie, which only changes when a new pattern is registered, is
+ * replaced by a copy. Senders take a reference on the arrays they need
+ * inside a read section (see g_message_center_begin_read()), and replaced
+ * objects are only released once the read sections which might have seen
+ * them are over, so registering a filter costs a copy of its bucket, not
+ * of the whole index.
+ *
+ * Removing a filter just flags it as removed, which dispatching honours
+ * right away, and leaves it in its bucket. Once there are more removed
+ * filters than live ones, the index is rebuilt from the live filters, so
+ * removal is O(1) amortized.
  */
+typedef struct
+{
+  GObject *sender;
+  GQuark message_name;
+} FilterKey;
+
+/* Callback latencies are counted in buckets of powers of 2 microseconds,
+ * the last one being for anything longer than about a quarter of second */
+#define N_LATENCY_BUCKETS 20
 
 typedef struct
 {
+  gint ref_count;
+  guint id;
+  guint64 serial;
+  gint removed;
+  GMessageCenter *message_center;
+  /* sender and object are weak references */
   GObject *sender;
-  gchar *message_name;
+  GObject *object;
+  gboolean watching_sender;
+  gboolean watching_object;
+  GQuark message_name;
+  gboolean is_pattern;
   GMessageCenterFilterFunc callback;
+  GMessageCenterBatchFilterFunc batch_callback;
   gpointer user_data;
+  GDestroyNotify destroy_notify;
+  GMainContext *context;
+  /* see g_message_center_coalesce_filter() */
+  gint coalesce_window;
+  gint coalesce_mode;
+  /* see g_message_center_get_stats() */
+  gint latency_histogram[N_LATENCY_BUCKETS];
 } RegisteredCallback;
 
+/* Messages waiting for their coalescing window to end, for a given filter,
+ * or for all of them if rc is NULL */
+typedef struct
+{
+  RegisteredCallback *rc;
+  GObject *sender;
+  GQuark message_name;
+} CoalesceKey;
+
+typedef struct
+{
+  CoalesceKey key;
+  GMessageCenter *message_center;
+  GMessage *message;
+  guint count;
+  guint timer;
+} CoalescedMessage;
+
+typedef struct _FilterBucket FilterBucket;
+
+struct _FilterBucket
+{
+  gint ref_count;
+  FilterKey key;
+  /* Ordered by serial, never modified once senders can see it */
+  GPtrArray *filters;
+  /* Next bucket in the same slot of a FilterIndex */
+  FilterBucket *next;
+};
+
+/* Buckets by FilterKey, in chains which are only ever prepended to, so
+ * that senders can walk them while a filter is registered */
+typedef struct
+{
+  guint n_slots;
+  guint n_buckets;
+  FilterBucket **slots;
+} FilterIndex;
+
+/* Initial number of slots of a FilterIndex, which must be a power of 2 */
+#define FILTER_INDEX_MIN_SLOTS 16
+
+/* Numbers of messages sent by name quark, in chunks allocated as names
+ * are sent. Chunks never move, and a TopicCounts is only replaced by a
+ * bigger copy, the old ones being kept until finalize, so that senders
+ * count without any lock */
+typedef struct
+{
+  guint n_chunks;
+  gsize *chunks[];
+} TopicCounts;
+
+#define TOPIC_COUNTS_CHUNK 256
+
+#define N_PRIORITY_LANES (G_MESSAGE_CENTER_PRIORITY_BULK + 1)
+
+/* Longest time bulk messages are dispatched for in a main loop iteration,
+ * in microseconds */
+#define BULK_TIME_SLICE 1000
+
+typedef struct
+{
+  GSource source;
+  GMessageCenter *message_center;
+  GMessageCenterPriority priority;
+  /* Protected by the message center lock */
+  GQueue messages;
+} LaneSource;
+
+/* A token bucket limiting the messages sent for a (sender, message name)
+ * pair, where a NULL sender or a 0 message name act as wildcards. Tokens
+ * are refilled lazily, when a message is sent */
+typedef struct
+{
+  FilterKey key;
+  GMessageCenter *message_center;
+  /* the sender is a weak reference */
+  gboolean watching_sender;
+  GMessageCenterRateLimitPolicy policy;
+  gdouble rate;
+  gdouble burst;
+  gdouble tokens;
+  gint64 last_refill;
+  /* Messages held back by G_MESSAGE_CENTER_RATE_LIMIT_DEFER, and the timer
+   * releasing them, which is scheduled whenever there are some */
+  GQueue deferred;
+  guint timer;
+  guint64 n_dropped;
+  guint64 n_coalesced;
+  guint64 n_deferred;
+} RateLimit;
+
+/* Messages sent with g_message_center_send_async() by a sender, waiting
+ * to be dispatched by a worker thread. A queue only exists while it has
+ * messages, and is pushed to the thread pool once, so that only one worker
+ * at a time dispatches messages from a given sender */
+typedef struct
+{
+  GObject *sender;
+  GQueue messages;
+} SenderQueue;
+
+/* Messages a worker dispatches from a queue before giving other queues a
+ * chance */
+#define SENDER_QUEUE_BATCH 64
+
 struct _GMessageCenterPrivate
 {
-  GSList *registered_callbacks;
+  GMutex lock;
+  /* Read by senders without the lock, replaced with the lock held */
+  FilterIndex *registered_callbacks;
+  GTopicTrie *wildcard_callbacks;
+  /* see g_message_center_begin_read() */
+  gint read_phase;
+  gint n_readers[2];
+  GHashTable *filters_by_id;
+  guint next_filter_id;
+  guint n_removed_filters;
+  guint64 next_serial;
+
+  /* Created on demand, runs delayed work on the global default context */
+  GTimerWheel *scheduler;
+  GHashTable *coalesced_messages;
+
+  /* Created on demand, see g_message_center_send_with_priority() */
+  GSource *lanes[N_PRIORITY_LANES];
+
+  /* Created on demand, see g_message_center_send_async() */
+  GThreadPool *workers;
+  GHashTable *sender_queues;
+
+  /* see g_message_center_set_dispatch_budget() */
+  gint dispatch_budget;
+  GQueue pending_dispatches;
+  GSource *dispatch_source;
+  GMainContext *dispatch_context;
+
+  /* see g_message_center_get_stats() */
+  gint stats_enabled;
+  gint handler_budget;
+  GMutex stats_lock;
+  TopicCounts *topic_counts;
+  GSList *old_topic_counts;
+
+  /* FilterKey -> RateLimit, see g_message_center_set_rate_limit() */
+  GHashTable *rate_limits;
+  gint n_rate_limits;
+
+  /* Name quark -> latest message sent with g_message_center_send_retained() */
+  GHashTable *retained_messages;
+
+  /* Created on demand, see g_message_center_set_journal() */
+  GMessageJournal *journal;
+
+  /* Correlation ID -> PendingRequest, see g_message_center_request_async() */
+  GHashTable *pending_requests;
+  guint64 next_correlation_id;
 };
 
+/* Don't bother rebuilding the index for less removed filters than this */
+#define MIN_REMOVED_FILTERS_TO_COLLECT 32
+
+/* Number of buckets a cursor can hold without allocating: exact sender and
+ * name, any sender for the name, any name for the sender, and a few
+ * matching wildcard patterns.
+ */
+#define FILTER_CURSOR_PREALLOC 8
+
+typedef struct
+{
+  GPtrArray **buckets;
+  guint *positions;
+  guint n_buckets;
+  guint allocated;
+  GPtrArray *buckets_prealloc[FILTER_CURSOR_PREALLOC];
+  guint positions_prealloc[FILTER_CURSOR_PREALLOC];
+} FilterCursor;
+
 enum {
   MESSAGE_RECEIVED_SIGNAL,
+  SLOW_HANDLER_SIGNAL,
   LAST_SIGNAL
 };
 static guint message_center_signals [LAST_SIGNAL] ;
 
-G_DEFINE_TYPE (GMessageCenter, g_message_center, G_TYPE_OBJECT)
+G_DEFINE_TYPE_WITH_PRIVATE (GMessageCenter, g_message_center, G_TYPE_OBJECT)
 
-static void
-g_message_center_finalize (GObject *object)
+static guint
+filter_key_hash (gconstpointer v)
 {
-  GMessageCenter *message_center = G_MESSAGE_CENTER (object);
+  const FilterKey *key = v;
 
-  if (message_center->priv != NULL) {
-    while (message_center->priv->registered_callbacks != NULL)
-      {
-        RegisteredCallback *rc = message_center->priv->registered_callbacks->data;
-        message_center->priv->registered_callbacks = g_slist_remove (message_center->priv->registered_callbacks, rc);
+  return g_direct_hash (key->sender) ^ (key->message_name * 2654435761u);
+}
 
-        if (rc->sender != NULL)
-          {
-            g_object_unref (rc->sender);
-          }
-        g_free (rc->message_name);
-        g_free (rc);
-      }
-  }
+static gboolean
+filter_key_equal (gconstpointer a, gconstpointer b)
+{
+  const FilterKey *key_a = a;
+  const FilterKey *key_b = b;
 
-  G_OBJECT_CLASS (g_message_center_parent_class)->finalize (object);
+  return key_a->sender == key_b->sender && key_a->message_name == key_b->message_name;
 }
 
-static void
-g_message_center_class_init (GMessageCenterClass *klass)
+static guint
+coalesce_key_hash (gconstpointer v)
 {
-  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  const CoalesceKey *key = v;
 
-  object_class->finalize = g_message_center_finalize;
+  return g_direct_hash (key->rc) ^ g_direct_hash (key->sender) ^ (key->message_name * 31);
+}
 
-  message_center_signals[MESSAGE_RECEIVED_SIGNAL] =
-		g_signal_new ("message-received",
-                  G_OBJECT_CLASS_TYPE (object_class),
-                  G_SIGNAL_RUN_LAST,
-                  G_STRUCT_OFFSET (GMessageCenterClass, message_received),
-                  NULL, NULL,
-                  g_cclosure_marshal_VOID__OBJECT,
-                  G_TYPE_NONE, 1,
-                  G_TYPE_OBJECT);
+static gboolean
+coalesce_key_equal (gconstpointer a, gconstpointer b)
+{
+  const CoalesceKey *key_a = a;
+  const CoalesceKey *key_b = b;
+
+  return key_a->rc == key_b->rc &&
+    key_a->sender == key_b->sender &&
+    key_a->message_name == key_b->message_name;
+}
+
+static RegisteredCallback *
+registered_callback_ref (RegisteredCallback *rc)
+{
+  g_atomic_int_inc (&rc->ref_count);
+
+  return rc;
 }
 
 static void
-g_message_center_init (GMessageCenter *message_center)
+registered_callback_unref (gpointer data)
 {
-  message_center->priv = g_message_center_get_instance_private (message_center);
+  RegisteredCallback *rc = data;
+
+  if (!g_atomic_int_dec_and_test (&rc->ref_count))
+    return;
+
+  if (rc->destroy_notify != NULL)
+    {
+      rc->destroy_notify (rc->user_data);
+    }
+  if (rc->context != NULL)
+    {
+      g_main_context_unref (rc->context);
+    }
+  g_free (rc);
 }
 
-/**
- * g_message_center_get:
- */
-GMessageCenter *
-g_message_center_get (void)
+static GPtrArray *
+filter_array_new (guint reserved_size)
 {
-  static GMessageCenter *message_center = NULL;
+  return g_ptr_array_new_full (reserved_size, registered_callback_unref);
+}
 
-  if (message_center == NULL) {
-    message_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
-  }
+/* Takes ownership of @filters */
+static FilterBucket *
+filter_bucket_new (GObject *sender, GQuark message_name, GPtrArray *filters)
+{
+  FilterBucket *bucket = g_new0 (FilterBucket, 1);
 
-  return message_center;
+  bucket->ref_count = 1;
+  bucket->key.sender = sender;
+  bucket->key.message_name = message_name;
+  bucket->filters = filters;
+
+  return bucket;
 }
 
-/**
- * g_message_center_send:
- */
-void
-g_message_center_send (GMessageCenter *message_center, GMessage *message)
+static FilterBucket *
+filter_bucket_ref (FilterBucket *bucket)
 {
-  GSList *l;
+  g_atomic_int_inc (&bucket->ref_count);
 
-  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
-  g_return_if_fail (G_IS_MESSAGE (message));
+  return bucket;
+}
 
-  /* 1st, notify all listeners */
-  g_signal_emit_by_name (message_center, "message-received", message);
+static gpointer
+filter_bucket_copy_ref (gconstpointer src, gpointer user_data)
+{
+  return filter_bucket_ref ((FilterBucket *) src);
+}
 
-  /* 2nd, notify registered filters */
-  for (l = message_center->priv->registered_callbacks; l != NULL; l = l->next)
+static void
+filter_bucket_unref (gpointer data)
+{
+  FilterBucket *bucket = data;
+
+  if (!g_atomic_int_dec_and_test (&bucket->ref_count))
+    return;
+
+  g_ptr_array_unref (bucket->filters);
+  g_free (bucket);
+}
+
+static FilterIndex *
+filter_index_new (guint n_slots)
+{
+  FilterIndex *index = g_new0 (FilterIndex, 1);
+
+  index->n_slots = n_slots;
+  index->slots = g_new0 (FilterBucket *, n_slots);
+
+  return index;
+}
+
+static void
+filter_index_free (FilterIndex *index)
+{
+  guint i;
+
+  for (i = 0; i < index->n_slots; i++)
     {
-      RegisteredCallback *rc = l->data;
+      FilterBucket *bucket = index->slots[i];
 
-      if ((rc->sender == NULL || rc->sender == g_message_get_sender (message)) &&
-          !g_strcmp0 (rc->message_name, g_message_get_name (message)))
+      while (bucket != NULL)
         {
-          rc->callback (message_center, message, rc->user_data);
+          FilterBucket *next = bucket->next;
+
+          filter_bucket_unref (bucket);
+          bucket = next;
         }
     }
+  g_free (index->slots);
+  g_free (index);
 }
 
-typedef struct
+static void
+topic_counts_free (TopicCounts *counts)
 {
-  GMessageCenter *message_center;
-  GMessage *message;
-} DelayedMessage;
+  guint i;
 
-static gboolean
-delayed_send_message_cb (gpointer user_data)
+  if (counts == NULL)
+    return;
+
+  for (i = 0; i < counts->n_chunks; i++)
+    {
+      g_free (counts->chunks[i]);
+    }
+  g_free (counts);
+}
+
+/* Can be called without the lock held, from a read section */
+static FilterBucket *
+filter_index_lookup (FilterIndex *index, GObject *sender, GQuark message_name)
 {
-  DelayedMessage *dm = (DelayedMessage *) user_data;
+  FilterKey key;
+  FilterBucket *bucket;
 
-  g_message_center_send (dm->message_center, dm->message);
+  key.sender = sender;
+  key.message_name = message_name;
 
-  g_object_unref (dm->message_center);
-  if (dm->message != NULL)
+  bucket = g_atomic_pointer_get (&index->slots[filter_key_hash (&key) & (index->n_slots - 1)]);
+  for (; bucket != NULL; bucket = bucket->next)
     {
-      g_object_unref (dm->message);
+      if (filter_key_equal (&bucket->key, &key))
+        return bucket;
     }
-  g_free (dm);
 
-  return FALSE;
+  return NULL;
 }
 
-/**
- * g_message_center_send_with_delay:
+/* Takes ownership of @bucket, which must be fully set up, as senders might
+ * find it right away */
+static void
+filter_index_insert (FilterIndex *index, FilterBucket *bucket)
+{
+  FilterBucket **slot = &index->slots[filter_key_hash (&bucket->key) & (index->n_slots - 1)];
+
+  bucket->next = *slot;
+  g_atomic_pointer_set (slot, bucket);
+  index->n_buckets++;
+}
+
+/* Senders look up the filters to call inside a read section, which must
+ * only take references on what they need and can't block. Writers, with
+ * the lock held, replace what senders might be reading, and then wait for
+ * the read sections which might have seen the old version to be over
+ * before releasing it, see g_message_center_synchronize().
+ *
+ * Sections count themselves in one of two phases, so that writers only wait
+ * for the senders which started before them, and not for the ones which
+ * keep coming.
  */
-void
-g_message_center_send_with_delay (GMessageCenter *message_center, GMessage *message, guint delay)
+static gint
+g_message_center_begin_read (GMessageCenter *message_center)
 {
-  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
-  g_return_if_fail (G_IS_MESSAGE (message));
+  GMessageCenterPrivate *priv = message_center->priv;
+  gint phase = g_atomic_int_get (&priv->read_phase);
 
-  if (delay == 0)
-    {
-      g_message_center_send (message_center, message);
-    }
-  else
-    {
-      DelayedMessage *dm = g_new0 (DelayedMessage, 1);
-      dm->message_center = g_object_ref (message_center);
-      dm->message = g_object_ref (message);
+  g_atomic_int_inc (&priv->n_readers[phase]);
 
-      g_timeout_add (delay, delayed_send_message_cb, dm);
-    }
+  return phase;
 }
 
-/**
- * g_message_center_send_full:
+static void
+g_message_center_end_read (GMessageCenter *message_center, gint phase)
+{
+  g_atomic_int_add (&message_center->priv->n_readers[phase], -1);
+}
+
+/* Must be called with the lock held, after replacing something senders
+ * read. Returns once no read section can still be using the old version.
+ *
+ * A sender might have read the phase before it is switched, but only count
+ * itself in it after the wait is over, so both phases are waited for.
  */
-void
-g_message_center_send_full (GMessageCenter *message_center, GObject *sender, const gchar *message_name, gpointer user_data)
+static void
+g_message_center_synchronize (GMessageCenter *message_center)
 {
-  GMessage *msg;
+  GMessageCenterPrivate *priv = message_center->priv;
+  guint i;
 
-  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
+  for (i = 0; i < 2; i++)
+    {
+      gint phase = priv->read_phase;
 
-  msg = g_message_new (sender, message_name, user_data);
-  if (msg != NULL)
+      g_atomic_int_set (&priv->read_phase, !phase);
+      while (g_atomic_int_get (&priv->n_readers[phase]) > 0)
+        {
+          g_thread_yield ();
+        }
+    }
+}
+
+/* Must be called with the lock held. Replaces the index by a bigger one, so
+ * that chains stay short. Buckets can't be moved to the new index, as
+ * senders might be walking their chain, so they are copied */
+static void
+g_message_center_grow_index (GMessageCenter *message_center)
+{
+  GMessageCenterPrivate *priv = message_center->priv;
+  FilterIndex *old_index = priv->registered_callbacks;
+  FilterIndex *index;
+  guint i;
+
+  index = filter_index_new (old_index->n_slots * 2);
+  for (i = 0; i < old_index->n_slots; i++)
     {
-      g_message_center_send (message_center, msg);
-      g_object_unref (msg);
+      FilterBucket *bucket;
+
+      for (bucket = old_index->slots[i]; bucket != NULL; bucket = bucket->next)
+        {
+          filter_index_insert (index, filter_bucket_new (bucket->key.sender,
+                                                         bucket->key.message_name,
+                                                         g_ptr_array_ref (bucket->filters)));
+        }
     }
+
+  g_atomic_pointer_set (&priv->registered_callbacks, index);
+  g_message_center_synchronize (message_center);
+  filter_index_free (old_index);
 }
 
-/**
- * g_message_center_send_full_with_delay:
- */
-void
-g_message_center_send_full_with_delay (GMessageCenter *message_center,
-                                       GObject *sender,
-                                       const gchar *message_name,
-                                       gpointer user_data,
-                                       guint delay)
+/* Must be called with the lock held. Senders see @rc from the next message
+ * they send on */
+static void
+g_message_center_add_to_index (GMessageCenter *message_center, RegisteredCallback *rc)
 {
-  GMessage *msg;
+  GMessageCenterPrivate *priv = message_center->priv;
+  const gchar *pattern = rc->is_pattern ? g_quark_to_string (rc->message_name) : NULL;
+  FilterBucket *bucket;
+  GPtrArray *filters, *old_filters;
+  guint i;
 
-  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
+  if (rc->is_pattern)
+    {
+      bucket = g_topic_trie_lookup (priv->wildcard_callbacks, pattern);
+    }
+  else
+    {
+      bucket = filter_index_lookup (priv->registered_callbacks, rc->sender, rc->message_name);
+    }
 
-  msg = g_message_new (sender, message_name, user_data);
-  if (msg != NULL)
+  if (bucket == NULL)
     {
-      g_message_center_send_with_delay (message_center, msg, delay);
-      g_object_unref (msg);
+      filters = filter_array_new (1);
+      g_ptr_array_add (filters, registered_callback_ref (rc));
+
+      if (rc->is_pattern)
+        {
+          GTopicTrie *old_trie = priv->wildcard_callbacks;
+          GTopicTrie *trie = g_topic_trie_copy (old_trie, filter_bucket_copy_ref, NULL);
+
+          g_topic_trie_insert (trie, pattern, filter_bucket_new (NULL, rc->message_name, filters));
+          g_atomic_pointer_set (&priv->wildcard_callbacks, trie);
+          g_message_center_synchronize (message_center);
+          g_topic_trie_free (old_trie);
+        }
+      else
+        {
+          if (priv->registered_callbacks->n_buckets >= priv->registered_callbacks->n_slots)
+            g_message_center_grow_index (message_center);
+          filter_index_insert (priv->registered_callbacks,
+                               filter_bucket_new (rc->sender, rc->message_name, filters));
+        }
+      return;
+    }
+
+  old_filters = bucket->filters;
+  filters = filter_array_new (old_filters->len + 1);
+  for (i = 0; i < old_filters->len; i++)
+    {
+      g_ptr_array_add (filters, registered_callback_ref (g_ptr_array_index (old_filters, i)));
     }
+  g_ptr_array_add (filters, registered_callback_ref (rc));
+
+  g_atomic_pointer_set (&bucket->filters, filters);
+  g_message_center_synchronize (message_center);
+  g_ptr_array_unref (old_filters);
 }
 
-/**
- * g_message_center_filter:
+static gint
+compare_filter_serials (gconstpointer a, gconstpointer b)
+{
+  const RegisteredCallback *rc_a = *((RegisteredCallback **) a);
+  const RegisteredCallback *rc_b = *((RegisteredCallback **) b);
+
+  return rc_a->serial < rc_b->serial ? -1 : (rc_a->serial > rc_b->serial ? 1 : 0);
+}
+
+/* Must be called with the lock held. Rebuilds the index with only the
+ * filters that were not removed.
  */
-void
-g_message_center_filter (GMessageCenter *message_center,
-                         GObject *sender,
-                         const gchar *message_name,
-                         GMessageCenterFilterFunc callback,
-                         gpointer user_data)
+static void
+g_message_center_collect_removed_filters (GMessageCenter *message_center)
 {
-  RegisteredCallback *rc;
+  GMessageCenterPrivate *priv = message_center->priv;
+  FilterIndex *old_index = priv->registered_callbacks;
+  GTopicTrie *old_trie = priv->wildcard_callbacks;
+  FilterIndex *index;
+  GTopicTrie *trie;
+  GPtrArray *live_filters;
+  GHashTableIter iter;
+  gpointer value;
+  guint i;
 
-  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
-  g_return_if_fail (G_IS_OBJECT (sender) || message_name != NULL);
-  g_return_if_fail (callback != NULL);
+  live_filters = g_ptr_array_sized_new (g_hash_table_size (priv->filters_by_id));
+  g_hash_table_iter_init (&iter, priv->filters_by_id);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      g_ptr_array_add (live_filters, value);
+    }
+  g_ptr_array_sort (live_filters, compare_filter_serials);
 
-  rc = g_new0 (RegisteredCallback, 1);
-  rc->sender = G_IS_OBJECT (sender) ? g_object_ref (sender) : NULL;
-  rc->message_name = g_strdup (message_name);
+  /* Senders can't see the new index until it is complete, so its buckets
+   * are filled in place */
+  index = filter_index_new (old_index->n_slots);
+  trie = g_topic_trie_new (filter_bucket_unref);
+  for (i = 0; i < live_filters->len; i++)
+    {
+      RegisteredCallback *rc = g_ptr_array_index (live_filters, i);
+      FilterBucket *bucket;
+
+      if (rc->is_pattern)
+        {
+          bucket = g_topic_trie_lookup (trie, g_quark_to_string (rc->message_name));
+        }
+      else
+        {
+          bucket = filter_index_lookup (index, rc->sender, rc->message_name);
+        }
+
+      if (bucket == NULL)
+        {
+          bucket = filter_bucket_new (rc->is_pattern ? NULL : rc->sender, rc->message_name, filter_array_new (1));
+          if (rc->is_pattern)
+            g_topic_trie_insert (trie, g_quark_to_string (rc->message_name), bucket);
+          else
+            filter_index_insert (index, bucket);
+        }
+      g_ptr_array_add (bucket->filters, registered_callback_ref (rc));
+    }
+
+  g_atomic_pointer_set (&priv->registered_callbacks, index);
+  g_atomic_pointer_set (&priv->wildcard_callbacks, trie);
+  g_message_center_synchronize (message_center);
+  filter_index_free (old_index);
+  g_topic_trie_free (old_trie);
+
+  priv->n_removed_filters = 0;
+  g_ptr_array_unref (live_filters);
+}
+
+static void filter_weak_notify (gpointer data, GObject *where_the_object_was);
+
+/* Must be called with the lock held */
+static void
+g_message_center_remove_filter (GMessageCenter *message_center, RegisteredCallback *rc)
+{
+  GMessageCenterPrivate *priv = message_center->priv;
+
+  g_atomic_int_set (&rc->removed, TRUE);
+
+  if (rc->watching_sender)
+    {
+      g_object_weak_unref (rc->sender, filter_weak_notify, rc);
+      rc->watching_sender = FALSE;
+    }
+  if (rc->watching_object)
+    {
+      g_object_weak_unref (rc->object, filter_weak_notify, rc);
+      rc->watching_object = FALSE;
+    }
+
+  priv->n_removed_filters++;
+  g_hash_table_remove (priv->filters_by_id, GUINT_TO_POINTER (rc->id));
+
+  if (priv->n_removed_filters >= MIN_REMOVED_FILTERS_TO_COLLECT &&
+      priv->n_removed_filters > g_hash_table_size (priv->filters_by_id))
+    {
+      g_message_center_collect_removed_filters (message_center);
+    }
+}
+
+/* Tells subclasses about a filter being added or removed. Must be called
+ * without the lock held */
+static void
+g_message_center_filter_changed (GMessageCenter *message_center,
+                                 GObject *sender,
+                                 GQuark message_name,
+                                 gboolean added)
+{
+  GMessageCenterClass *klass = G_MESSAGE_CENTER_GET_CLASS (message_center);
+
+  if (klass->filter_changed != NULL)
+    klass->filter_changed (message_center, sender, g_quark_to_string (message_name), added);
+}
+
+static void
+filter_weak_notify (gpointer data, GObject *where_the_object_was)
+{
+  RegisteredCallback *rc = data;
+  GMessageCenter *message_center = rc->message_center;
+  GObject *sender = rc->sender;
+  GQuark message_name = rc->message_name;
+  gboolean removed = FALSE;
+
+  g_mutex_lock (&message_center->priv->lock);
+
+  /* The weak reference is gone already, don't try to remove it */
+  if (rc->sender == where_the_object_was)
+    rc->watching_sender = FALSE;
+  if (rc->object == where_the_object_was)
+    rc->watching_object = FALSE;
+
+  if (!g_atomic_int_get (&rc->removed))
+    {
+      g_message_center_remove_filter (message_center, rc);
+      removed = TRUE;
+    }
+
+  g_mutex_unlock (&message_center->priv->lock);
+
+  if (removed)
+    g_message_center_filter_changed (message_center, sender, message_name, FALSE);
+}
+
+static void
+rate_limit_free (gpointer data)
+{
+  RateLimit *limit = data;
+
+  /* Deferred messages keep the center alive through their timer, so there
+   * are none left when it is finalized */
+  g_queue_foreach (&limit->deferred, (GFunc) g_object_unref, NULL);
+  g_queue_clear (&limit->deferred);
+  g_free (limit);
+}
+
+static void rate_limit_weak_notify (gpointer data, GObject *where_the_object_was);
+
+/* Must be called with the lock held. Returns the deferred messages, which
+ * must be delivered, and unreferenced, once the lock is released */
+static GList *
+g_message_center_remove_rate_limit (GMessageCenter *message_center, RateLimit *limit)
+{
+  GMessageCenterPrivate *priv = message_center->priv;
+  GList *deferred;
+
+  if (limit->watching_sender)
+    {
+      g_object_weak_unref (limit->key.sender, rate_limit_weak_notify, limit);
+      limit->watching_sender = FALSE;
+    }
+  if (limit->timer != 0)
+    {
+      g_timer_wheel_cancel (priv->scheduler, limit->timer);
+    }
+
+  deferred = limit->deferred.head;
+  g_queue_init (&limit->deferred);
+
+  g_hash_table_remove (priv->rate_limits, &limit->key);
+  g_atomic_int_add (&priv->n_rate_limits, -1);
+
+  return deferred;
+}
+
+static void
+rate_limit_weak_notify (gpointer data, GObject *where_the_object_was)
+{
+  RateLimit *limit = data;
+  GMessageCenter *message_center = limit->message_center;
+  GList *deferred;
+
+  g_mutex_lock (&message_center->priv->lock);
+  /* The weak reference is gone already, don't try to remove it */
+  limit->watching_sender = FALSE;
+  /* Deferred messages hold a reference on the sender, so there are none */
+  deferred = g_message_center_remove_rate_limit (message_center, limit);
+  g_mutex_unlock (&message_center->priv->lock);
+
+  g_list_free_full (deferred, g_object_unref);
+}
+
+static void
+g_message_center_dispose (GObject *object)
+{
+  GMessageCenter *message_center = G_MESSAGE_CENTER (object);
+  GHashTableIter iter;
+  gpointer value;
+
+  /* Stop watching senders and objects, they could outlive us */
+  g_mutex_lock (&message_center->priv->lock);
+  g_hash_table_iter_init (&iter, message_center->priv->filters_by_id);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      RegisteredCallback *rc = value;
+
+      if (rc->watching_sender)
+        g_object_weak_unref (rc->sender, filter_weak_notify, rc);
+      if (rc->watching_object)
+        g_object_weak_unref (rc->object, filter_weak_notify, rc);
+      rc->watching_sender = rc->watching_object = FALSE;
+    }
+  g_hash_table_iter_init (&iter, message_center->priv->rate_limits);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      RateLimit *limit = value;
+
+      if (limit->watching_sender)
+        g_object_weak_unref (limit->key.sender, rate_limit_weak_notify, limit);
+      limit->watching_sender = FALSE;
+    }
+  g_mutex_unlock (&message_center->priv->lock);
+
+  G_OBJECT_CLASS (g_message_center_parent_class)->dispose (object);
+}
+
+static void
+g_message_center_finalize (GObject *object)
+{
+  GMessageCenter *message_center = G_MESSAGE_CENTER (object);
+
+  if (message_center->priv != NULL) {
+    guint i;
+
+    /* Queued messages hold a reference on us, so lanes are empty by now */
+    for (i = 0; i < N_PRIORITY_LANES; i++)
+      {
+        if (message_center->priv->lanes[i] != NULL)
+          {
+            g_source_destroy (message_center->priv->lanes[i]);
+            g_clear_pointer (&message_center->priv->lanes[i], g_source_unref);
+          }
+      }
+    g_clear_pointer (&message_center->priv->scheduler, g_timer_wheel_free);
+    /* Pending dispatches hold a reference on us, so there are none left */
+    if (message_center->priv->dispatch_source != NULL)
+      {
+        g_source_destroy (message_center->priv->dispatch_source);
+        g_clear_pointer (&message_center->priv->dispatch_source, g_source_unref);
+      }
+    g_clear_pointer (&message_center->priv->dispatch_context, g_main_context_unref);
+    /* This might be running in a worker, don't wait for them */
+    if (message_center->priv->workers != NULL)
+      {
+        g_thread_pool_free (message_center->priv->workers, FALSE, FALSE);
+      }
+    g_clear_pointer (&message_center->priv->sender_queues, g_hash_table_destroy);
+    topic_counts_free (message_center->priv->topic_counts);
+    message_center->priv->topic_counts = NULL;
+    g_slist_free_full (message_center->priv->old_topic_counts, g_free);
+    message_center->priv->old_topic_counts = NULL;
+    g_clear_pointer (&message_center->priv->retained_messages, g_hash_table_destroy);
+    g_clear_pointer (&message_center->priv->journal, g_message_journal_free);
+    g_clear_pointer (&message_center->priv->rate_limits, g_hash_table_destroy);
+    /* Pending requests hold a reference on us, so this is empty by now */
+    g_clear_pointer (&message_center->priv->pending_requests, g_hash_table_destroy);
+    g_mutex_clear (&message_center->priv->stats_lock);
+    g_clear_pointer (&message_center->priv->coalesced_messages, g_hash_table_destroy);
+    g_clear_pointer (&message_center->priv->filters_by_id, g_hash_table_destroy);
+    g_clear_pointer (&message_center->priv->registered_callbacks, filter_index_free);
+    g_clear_pointer (&message_center->priv->wildcard_callbacks, g_topic_trie_free);
+    g_mutex_clear (&message_center->priv->lock);
+  }
+
+  G_OBJECT_CLASS (g_message_center_parent_class)->finalize (object);
+}
+
+static void
+g_message_center_class_init (GMessageCenterClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->dispose = g_message_center_dispose;
+  object_class->finalize = g_message_center_finalize;
+
+  message_center_signals[MESSAGE_RECEIVED_SIGNAL] =
+		g_signal_new ("message-received",
+                  G_OBJECT_CLASS_TYPE (object_class),
+                  G_SIGNAL_RUN_LAST,
+                  G_STRUCT_OFFSET (GMessageCenterClass, message_received),
+                  NULL, NULL,
+                  g_cclosure_marshal_VOID__OBJECT,
+                  G_TYPE_NONE, 1,
+                  G_TYPE_OBJECT);
+
+  /**
+   * GMessageCenter::slow-handler:
+   * @message_center: the #GMessageCenter
+   * @message: the message the filter was called for
+   * @filter_id: the ID of the filter
+   * @elapsed: the time the filter took, in microseconds
+   *
+   * Emitted, from the thread the filter ran on, after a filter took longer
+   * than the budget set with g_message_center_set_handler_budget().
+   */
+  message_center_signals[SLOW_HANDLER_SIGNAL] =
+    g_signal_new ("slow-handler",
+                  G_OBJECT_CLASS_TYPE (object_class),
+                  G_SIGNAL_RUN_LAST,
+                  G_STRUCT_OFFSET (GMessageCenterClass, slow_handler),
+                  NULL, NULL,
+                  NULL,
+                  G_TYPE_NONE, 3,
+                  G_TYPE_MESSAGE,
+                  G_TYPE_UINT,
+                  G_TYPE_INT64);
+}
+
+static void
+g_message_center_init (GMessageCenter *message_center)
+{
+  message_center->priv = g_message_center_get_instance_private (message_center);
+  g_mutex_init (&message_center->priv->lock);
+  message_center->priv->registered_callbacks = filter_index_new (FILTER_INDEX_MIN_SLOTS);
+  message_center->priv->wildcard_callbacks = g_topic_trie_new (filter_bucket_unref);
+  message_center->priv->filters_by_id = g_hash_table_new_full (NULL, NULL, NULL, registered_callback_unref);
+  message_center->priv->next_filter_id = 1;
+  message_center->priv->coalesced_messages = g_hash_table_new (coalesce_key_hash, coalesce_key_equal);
+  g_queue_init (&message_center->priv->pending_dispatches);
+  message_center->priv->sender_queues = g_hash_table_new (NULL, NULL);
+  g_mutex_init (&message_center->priv->stats_lock);
+  message_center->priv->retained_messages = g_hash_table_new_full (NULL, NULL, NULL, g_object_unref);
+  message_center->priv->rate_limits = g_hash_table_new_full (filter_key_hash, filter_key_equal, NULL, rate_limit_free);
+  message_center->priv->pending_requests = g_hash_table_new (g_int64_hash, g_int64_equal);
+  message_center->priv->next_correlation_id = 1;
+}
+
+/* Must be called from a read section */
+static void
+filter_cursor_append (FilterCursor *cursor, FilterBucket *bucket)
+{
+  GPtrArray *filters;
+
+  if (bucket == NULL)
+    return;
+
+  filters = g_atomic_pointer_get (&bucket->filters);
+  if (filters->len == 0)
+    return;
+
+  if (cursor->n_buckets == cursor->allocated)
+    {
+      cursor->allocated *= 2;
+      if (cursor->buckets == cursor->buckets_prealloc)
+        {
+          cursor->buckets = g_new (GPtrArray *, cursor->allocated);
+          cursor->positions = g_new (guint, cursor->allocated);
+          memcpy (cursor->buckets, cursor->buckets_prealloc, sizeof (GPtrArray *) * cursor->n_buckets);
+          memcpy (cursor->positions, cursor->positions_prealloc, sizeof (guint) * cursor->n_buckets);
+        }
+      else
+        {
+          cursor->buckets = g_renew (GPtrArray *, cursor->buckets, cursor->allocated);
+          cursor->positions = g_renew (guint, cursor->positions, cursor->allocated);
+        }
+    }
+
+  cursor->buckets[cursor->n_buckets] = g_ptr_array_ref (filters);
+  cursor->positions[cursor->n_buckets] = 0;
+  cursor->n_buckets++;
+}
+
+static void
+filter_cursor_add_bucket (FilterCursor *cursor, FilterIndex *index, GObject *sender, GQuark message_name)
+{
+  filter_cursor_append (cursor, filter_index_lookup (index, sender, message_name));
+}
+
+static void
+filter_cursor_add_wildcard_bucket (gpointer value, gpointer user_data)
+{
+  filter_cursor_append (user_data, value);
+}
+
+/* Takes the filters currently registered for messages from @sender named
+ * @message_name, without taking the lock */
+static void
+filter_cursor_init (FilterCursor *cursor, GMessageCenter *message_center, GObject *sender, GQuark message_name)
+{
+  GMessageCenterPrivate *priv = message_center->priv;
+  FilterIndex *index;
+  gint phase;
+
+  cursor->buckets = cursor->buckets_prealloc;
+  cursor->positions = cursor->positions_prealloc;
+  cursor->n_buckets = 0;
+  cursor->allocated = FILTER_CURSOR_PREALLOC;
+
+  phase = g_message_center_begin_read (message_center);
+  index = g_atomic_pointer_get (&priv->registered_callbacks);
+
+  if (message_name != 0)
+    {
+      GTopicTrie *wildcard_callbacks = g_atomic_pointer_get (&priv->wildcard_callbacks);
+
+      filter_cursor_add_bucket (cursor, index, sender, message_name);
+      filter_cursor_add_bucket (cursor, index, NULL, message_name);
+
+      if (!g_topic_trie_is_empty (wildcard_callbacks))
+        {
+          g_topic_trie_match (wildcard_callbacks,
+                              g_quark_to_string (message_name),
+                              filter_cursor_add_wildcard_bucket,
+                              cursor);
+        }
+    }
+  filter_cursor_add_bucket (cursor, index, sender, 0);
+
+  g_message_center_end_read (message_center, phase);
+}
+
+static void
+filter_cursor_clear (FilterCursor *cursor)
+{
+  guint i;
+
+  for (i = 0; i < cursor->n_buckets; i++)
+    {
+      g_ptr_array_unref (cursor->buckets[i]);
+    }
+  if (cursor->buckets != cursor->buckets_prealloc)
+    {
+      g_free (cursor->buckets);
+      g_free (cursor->positions);
+    }
+}
+
+/* Returns the matching filters in the order they were registered, by merging
+ * the (already ordered) buckets on their serial number.
+ */
+static RegisteredCallback *
+filter_cursor_next (FilterCursor *cursor)
+{
+  RegisteredCallback *next = NULL;
+  guint i, next_bucket = 0;
+
+  for (i = 0; i < cursor->n_buckets; i++)
+    {
+      RegisteredCallback *rc;
+
+      if (cursor->positions[i] >= cursor->buckets[i]->len)
+        continue;
+
+      rc = g_ptr_array_index (cursor->buckets[i], cursor->positions[i]);
+      if (next == NULL || rc->serial < next->serial)
+        {
+          next = rc;
+          next_bucket = i;
+        }
+    }
+
+  if (next != NULL)
+    cursor->positions[next_bucket]++;
+
+  return next;
+}
+
+/**
+ * g_message_center_get:
+ */
+GMessageCenter *
+g_message_center_get (void)
+{
+  static GMessageCenter *message_center = NULL;
+
+  if (g_once_init_enter (&message_center))
+    {
+      g_once_init_leave (&message_center, g_object_new (G_TYPE_MESSAGE_CENTER, NULL));
+    }
+
+  return message_center;
+}
+
+typedef struct
+{
+  GMessageCenter *message_center;
+  GPtrArray *messages;
+  RegisteredCallback *rc;
+} ContextInvocation;
+
+/* Calls a filter right away, timing it if anybody wants to know */
+static void
+g_message_center_run_filter (GMessageCenter *message_center,
+                             RegisteredCallback *rc,
+                             GMessage **messages,
+                             guint n_messages)
+{
+  gint budget = g_atomic_int_get (&message_center->priv->handler_budget);
+  gint64 start = 0, elapsed;
+  guint bucket, i;
+
+  if (budget > 0 || g_atomic_int_get (&message_center->priv->stats_enabled))
+    {
+      start = g_get_monotonic_time ();
+    }
+
+  if (rc->batch_callback != NULL)
+    {
+      rc->batch_callback (message_center, messages, n_messages, rc->user_data);
+    }
+  else
+    {
+      for (i = 0; i < n_messages; i++)
+        {
+          rc->callback (message_center, messages[i], rc->user_data);
+        }
+    }
+
+  if (start == 0)
+    return;
+
+  elapsed = g_get_monotonic_time () - start;
+
+  bucket = elapsed > 0 ? g_bit_storage ((gulong) elapsed) : 0;
+  g_atomic_int_inc (&rc->latency_histogram[MIN (bucket, N_LATENCY_BUCKETS - 1)]);
+
+  if (budget > 0 && elapsed > budget)
+    {
+      g_signal_emit (message_center, message_center_signals[SLOW_HANDLER_SIGNAL], 0,
+                     messages[0], rc->id, elapsed);
+    }
+}
+
+static gboolean
+context_invocation_cb (gpointer user_data)
+{
+  ContextInvocation *invocation = user_data;
+
+  /* the filter could have been removed in the meantime */
+  if (g_atomic_int_get (&invocation->rc->removed))
+    return G_SOURCE_REMOVE;
+
+  g_message_center_run_filter (invocation->message_center,
+                               invocation->rc,
+                               (GMessage **) invocation->messages->pdata,
+                               invocation->messages->len);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+context_invocation_free (gpointer user_data)
+{
+  ContextInvocation *invocation = user_data;
+
+  g_object_unref (invocation->message_center);
+  g_ptr_array_unref (invocation->messages);
+  registered_callback_unref (invocation->rc);
+  g_free (invocation);
+}
+
+static void
+g_message_center_call_filter (GMessageCenter *message_center,
+                              RegisteredCallback *rc,
+                              GMessage **messages,
+                              guint n_messages)
+{
+  ContextInvocation *invocation;
+  GSource *source;
+  guint i;
+
+  if (rc->context == NULL || g_main_context_is_owner (rc->context))
+    {
+      g_message_center_run_filter (message_center, rc, messages, n_messages);
+      return;
+    }
+
+  invocation = g_new0 (ContextInvocation, 1);
+  invocation->message_center = g_object_ref (message_center);
+  invocation->messages = g_ptr_array_new_full (n_messages, g_object_unref);
+  for (i = 0; i < n_messages; i++)
+    {
+      g_ptr_array_add (invocation->messages, g_object_ref (messages[i]));
+    }
+  invocation->rc = registered_callback_ref (rc);
+
+  source = g_idle_source_new ();
+  g_source_set_priority (source, G_PRIORITY_DEFAULT);
+  g_source_set_callback (source, context_invocation_cb, invocation, context_invocation_free);
+  g_source_attach (source, rc->context);
+  g_source_unref (source);
+}
+
+static void g_message_center_coalesce (GMessageCenter *message_center,
+                                       RegisteredCallback *rc,
+                                       GMessage *message,
+                                       guint window,
+                                       GMessageCenterCoalesceMode mode);
+
+static void
+g_message_center_invoke_filter (GMessageCenter *message_center,
+                                RegisteredCallback *rc,
+                                GMessage **messages,
+                                guint n_messages)
+{
+  guint window = g_atomic_int_get (&rc->coalesce_window);
+  guint i;
+
+  if (window > 0)
+    {
+      for (i = 0; i < n_messages; i++)
+        {
+          g_message_center_coalesce (message_center, rc, messages[i], window, g_atomic_int_get (&rc->coalesce_mode));
+        }
+    }
+  else
+    {
+      g_message_center_call_filter (message_center, rc, messages, n_messages);
+    }
+}
+
+/* Returns chunk @i of the topic counts, allocating it, and a bigger
+ * TopicCounts if needed */
+static gsize *
+topic_counts_add_chunk (GMessageCenter *message_center, guint i)
+{
+  GMessageCenterPrivate *priv = message_center->priv;
+  TopicCounts *counts;
+  gsize *chunk;
+
+  g_mutex_lock (&priv->stats_lock);
+
+  counts = priv->topic_counts;
+  if (counts == NULL || i >= counts->n_chunks)
+    {
+      guint n_chunks = MAX (i + 1, counts != NULL ? counts->n_chunks * 2 : 0);
+      TopicCounts *new_counts = g_malloc0 (sizeof (TopicCounts) + n_chunks * sizeof (gsize *));
+
+      new_counts->n_chunks = n_chunks;
+      if (counts != NULL)
+        {
+          memcpy (new_counts->chunks, counts->chunks, counts->n_chunks * sizeof (gsize *));
+          /* Senders may still be looking at it */
+          priv->old_topic_counts = g_slist_prepend (priv->old_topic_counts, counts);
+        }
+      g_atomic_pointer_set (&priv->topic_counts, new_counts);
+      counts = new_counts;
+    }
+
+  chunk = counts->chunks[i];
+  if (chunk == NULL)
+    {
+      chunk = g_new0 (gsize, TOPIC_COUNTS_CHUNK);
+      g_atomic_pointer_set (&counts->chunks[i], chunk);
+    }
+
+  g_mutex_unlock (&priv->stats_lock);
+
+  return chunk;
+}
+
+/* Notifies the listeners of the message-received signal, if there are any,
+ * as emitting a signal is costly compared to the rest of sending a message */
+static void
+g_message_center_notify_listeners (GMessageCenter *message_center, GMessage *message)
+{
+  if (G_MESSAGE_CENTER_GET_CLASS (message_center)->message_received != NULL ||
+      g_signal_has_handler_pending (message_center, message_center_signals[MESSAGE_RECEIVED_SIGNAL], 0, FALSE))
+    {
+      g_signal_emit (message_center, message_center_signals[MESSAGE_RECEIVED_SIGNAL], 0, message);
+    }
+
+  if (g_atomic_int_get (&message_center->priv->stats_enabled))
+    {
+      GQuark message_name = g_message_get_name_quark (message);
+      TopicCounts *counts = g_atomic_pointer_get (&message_center->priv->topic_counts);
+      guint i = message_name / TOPIC_COUNTS_CHUNK;
+      gsize *chunk = NULL;
+
+      if (counts != NULL && i < counts->n_chunks)
+        chunk = g_atomic_pointer_get (&counts->chunks[i]);
+      if (chunk == NULL)
+        chunk = topic_counts_add_chunk (message_center, i);
+
+      g_atomic_pointer_add (&chunk[message_name % TOPIC_COUNTS_CHUNK], 1);
+    }
+}
+
+/* Moves a cursor to a PendingDispatch, which doesn't live at the same
+ * address, so the preallocated arrays must be pointed to again */
+static void
+filter_cursor_move (FilterCursor *dest, FilterCursor *src)
+{
+  *dest = *src;
+  if (src->buckets == src->buckets_prealloc)
+    {
+      dest->buckets = dest->buckets_prealloc;
+      dest->positions = dest->positions_prealloc;
+    }
+}
+
+/* A dispatch which ran out of time, or queued behind one, continued from
+ * an idle source on the global default main context. The cursor is kept as
+ * it was, so filters are still called in order, from next_filter on */
+typedef struct
+{
+  GMessageCenter *message_center;
+  GMessage **messages;
+  guint n_messages;
+  FilterCursor cursor;
+  RegisteredCallback *next_filter;
+} PendingDispatch;
+
+/* Takes over @cursor */
+static PendingDispatch *
+pending_dispatch_new (GMessageCenter *message_center,
+                      FilterCursor *cursor,
+                      GMessage **messages,
+                      guint n_messages)
+{
+  PendingDispatch *pending = g_new0 (PendingDispatch, 1);
+  guint i;
+
+  pending->message_center = g_object_ref (message_center);
+  filter_cursor_move (&pending->cursor, cursor);
+  pending->messages = g_new (GMessage *, n_messages);
+  for (i = 0; i < n_messages; i++)
+    {
+      pending->messages[i] = g_object_ref (messages[i]);
+    }
+  pending->n_messages = n_messages;
+
+  return pending;
+}
+
+static void
+pending_dispatch_free (PendingDispatch *pending)
+{
+  guint i;
+
+  filter_cursor_clear (&pending->cursor);
+  for (i = 0; i < pending->n_messages; i++)
+    {
+      g_object_unref (pending->messages[i]);
+    }
+  g_free (pending->messages);
+  g_object_unref (pending->message_center);
+  g_free (pending);
+}
+
+/* Calls the filters from @cursor, starting with @rc if not NULL, until
+ * there are no more or @deadline is reached. Returns the next filter to
+ * call in the latter case */
+static RegisteredCallback *
+g_message_center_run_cursor (GMessageCenter *message_center,
+                             FilterCursor *cursor,
+                             RegisteredCallback *rc,
+                             GMessage **messages,
+                             guint n_messages,
+                             gint64 deadline)
+{
+  GObject *sender = g_message_get_sender (messages[0]);
+  gboolean called = FALSE;
+
+  if (rc == NULL)
+    rc = filter_cursor_next (cursor);
+
+  for (; rc != NULL; rc = filter_cursor_next (cursor))
+    {
+      /* Wildcard buckets are shared by all senders */
+      if (rc->sender != NULL && rc->sender != sender)
+        continue;
+      if (g_atomic_int_get (&rc->removed))
+        continue;
+
+      /* At least one filter is called every time, so that it progresses */
+      if (deadline != 0 && called && g_get_monotonic_time () >= deadline)
+        return rc;
+
+      g_message_center_invoke_filter (message_center, rc, messages, n_messages);
+      called = TRUE;
+    }
+
+  return NULL;
+}
+
+static gboolean
+pending_dispatch_cb (gpointer user_data)
+{
+  GMessageCenter *message_center = g_object_ref (user_data);
+  GMessageCenterPrivate *priv = message_center->priv;
+  gint budget = g_atomic_int_get (&priv->dispatch_budget);
+  gint64 deadline = budget > 0 ? g_get_monotonic_time () + budget : 0;
+  gboolean done = FALSE;
+
+  do
+    {
+      PendingDispatch *pending;
+
+      g_mutex_lock (&priv->lock);
+      pending = g_queue_peek_head (&priv->pending_dispatches);
+      g_mutex_unlock (&priv->lock);
+
+      pending->next_filter = g_message_center_run_cursor (message_center,
+                                                          &pending->cursor,
+                                                          pending->next_filter,
+                                                          pending->messages,
+                                                          pending->n_messages,
+                                                          deadline);
+      if (pending->next_filter != NULL)
+        break;
+
+      g_mutex_lock (&priv->lock);
+      g_queue_pop_head (&priv->pending_dispatches);
+      if (g_queue_is_empty (&priv->pending_dispatches))
+        {
+          g_clear_pointer (&priv->dispatch_source, g_source_unref);
+          g_clear_pointer (&priv->dispatch_context, g_main_context_unref);
+          done = TRUE;
+        }
+      g_mutex_unlock (&priv->lock);
+
+      pending_dispatch_free (pending);
+    }
+  while (!done && (deadline == 0 || g_get_monotonic_time () < deadline));
+
+  g_object_unref (message_center);
+
+  return done ? G_SOURCE_REMOVE : G_SOURCE_CONTINUE;
+}
+
+/* Whether dispatches from @context can be time sliced: dispatches are
+ * only continued from one context at a time. Must be called with the lock
+ * held */
+static gboolean
+g_message_center_can_queue_dispatch (GMessageCenter *message_center, GMainContext *context)
+{
+  GMessageCenterPrivate *priv = message_center->priv;
+
+  return g_queue_is_empty (&priv->pending_dispatches) || priv->dispatch_context == context;
+}
+
+/* Queues a dispatch to be continued from @context, which must be allowed
+ * by g_message_center_can_queue_dispatch(). Must be called with the lock
+ * held */
+static void
+g_message_center_queue_dispatch (GMessageCenter *message_center, GMainContext *context, PendingDispatch *pending)
+{
+  GMessageCenterPrivate *priv = message_center->priv;
+
+  g_queue_push_tail (&priv->pending_dispatches, pending);
+  if (priv->dispatch_source == NULL)
+    {
+      /* Below redrawing, so that the UI is updated in between */
+      priv->dispatch_source = g_idle_source_new ();
+      g_source_set_priority (priv->dispatch_source, G_PRIORITY_DEFAULT_IDLE);
+      g_source_set_callback (priv->dispatch_source, pending_dispatch_cb, message_center, NULL);
+      g_source_set_name (priv->dispatch_source, "GMessageCenter dispatch");
+      g_source_attach (priv->dispatch_source, context);
+      priv->dispatch_context = g_main_context_ref (context);
+    }
+}
+
+/* Calls all filters from @cursor, which is cleared, for messages which all
+ * have the same sender and name */
+static void
+g_message_center_dispatch (GMessageCenter *message_center,
+                           FilterCursor *cursor,
+                           GMessage **messages,
+                           guint n_messages)
+{
+  GMessageCenterPrivate *priv = message_center->priv;
+  gint budget = g_atomic_int_get (&priv->dispatch_budget);
+  GMainContext *context = NULL;
+  gint64 deadline = 0;
+  RegisteredCallback *rc;
+
+  /* Only dispatching from the thread default main context, while its loop
+   * runs, is time sliced, as other threads might not run one */
+  if (budget > 0)
+    {
+      context = g_main_context_ref_thread_default ();
+      if (!g_main_context_is_owner (context))
+        g_clear_pointer (&context, g_main_context_unref);
+    }
+  if (context != NULL)
+    {
+      g_mutex_lock (&priv->lock);
+      if (!g_message_center_can_queue_dispatch (message_center, context))
+        {
+          g_clear_pointer (&context, g_main_context_unref);
+        }
+      else if (!g_queue_is_empty (&priv->pending_dispatches))
+        {
+          /* Don't overtake the messages not fully dispatched yet */
+          g_message_center_queue_dispatch (message_center,
+                                           context,
+                                           pending_dispatch_new (message_center, cursor, messages, n_messages));
+          g_mutex_unlock (&priv->lock);
+          g_main_context_unref (context);
+          return;
+        }
+      g_mutex_unlock (&priv->lock);
+
+      if (context != NULL)
+        deadline = g_get_monotonic_time () + budget;
+    }
+
+  rc = g_message_center_run_cursor (message_center, cursor, NULL, messages, n_messages, deadline);
+  if (rc != NULL)
+    {
+      g_mutex_lock (&priv->lock);
+      if (g_message_center_can_queue_dispatch (message_center, context))
+        {
+          PendingDispatch *pending = pending_dispatch_new (message_center, cursor, messages, n_messages);
+
+          pending->next_filter = rc;
+          g_message_center_queue_dispatch (message_center, context, pending);
+          g_mutex_unlock (&priv->lock);
+          g_main_context_unref (context);
+          return;
+        }
+      g_mutex_unlock (&priv->lock);
+
+      /* Another context started continuing dispatches meanwhile */
+      g_message_center_run_cursor (message_center, cursor, rc, messages, n_messages, 0);
+    }
+  if (context != NULL)
+    g_main_context_unref (context);
+  filter_cursor_clear (cursor);
+}
+
+/* Delivers a message that went through the rate limits */
+static void
+g_message_center_deliver (GMessageCenter *message_center, GMessage *message)
+{
+  FilterCursor cursor;
+
+  /* 1st, notify all listeners */
+  g_message_center_notify_listeners (message_center, message);
+
+  /* 2nd, notify registered filters. Filters registered from the callbacks
+   * will only get the next messages.
+   */
+  filter_cursor_init (&cursor, message_center, g_message_get_sender (message), g_message_get_name_quark (message));
+  g_message_center_dispatch (message_center, &cursor, &message, 1);
+}
+
+static void
+rate_limit_refill (RateLimit *limit, gint64 now)
+{
+  limit->tokens = MIN (limit->burst, limit->tokens + (now - limit->last_refill) * limit->rate);
+  limit->last_refill = now;
+}
+
+/* Milliseconds until @limit has a token again, rounded up */
+static guint
+rate_limit_get_wait (RateLimit *limit)
+{
+  return (guint) ((1.0 - limit->tokens) / limit->rate / 1000.0) + 1;
+}
+
+typedef struct
+{
+  GMessageCenter *message_center;
+  FilterKey key;
+} RateLimitRelease;
+
+static void
+rate_limit_release_free (gpointer data)
+{
+  RateLimitRelease *release = data;
+
+  g_object_unref (release->message_center);
+  g_free (release);
+}
+
+static void rate_limit_release_cb (gpointer user_data);
+
+/* Must be called with the lock held */
+static void
+rate_limit_schedule_release (GMessageCenter *message_center, RateLimit *limit)
+{
+  RateLimitRelease *release = g_new0 (RateLimitRelease, 1);
+
+  release->message_center = g_object_ref (message_center);
+  release->key = limit->key;
+  limit->timer = g_timer_wheel_add (message_center->priv->scheduler,
+                                    rate_limit_get_wait (limit),
+                                    rate_limit_release_cb,
+                                    release,
+                                    rate_limit_release_free);
+}
+
+/* Delivers the deferred messages the limit has tokens for */
+static void
+rate_limit_release_cb (gpointer user_data)
+{
+  RateLimitRelease *release = user_data;
+  GMessageCenter *message_center = release->message_center;
+  RateLimit *limit;
+  GQueue ready = G_QUEUE_INIT;
+  GMessage *message;
+
+  g_mutex_lock (&message_center->priv->lock);
+  limit = g_hash_table_lookup (message_center->priv->rate_limits, &release->key);
+  /* Removing the limit cancels the timer, but it might be running already */
+  if (limit != NULL && limit->timer != 0)
+    {
+      limit->timer = 0;
+      rate_limit_refill (limit, g_get_monotonic_time ());
+      while (limit->tokens >= 1.0 && !g_queue_is_empty (&limit->deferred))
+        {
+          g_queue_push_tail (&ready, g_queue_pop_head (&limit->deferred));
+          limit->tokens -= 1.0;
+        }
+      if (!g_queue_is_empty (&limit->deferred))
+        {
+          rate_limit_schedule_release (message_center, limit);
+        }
+    }
+  g_mutex_unlock (&message_center->priv->lock);
+
+  while ((message = g_queue_pop_head (&ready)) != NULL)
+    {
+      g_message_center_deliver (message_center, message);
+      g_object_unref (message);
+    }
+}
+
+/* Checks @message against the rate limits matching it. Returns TRUE if it
+ * can be delivered now, or FALSE if it was dropped, coalesced or deferred.
+ */
+static gboolean
+g_message_center_admit (GMessageCenter *message_center, GMessage *message)
+{
+  GMessageCenterPrivate *priv = message_center->priv;
+  RateLimit *limits[3], *exceeded = NULL;
+  FilterKey keys[3];
+  guint n_limits = 0, window = 0, i;
+  gint64 now = g_get_monotonic_time ();
+
+  keys[0].sender = g_message_get_sender (message);
+  keys[0].message_name = g_message_get_name_quark (message);
+  keys[1].sender = keys[0].sender;
+  keys[1].message_name = 0;
+  keys[2].sender = NULL;
+  keys[2].message_name = keys[0].message_name;
+
+  g_mutex_lock (&priv->lock);
+
+  for (i = 0; i < G_N_ELEMENTS (keys); i++)
+    {
+      RateLimit *limit = g_hash_table_lookup (priv->rate_limits, &keys[i]);
+
+      if (limit == NULL)
+        continue;
+
+      rate_limit_refill (limit, now);
+      /* Deferred messages go first, to keep them in order */
+      if (exceeded == NULL && (limit->tokens < 1.0 || !g_queue_is_empty (&limit->deferred)))
+        exceeded = limit;
+      limits[n_limits++] = limit;
+    }
+
+  if (exceeded == NULL)
+    {
+      /* A message only takes tokens if all its limits let it through */
+      for (i = 0; i < n_limits; i++)
+        {
+          limits[i]->tokens -= 1.0;
+        }
+      g_mutex_unlock (&priv->lock);
+      return TRUE;
+    }
+
+  switch (exceeded->policy)
+    {
+    case G_MESSAGE_CENTER_RATE_LIMIT_DROP:
+      exceeded->n_dropped++;
+      break;
+    case G_MESSAGE_CENTER_RATE_LIMIT_COALESCE:
+      exceeded->n_coalesced++;
+      window = rate_limit_get_wait (exceeded);
+      break;
+    case G_MESSAGE_CENTER_RATE_LIMIT_DEFER:
+      exceeded->n_deferred++;
+      g_queue_push_tail (&exceeded->deferred, g_object_ref (message));
+      if (exceeded->timer == 0)
+        {
+          rate_limit_schedule_release (message_center, exceeded);
+        }
+      break;
+    }
+
+  g_mutex_unlock (&priv->lock);
+
+  /* The coalesced message is sent again once the window ends, and goes
+   * through the limits again then */
+  if (window > 0)
+    {
+      g_message_center_coalesce (message_center, NULL, message, window, G_MESSAGE_CENTER_COALESCE_THROTTLE);
+    }
+
+  return FALSE;
+}
+
+/* Sends a message right away, once it went through the journal */
+static void
+g_message_center_send_now (GMessageCenter *message_center, GMessage *message)
+{
+  if (g_atomic_int_get (&message_center->priv->n_rate_limits) > 0 &&
+      !g_message_center_admit (message_center, message))
+    return;
+
+  g_message_center_deliver (message_center, message);
+}
+
+/* Records @message in the journal, if there is one. Messages are recorded
+ * once, when the center gets them, however they are delivered then */
+static void
+g_message_center_journal (GMessageCenter *message_center, GMessage *message)
+{
+  GMessageJournal *journal = g_atomic_pointer_get (&message_center->priv->journal);
+
+  if (journal != NULL)
+    g_message_journal_append (journal, message);
+}
+
+/**
+ * g_message_center_send:
+ */
+void
+g_message_center_send (GMessageCenter *message_center, GMessage *message)
+{
+  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
+  g_return_if_fail (G_IS_MESSAGE (message));
+
+  g_message_center_journal (message_center, message);
+  g_message_center_send_now (message_center, message);
+}
+
+typedef struct
+{
+  GMessageCenter *message_center;
+  GMessage *message;
+} DelayedMessage;
+
+static void
+delayed_send_message_cb (gpointer user_data)
+{
+  DelayedMessage *dm = (DelayedMessage *) user_data;
+
+  g_message_center_send_now (dm->message_center, dm->message);
+}
+
+static void
+delayed_message_free (gpointer user_data)
+{
+  DelayedMessage *dm = (DelayedMessage *) user_data;
+
+  g_object_unref (dm->message_center);
+  if (dm->message != NULL)
+    {
+      g_object_unref (dm->message);
+    }
+  g_free (dm);
+}
+
+static GTimerWheel *
+g_message_center_get_scheduler (GMessageCenter *message_center)
+{
+  GTimerWheel *scheduler;
+
+  g_mutex_lock (&message_center->priv->lock);
+  if (message_center->priv->scheduler == NULL)
+    {
+      message_center->priv->scheduler = g_timer_wheel_new (NULL);
+    }
+  scheduler = message_center->priv->scheduler;
+  g_mutex_unlock (&message_center->priv->lock);
+
+  return scheduler;
+}
+
+static void
+coalesced_message_free (CoalescedMessage *cm)
+{
+  if (cm->key.rc != NULL)
+    {
+      registered_callback_unref (cm->key.rc);
+    }
+  g_object_unref (cm->message);
+  g_object_unref (cm->message_center);
+  g_free (cm);
+}
+
+static void
+coalesced_message_deliver_cb (gpointer user_data)
+{
+  CoalescedMessage *cm = user_data;
+  GMessageCenter *message_center = cm->message_center;
+
+  /* Messages coming from now on start a new window */
+  g_mutex_lock (&message_center->priv->lock);
+  g_hash_table_remove (message_center->priv->coalesced_messages, &cm->key);
+  g_mutex_unlock (&message_center->priv->lock);
+
+  g_message_set_coalesced_count (cm->message, cm->count);
+  if (cm->key.rc == NULL)
+    {
+      g_message_center_send_now (message_center, cm->message);
+    }
+  else if (!g_atomic_int_get (&cm->key.rc->removed))
+    {
+      g_message_center_call_filter (message_center, cm->key.rc, &cm->message, 1);
+    }
+
+  coalesced_message_free (cm);
+}
+
+/* Keeps @message until the coalescing window for its sender and name ends,
+ * replacing any message already waiting. If @rc is not NULL, the message
+ * will only be delivered to that filter.
+ */
+static void
+g_message_center_coalesce (GMessageCenter *message_center,
+                           RegisteredCallback *rc,
+                           GMessage *message,
+                           guint window,
+                           GMessageCenterCoalesceMode mode)
+{
+  GTimerWheel *scheduler = g_message_center_get_scheduler (message_center);
+  CoalescedMessage *cm;
+  CoalesceKey key;
+  GMessage *latest, *replaced = NULL;
+
+  /* Filters get their own copy, as the message might be a pooled one, and
+   * it is also delivered with a different count to other filters */
+  latest = rc != NULL ? g_message_copy (message) : g_object_ref (message);
+
+  key.rc = rc;
+  key.sender = g_message_get_sender (message);
+  key.message_name = g_message_get_name_quark (message);
+
+  g_mutex_lock (&message_center->priv->lock);
+
+  cm = g_hash_table_lookup (message_center->priv->coalesced_messages, &key);
+  if (cm == NULL)
+    {
+      cm = g_new0 (CoalescedMessage, 1);
+      cm->key = key;
+      if (rc != NULL)
+        {
+          registered_callback_ref (rc);
+        }
+      cm->message_center = g_object_ref (message_center);
+      cm->message = latest;
+      cm->count = g_message_get_coalesced_count (message);
+      g_hash_table_insert (message_center->priv->coalesced_messages, &cm->key, cm);
+
+      cm->timer = g_timer_wheel_add (scheduler, window, coalesced_message_deliver_cb, cm, NULL);
+    }
+  else
+    {
+      replaced = cm->message;
+      cm->message = latest;
+      cm->count += g_message_get_coalesced_count (message);
+
+      /* If cancelling fails, the message is being delivered already, and
+       * will pick this one */
+      if (mode == G_MESSAGE_CENTER_COALESCE_DEBOUNCE && g_timer_wheel_cancel (scheduler, cm->timer))
+        {
+          cm->timer = g_timer_wheel_add (scheduler, window, coalesced_message_deliver_cb, cm, NULL);
+        }
+    }
+
+  g_mutex_unlock (&message_center->priv->lock);
+
+  /* Not with the lock held, this might drop the last reference on a sender */
+  if (replaced != NULL)
+    {
+      g_object_unref (replaced);
+    }
+}
+
+/**
+ * g_message_center_send_coalesced:
+ * @message_center: a #GMessageCenter
+ * @message: the message to send
+ * @window: the coalescing window, in milliseconds
+ * @mode: how to coalesce messages
+ *
+ * Sends @message, coalesced with other messages with the same sender and
+ * name sent with this function within @window. Only the latest one is
+ * delivered, from the global default main context, and
+ * g_message_get_coalesced_count() tells how many messages it stands for.
+ *
+ * This is useful for messages sent much more often than anybody needs to
+ * handle them, like progress updates.
+ */
+void
+g_message_center_send_coalesced (GMessageCenter *message_center,
+                                 GMessage *message,
+                                 guint window,
+                                 GMessageCenterCoalesceMode mode)
+{
+  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
+  g_return_if_fail (G_IS_MESSAGE (message));
+
+  if (window == 0)
+    {
+      g_message_center_send (message_center, message);
+      return;
+    }
+
+  g_message_center_journal (message_center, message);
+  g_message_center_coalesce (message_center, NULL, message, window, mode);
+}
+
+/* Must be called with the lock held */
+static gboolean
+g_message_center_has_urgent_messages (GMessageCenter *message_center)
+{
+  LaneSource *lane = (LaneSource *) message_center->priv->lanes[G_MESSAGE_CENTER_PRIORITY_URGENT];
+
+  return lane != NULL && !g_queue_is_empty (&lane->messages);
+}
+
+static gboolean
+lane_source_dispatch (GSource *source, GSourceFunc callback, gpointer user_data)
+{
+  LaneSource *lane = (LaneSource *) source;
+  GMessageCenter *message_center;
+  GMessageCenterPrivate *priv;
+  gint64 deadline = 0;
+  guint n_messages;
+
+  /* The lane is only ready when it has messages, which keep the center
+   * alive, but the last one could be holding the last reference */
+  message_center = g_object_ref (lane->message_center);
+  priv = message_center->priv;
+
+  g_mutex_lock (&priv->lock);
+
+  /* Messages sent while dispatching wait for the next iteration, and bulk
+   * messages are only dispatched for a slice of time */
+  n_messages = lane->messages.length;
+  if (lane->priority == G_MESSAGE_CENTER_PRIORITY_BULK)
+    {
+      deadline = g_get_monotonic_time () + BULK_TIME_SLICE;
+    }
+
+  while (n_messages-- > 0)
+    {
+      GMessage *message = g_queue_pop_head (&lane->messages);
+
+      g_mutex_unlock (&priv->lock);
+
+      g_message_center_send_now (message_center, message);
+      g_object_unref (message);
+      g_object_unref (message_center);
+
+      g_mutex_lock (&priv->lock);
+
+      /* Let more urgent messages go first */
+      if (lane->priority != G_MESSAGE_CENTER_PRIORITY_URGENT &&
+          g_message_center_has_urgent_messages (message_center))
+        break;
+      if (deadline != 0 && g_get_monotonic_time () >= deadline)
+        break;
+    }
+
+  if (g_queue_is_empty (&lane->messages))
+    {
+      g_source_set_ready_time (source, -1);
+    }
+
+  g_mutex_unlock (&priv->lock);
+
+  g_object_unref (message_center);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs lane_source_funcs = {
+  NULL,
+  NULL,
+  lane_source_dispatch,
+  NULL
+};
+
+/**
+ * g_message_center_send_with_priority:
+ * @message_center: a #GMessageCenter
+ * @message: the message to send
+ * @priority: the priority of the message
+ *
+ * Queues @message for dispatching from the global default main context,
+ * in a separate queue for each priority. Urgent messages are dispatched
+ * before any other source in the main loop, and take precedence over
+ * queued messages of lower priorities. Bulk messages are dispatched only
+ * for a short time in every main loop iteration, so that a flood of them
+ * doesn't hold off anything else.
+ *
+ * Messages of the same priority are dispatched in the order they were
+ * sent. This can be called from any thread.
+ */
+void
+g_message_center_send_with_priority (GMessageCenter *message_center,
+                                     GMessage *message,
+                                     GMessageCenterPriority priority)
+{
+  static const gint source_priorities[N_PRIORITY_LANES] = {
+    G_PRIORITY_HIGH,
+    G_PRIORITY_DEFAULT,
+    G_PRIORITY_LOW
+  };
+  GMessageCenterPrivate *priv;
+  LaneSource *lane;
+
+  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
+  g_return_if_fail (G_IS_MESSAGE (message));
+  g_return_if_fail (priority < N_PRIORITY_LANES);
+
+  priv = message_center->priv;
+
+  g_message_center_journal (message_center, message);
+
+  /* Queued messages keep the center alive */
+  g_object_ref (message_center);
+  g_object_ref (message);
+
+  g_mutex_lock (&priv->lock);
+
+  if (priv->lanes[priority] == NULL)
+    {
+      priv->lanes[priority] = g_source_new (&lane_source_funcs, sizeof (LaneSource));
+      lane = (LaneSource *) priv->lanes[priority];
+      lane->message_center = message_center;
+      lane->priority = priority;
+      g_queue_init (&lane->messages);
+      g_source_set_priority (priv->lanes[priority], source_priorities[priority]);
+      g_source_set_name (priv->lanes[priority], "GMessageCenter lane");
+      g_source_attach (priv->lanes[priority], NULL);
+    }
+
+  lane = (LaneSource *) priv->lanes[priority];
+  if (g_queue_is_empty (&lane->messages))
+    {
+      g_source_set_ready_time (priv->lanes[priority], 0);
+    }
+  g_queue_push_tail (&lane->messages, message);
+
+  g_mutex_unlock (&priv->lock);
+}
+
+static void
+sender_queue_dispatch_func (gpointer data, gpointer user_data)
+{
+  SenderQueue *queue = data;
+  GMessageCenter *message_center;
+  GMessageCenterPrivate *priv;
+  guint n_messages = 0;
+
+  /* Queued messages keep the center alive, but the last one could be
+   * holding the last reference */
+  message_center = g_object_ref (user_data);
+  priv = message_center->priv;
+
+  g_mutex_lock (&priv->lock);
+
+  while (!g_queue_is_empty (&queue->messages) && n_messages++ < SENDER_QUEUE_BATCH)
+    {
+      GMessage *message = g_queue_pop_head (&queue->messages);
+
+      g_mutex_unlock (&priv->lock);
+
+      g_message_center_send_now (message_center, message);
+      g_object_unref (message);
+      g_object_unref (message_center);
+
+      g_mutex_lock (&priv->lock);
+    }
+
+  if (g_queue_is_empty (&queue->messages))
+    {
+      g_hash_table_remove (priv->sender_queues, queue->sender);
+      g_free (queue);
+    }
+  else
+    {
+      /* Go to the back of the line, messages of this sender still can't
+       * be dispatched by any other worker */
+      g_thread_pool_push (priv->workers, queue, NULL);
+    }
+
+  g_mutex_unlock (&priv->lock);
+
+  g_object_unref (message_center);
+}
+
+/**
+ * g_message_center_send_retained:
+ * @message_center: a #GMessageCenter
+ * @message: the message to send
+ *
+ * Sends @message, like g_message_center_send(), and keeps it as the
+ * current value for its name, replacing any message previously retained
+ * with the same name. Filters registered afterwards for that name, or a
+ * pattern or sender matching it, get the retained message as soon as they
+ * are registered, so that they don't miss the current state of things.
+ *
+ * Retained messages, and thus their sender, are kept alive until replaced,
+ * or removed with g_message_center_clear_retained().
+ */
+void
+g_message_center_send_retained (GMessageCenter *message_center, GMessage *message)
+{
+  GQuark name;
+  GMessage *replaced;
+
+  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
+  g_return_if_fail (G_IS_MESSAGE (message));
+
+  name = g_message_get_name_quark (message);
+
+  g_mutex_lock (&message_center->priv->lock);
+  replaced = g_hash_table_lookup (message_center->priv->retained_messages, GUINT_TO_POINTER (name));
+  g_hash_table_steal (message_center->priv->retained_messages, GUINT_TO_POINTER (name));
+  g_hash_table_insert (message_center->priv->retained_messages, GUINT_TO_POINTER (name), g_object_ref (message));
+  g_mutex_unlock (&message_center->priv->lock);
+
+  /* Not with the lock held, this might drop the last reference on a sender */
+  if (replaced != NULL)
+    {
+      g_object_unref (replaced);
+    }
+
+  g_message_center_send (message_center, message);
+}
+
+/**
+ * g_message_center_clear_retained:
+ * @message_center: a #GMessageCenter
+ * @message_name: the name of the retained message
+ *
+ * Forgets the message retained for @message_name, if any.
+ */
+void
+g_message_center_clear_retained (GMessageCenter *message_center, const gchar *message_name)
+{
+  GQuark name;
+  GMessage *message;
+
+  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
+  g_return_if_fail (message_name != NULL);
+
+  name = g_quark_try_string (message_name);
+  if (name == 0)
+    return;
+
+  g_mutex_lock (&message_center->priv->lock);
+  message = g_hash_table_lookup (message_center->priv->retained_messages, GUINT_TO_POINTER (name));
+  if (message != NULL)
+    {
+      g_hash_table_steal (message_center->priv->retained_messages, GUINT_TO_POINTER (name));
+    }
+  g_mutex_unlock (&message_center->priv->lock);
+
+  /* Not with the lock held, this might drop the last reference on a sender */
+  if (message != NULL)
+    {
+      g_object_unref (message);
+    }
+}
+
+/**
+ * g_message_center_send_many:
+ * @message_center: a #GMessageCenter
+ * @messages: (array length=n_messages): the messages to send
+ * @n_messages: the number of messages in @messages
+ *
+ * Sends several messages at once. Messages are grouped by sender and name,
+ * and the filters are looked up only once for each group. Filters
+ * registered with g_message_center_filter_batch() get all the messages of
+ * a group in a single call.
+ *
+ * Messages with the same sender and name are delivered in the order they
+ * are in @messages, and groups in the order of their first message.
+ */
+void
+g_message_center_send_many (GMessageCenter *message_center,
+                            GMessage **messages,
+                            guint n_messages)
+{
+  FilterCursor *cursors;
+  FilterKey *keys;
+  GHashTable *groups_by_key;
+  GPtrArray *groups;
+  guint i;
+
+  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
+  g_return_if_fail (messages != NULL || n_messages == 0);
+
+  for (i = 0; i < n_messages; i++)
+    {
+      g_return_if_fail (G_IS_MESSAGE (messages[i]));
+    }
+
+  if (n_messages == 0)
+    return;
+
+  /* There can't be more groups than messages */
+  keys = g_new (FilterKey, n_messages);
+  groups_by_key = g_hash_table_new (filter_key_hash, filter_key_equal);
+  groups = g_ptr_array_new_with_free_func ((GDestroyNotify) g_ptr_array_unref);
+
+  for (i = 0; i < n_messages; i++)
+    {
+      FilterKey *key = &keys[groups->len];
+      GPtrArray *group;
+
+      g_message_center_journal (message_center, messages[i]);
+      if (g_atomic_int_get (&message_center->priv->n_rate_limits) > 0 &&
+          !g_message_center_admit (message_center, messages[i]))
+        continue;
+
+      g_message_center_notify_listeners (message_center, messages[i]);
+
+      key->sender = g_message_get_sender (messages[i]);
+      key->message_name = g_message_get_name_quark (messages[i]);
+      group = g_hash_table_lookup (groups_by_key, key);
+      if (group == NULL)
+        {
+          group = g_ptr_array_new ();
+          g_ptr_array_add (groups, group);
+          g_hash_table_insert (groups_by_key, key, group);
+        }
+      g_ptr_array_add (group, messages[i]);
+    }
+
+  /* Filters registered from the callbacks don't get the next groups */
+  cursors = g_new (FilterCursor, groups->len);
+  for (i = 0; i < groups->len; i++)
+    {
+      filter_cursor_init (&cursors[i], message_center, keys[i].sender, keys[i].message_name);
+    }
+  for (i = 0; i < groups->len; i++)
+    {
+      GPtrArray *group = g_ptr_array_index (groups, i);
+
+      g_message_center_dispatch (message_center, &cursors[i], (GMessage **) group->pdata, group->len);
+    }
+  g_free (cursors);
+
+  g_hash_table_destroy (groups_by_key);
+  g_ptr_array_unref (groups);
+  g_free (keys);
+}
+
+/**
+ * g_message_center_send_async:
+ * @message_center: a #GMessageCenter
+ * @message: the message to send
+ *
+ * Queues @message for dispatching from a pool of worker threads, and
+ * returns right away, whatever the filters do with it.
+ *
+ * Messages from the same sender are dispatched one at a time, in the order
+ * they were sent, while messages from different senders are dispatched in
+ * parallel. Filters are thus called from the worker threads, except the
+ * ones registered with %G_MESSAGE_CENTER_FILTER_INVOKE_IN_CONTEXT.
+ */
+void
+g_message_center_send_async (GMessageCenter *message_center, GMessage *message)
+{
+  GMessageCenterPrivate *priv;
+  SenderQueue *queue;
+  GObject *sender;
+
+  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
+  g_return_if_fail (G_IS_MESSAGE (message));
+
+  priv = message_center->priv;
+  sender = g_message_get_sender (message);
+
+  g_message_center_journal (message_center, message);
+
+  /* Queued messages keep the center alive */
+  g_object_ref (message_center);
+  g_object_ref (message);
+
+  g_mutex_lock (&priv->lock);
+
+  if (priv->workers == NULL)
+    {
+      priv->workers = g_thread_pool_new (sender_queue_dispatch_func,
+                                         message_center,
+                                         g_get_num_processors (),
+                                         FALSE,
+                                         NULL);
+    }
+
+  queue = g_hash_table_lookup (priv->sender_queues, sender);
+  if (queue == NULL)
+    {
+      queue = g_new0 (SenderQueue, 1);
+      queue->sender = sender;
+      g_queue_init (&queue->messages);
+      g_hash_table_insert (priv->sender_queues, sender, queue);
+      g_thread_pool_push (priv->workers, queue, NULL);
+    }
+  g_queue_push_tail (&queue->messages, message);
+
+  g_mutex_unlock (&priv->lock);
+}
+
+/**
+ * g_message_center_send_with_delay:
+ * @message_center: a #GMessageCenter
+ * @message: the message to send
+ * @delay: the delay, in milliseconds
+ *
+ * Sends @message once @delay is elapsed, from the global default main
+ * context. All delayed messages of @message_center share a single timer
+ * wheel, so lots of them can be pending at a time.
+ *
+ * Returns: a handle to use with g_message_center_cancel_delayed(), or 0 if
+ * @delay is 0, in which case the message is sent right away
+ */
+guint
+g_message_center_send_with_delay (GMessageCenter *message_center, GMessage *message, guint delay)
+{
+  DelayedMessage *dm;
+
+  g_return_val_if_fail (G_IS_MESSAGE_CENTER (message_center), 0);
+  g_return_val_if_fail (G_IS_MESSAGE (message), 0);
+
+  if (delay == 0)
+    {
+      g_message_center_send (message_center, message);
+      return 0;
+    }
+
+  g_message_center_journal (message_center, message);
+
+  dm = g_new0 (DelayedMessage, 1);
+  dm->message_center = g_object_ref (message_center);
+  dm->message = g_object_ref (message);
+
+  return g_timer_wheel_add (g_message_center_get_scheduler (message_center),
+                            delay,
+                            delayed_send_message_cb,
+                            dm,
+                            delayed_message_free);
+}
+
+/**
+ * g_message_center_cancel_delayed:
+ * @message_center: a #GMessageCenter
+ * @handle: a handle returned by g_message_center_send_with_delay()
+ *
+ * Cancels sending a delayed message. This can be called from any thread.
+ *
+ * Returns: %TRUE if the message was cancelled, %FALSE if it was already sent
+ */
+gboolean
+g_message_center_cancel_delayed (GMessageCenter *message_center, guint handle)
+{
+  GTimerWheel *scheduler;
+
+  g_return_val_if_fail (G_IS_MESSAGE_CENTER (message_center), FALSE);
+
+  g_mutex_lock (&message_center->priv->lock);
+  scheduler = message_center->priv->scheduler;
+  g_mutex_unlock (&message_center->priv->lock);
+
+  if (handle == 0 || scheduler == NULL)
+    return FALSE;
+
+  return g_timer_wheel_cancel (scheduler, handle);
+}
+
+/* A request waiting for its reply. The correlation ID is the key in the
+ * pending_requests table. The timeout and cancellation sources only know the
+ * ID, so whichever of the reply, the timeout and the cancellation comes
+ * first takes the request out of the table and completes it, and the
+ * others find nothing to do */
+typedef struct
+{
+  guint64 id;
+  GTask *task;
+  guint timer;
+  GSource *cancel_source;
+} PendingRequest;
+
+typedef struct
+{
+  GMessageCenter *message_center;
+  guint64 id;
+} PendingRequestHandle;
+
+static PendingRequestHandle *
+pending_request_handle_new (GMessageCenter *message_center, guint64 id)
+{
+  PendingRequestHandle *handle = g_new0 (PendingRequestHandle, 1);
+
+  handle->message_center = g_object_ref (message_center);
+  handle->id = id;
+
+  return handle;
+}
+
+static void
+pending_request_handle_free (gpointer data)
+{
+  PendingRequestHandle *handle = data;
+
+  g_object_unref (handle->message_center);
+  g_free (handle);
+}
+
+/* Completes a request with @reply, or with @error_code if @reply is NULL.
+ * Returns FALSE if the request was already completed */
+static gboolean
+g_message_center_complete_request (GMessageCenter *message_center,
+                                   guint64 id,
+                                   GMessage *reply,
+                                   GIOErrorEnum error_code)
+{
+  PendingRequest *pending;
+  GTimerWheel *scheduler;
+
+  g_mutex_lock (&message_center->priv->lock);
+  pending = g_hash_table_lookup (message_center->priv->pending_requests, &id);
+  if (pending != NULL)
+    {
+      g_hash_table_remove (message_center->priv->pending_requests, &id);
+    }
+  scheduler = message_center->priv->scheduler;
+  g_mutex_unlock (&message_center->priv->lock);
+
+  if (pending == NULL)
+    return FALSE;
+
+  if (pending->timer != 0)
+    {
+      g_timer_wheel_cancel (scheduler, pending->timer);
+    }
+  if (pending->cancel_source != NULL)
+    {
+      g_source_destroy (pending->cancel_source);
+      g_source_unref (pending->cancel_source);
+    }
+
+  if (reply != NULL)
+    {
+      g_task_return_pointer (pending->task, g_object_ref (reply), g_object_unref);
+    }
+  else if (error_code == G_IO_ERROR_TIMED_OUT)
+    {
+      g_task_return_new_error (pending->task, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                               "No reply to the request was received in time");
+    }
+  else
+    {
+      g_task_return_new_error (pending->task, G_IO_ERROR, error_code,
+                               "The request was cancelled");
+    }
+
+  g_object_unref (pending->task);
+  g_free (pending);
+
+  return TRUE;
+}
+
+static void
+request_timeout_cb (gpointer user_data)
+{
+  PendingRequestHandle *handle = user_data;
+
+  g_message_center_complete_request (handle->message_center, handle->id, NULL, G_IO_ERROR_TIMED_OUT);
+}
+
+static gboolean
+request_cancelled_cb (GCancellable *cancellable, gpointer user_data)
+{
+  PendingRequestHandle *handle = user_data;
+
+  g_message_center_complete_request (handle->message_center, handle->id, NULL, G_IO_ERROR_CANCELLED);
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * g_message_center_request_async:
+ * @message_center: a #GMessageCenter
+ * @request: the request message
+ * @timeout: how long to wait for the reply, in milliseconds, or 0 to wait
+ * forever
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: called once the reply is received, or on timeout or
+ * cancellation
+ * @user_data: data to pass to @callback
+ *
+ * Sends a copy of @request, with a new correlation ID, and waits for a
+ * filter to answer it with g_message_center_reply(). @callback is called
+ * from the thread-default main context of the calling thread, and should
+ * call g_message_center_request_finish() to get the reply.
+ *
+ * No filter is registered for the reply, pending requests are only looked
+ * up by their correlation ID, and timeouts share the timer wheel used for
+ * delayed messages.
+ */
+void
+g_message_center_request_async (GMessageCenter *message_center,
+                                GMessage *request,
+                                guint timeout,
+                                GCancellable *cancellable,
+                                GAsyncReadyCallback callback,
+                                gpointer user_data)
+{
+  GMessageCenterPrivate *priv;
+  PendingRequest *pending;
+  GTimerWheel *scheduler = NULL;
+  GMessage *msg;
+
+  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
+  g_return_if_fail (G_IS_MESSAGE (request));
+  g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+  priv = message_center->priv;
+
+  pending = g_new0 (PendingRequest, 1);
+  pending->task = g_task_new (message_center, cancellable, callback, user_data);
+  g_task_set_source_tag (pending->task, g_message_center_request_async);
+  /* Cancellation is reported by the cancellable source, with the request
+   * already taken out of the table */
+  g_task_set_check_cancellable (pending->task, FALSE);
+
+  if (timeout > 0)
+    {
+      scheduler = g_message_center_get_scheduler (message_center);
+    }
+
+  g_mutex_lock (&priv->lock);
+  pending->id = priv->next_correlation_id++;
+  g_hash_table_insert (priv->pending_requests, &pending->id, pending);
+
+  /* Set up while holding the lock, so that neither of them can complete
+   * the request before it is fully set up */
+  if (scheduler != NULL)
+    {
+      pending->timer = g_timer_wheel_add (scheduler,
+                                          timeout,
+                                          request_timeout_cb,
+                                          pending_request_handle_new (message_center, pending->id),
+                                          pending_request_handle_free);
+    }
+  if (cancellable != NULL)
+    {
+      pending->cancel_source = g_cancellable_source_new (cancellable);
+      g_source_set_callback (pending->cancel_source,
+                             (GSourceFunc) request_cancelled_cb,
+                             pending_request_handle_new (message_center, pending->id),
+                             pending_request_handle_free);
+      g_source_attach (pending->cancel_source, g_task_get_context (pending->task));
+    }
+
+  msg = g_message_copy (request);
+  g_message_set_correlation_id (msg, pending->id);
+  g_mutex_unlock (&priv->lock);
+
+  g_message_center_send (message_center, msg);
+  g_object_unref (msg);
+}
+
+/**
+ * g_message_center_request_finish:
+ * @message_center: a #GMessageCenter
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError, or %NULL
+ *
+ * Finishes a request started with g_message_center_request_async(). On
+ * timeout, @error is set to %G_IO_ERROR_TIMED_OUT, and on cancellation to
+ * %G_IO_ERROR_CANCELLED.
+ *
+ * Returns: (transfer full): the reply, or %NULL on error
+ */
+GMessage *
+g_message_center_request_finish (GMessageCenter *message_center,
+                                 GAsyncResult *result,
+                                 GError **error)
+{
+  g_return_val_if_fail (G_IS_MESSAGE_CENTER (message_center), NULL);
+  g_return_val_if_fail (g_task_is_valid (result, message_center), NULL);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) == g_message_center_request_async, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/**
+ * g_message_center_reply:
+ * @message_center: a #GMessageCenter
+ * @request: the request message, as received by a filter
+ * @reply: the reply
+ *
+ * Answers a request sent with g_message_center_request_async(). The reply
+ * is given to the requester only, it is not sent to the filters. Only the
+ * first reply to a request is taken into account.
+ *
+ * Returns: %TRUE if the requester was waiting for the reply, %FALSE if
+ * the request already got a reply, timed out or was cancelled
+ */
+gboolean
+g_message_center_reply (GMessageCenter *message_center, GMessage *request, GMessage *reply)
+{
+  guint64 id;
+
+  g_return_val_if_fail (G_IS_MESSAGE_CENTER (message_center), FALSE);
+  g_return_val_if_fail (G_IS_MESSAGE (request), FALSE);
+  g_return_val_if_fail (G_IS_MESSAGE (reply), FALSE);
+
+  id = g_message_get_correlation_id (request);
+  g_return_val_if_fail (id != 0, FALSE);
+
+  g_message_set_correlation_id (reply, id);
+
+  return g_message_center_complete_request (message_center, id, reply, 0);
+}
+
+/**
+ * g_message_center_send_full:
+ */
+void
+g_message_center_send_full (GMessageCenter *message_center, GObject *sender, const gchar *message_name, gpointer user_data)
+{
+  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
+  g_return_if_fail (G_IS_OBJECT (sender));
+  g_return_if_fail (message_name != NULL);
+
+  g_message_center_emit (message_center, sender, g_quark_from_string (message_name), user_data);
+}
+
+/**
+ * g_message_center_emit:
+ * @message_center: a #GMessageCenter
+ * @sender: the object sending the message
+ * @message_name: the name of the message, as a #GQuark
+ * @user_data: data to attach to the message
+ *
+ * Sends a message right away, like g_message_center_send_full(), but
+ * without creating a new #GMessage. The message passed to the filters is
+ * taken from a per-thread pool, and given back once all filters are called,
+ * so sending lots of messages this way doesn't allocate any memory.
+ *
+ * Filters wanting to keep the message after returning must take a
+ * reference on it, in which case it won't be reused. Data can only be
+ * attached to it then. Emitting #GMessageCenter::message-received also
+ * references it, so messages aren't reused while that signal has handlers.
+ */
+void
+g_message_center_emit (GMessageCenter *message_center,
+                       GObject *sender,
+                       GQuark message_name,
+                       gpointer user_data)
+{
+  GMessage *msg;
+
+  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
+  g_return_if_fail (G_IS_OBJECT (sender));
+  g_return_if_fail (message_name != 0);
+
+  msg = g_message_pool_acquire (sender, message_name, user_data);
+  g_message_center_send (message_center, msg);
+  g_message_pool_release (msg);
+}
+
+/**
+ * g_message_center_send_full_with_delay:
+ *
+ * Returns: a handle to use with g_message_center_cancel_delayed(), or 0
+ */
+guint
+g_message_center_send_full_with_delay (GMessageCenter *message_center,
+                                       GObject *sender,
+                                       const gchar *message_name,
+                                       gpointer user_data,
+                                       guint delay)
+{
+  GMessage *msg;
+  guint handle = 0;
+
+  g_return_val_if_fail (G_IS_MESSAGE_CENTER (message_center), 0);
+
+  msg = g_message_new (sender, message_name, user_data);
+  if (msg != NULL)
+    {
+      handle = g_message_center_send_with_delay (message_center, msg, delay);
+      g_object_unref (msg);
+    }
+
+  return handle;
+}
+
+/**
+ * g_message_center_filter:
+ * @message_center: a #GMessageCenter
+ * @sender: (nullable): only get messages sent by this object
+ * @message_name: (nullable): only get messages with this name
+ * @callback: function to call for every matching message
+ * @user_data: data to pass to @callback
+ *
+ * Registers a filter on @message_center. At least one of @sender or
+ * @message_name must be specified. If @sender is specified, the filter is
+ * automatically removed when @sender is finalized.
+ *
+ * @message_name can be a pattern, where a '*' segment matches exactly one
+ * segment of a dotted message name, and a '#' segment matches zero or more
+ * segments, so "test.message.*" gets "test.message.count", and "test.#"
+ * gets both "test" and "test.message.count".
+ *
+ * Returns: the ID of the filter, to be used with g_message_center_unfilter()
+ */
+guint
+g_message_center_filter (GMessageCenter *message_center,
+                         GObject *sender,
+                         const gchar *message_name,
+                         GMessageCenterFilterFunc callback,
+                         gpointer user_data)
+{
+  return g_message_center_filter_full (message_center,
+                                       sender,
+                                       message_name,
+                                       callback,
+                                       user_data,
+                                       NULL,
+                                       G_MESSAGE_CENTER_FILTER_DEFAULT);
+}
+
+/* Must be called with the lock held. Returns the retained messages @rc
+ * matches, if any */
+static GPtrArray *
+g_message_center_collect_retained (GMessageCenter *message_center, RegisteredCallback *rc)
+{
+  GHashTable *retained_messages = message_center->priv->retained_messages;
+  GPtrArray *retained = NULL;
+  GMessage *message;
+
+  if (g_hash_table_size (retained_messages) == 0)
+    return NULL;
+
+  if (rc->message_name != 0 && !rc->is_pattern)
+    {
+      message = g_hash_table_lookup (retained_messages, GUINT_TO_POINTER (rc->message_name));
+      if (message != NULL && (rc->sender == NULL || rc->sender == g_message_get_sender (message)))
+        {
+          retained = g_ptr_array_new_with_free_func (g_object_unref);
+          g_ptr_array_add (retained, g_object_ref (message));
+        }
+    }
+  else
+    {
+      GHashTableIter iter;
+      gpointer value;
+
+      g_hash_table_iter_init (&iter, retained_messages);
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        {
+          message = value;
+
+          if (rc->sender != NULL && rc->sender != g_message_get_sender (message))
+            continue;
+          if (rc->is_pattern &&
+              !g_topic_matches (g_quark_to_string (rc->message_name), g_message_get_name (message)))
+            continue;
+
+          if (retained == NULL)
+            retained = g_ptr_array_new_with_free_func (g_object_unref);
+          g_ptr_array_add (retained, g_object_ref (message));
+        }
+    }
+
+  return retained;
+}
+
+static guint
+g_message_center_add_filter (GMessageCenter *message_center,
+                             GObject *sender,
+                             const gchar *message_name,
+                             GMessageCenterFilterFunc callback,
+                             GMessageCenterBatchFilterFunc batch_callback,
+                             gpointer user_data,
+                             GDestroyNotify destroy_notify,
+                             GObject *object,
+                             GMessageCenterFilterFlags flags)
+{
+  RegisteredCallback *rc;
+  GPtrArray *retained;
+  GObject *filter_sender;
+  GQuark filter_name;
+  guint id;
+
+  rc = g_new0 (RegisteredCallback, 1);
+  rc->ref_count = 1;
+  rc->message_center = message_center;
+  rc->sender = G_IS_OBJECT (sender) ? sender : NULL;
+  rc->object = object;
+  rc->message_name = message_name != NULL ? g_quark_from_string (message_name) : 0;
+  filter_sender = rc->sender;
+  filter_name = rc->message_name;
+  rc->is_pattern = g_topic_is_pattern (message_name);
   rc->callback = callback;
+  rc->batch_callback = batch_callback;
   rc->user_data = user_data;
+  rc->destroy_notify = destroy_notify;
+  if (flags & G_MESSAGE_CENTER_FILTER_INVOKE_IN_CONTEXT)
+    {
+      rc->context = g_main_context_ref_thread_default ();
+    }
+
+  g_mutex_lock (&message_center->priv->lock);
+
+  rc->id = id = message_center->priv->next_filter_id++;
+  rc->serial = message_center->priv->next_serial++;
+  g_hash_table_insert (message_center->priv->filters_by_id, GUINT_TO_POINTER (id), rc);
+  g_message_center_add_to_index (message_center, rc);
+
+  if (rc->sender != NULL)
+    {
+      g_object_weak_ref (rc->sender, filter_weak_notify, rc);
+      rc->watching_sender = TRUE;
+    }
+  if (rc->object != NULL)
+    {
+      g_object_weak_ref (rc->object, filter_weak_notify, rc);
+      rc->watching_object = TRUE;
+    }
+
+  retained = g_message_center_collect_retained (message_center, rc);
+  if (retained != NULL)
+    {
+      registered_callback_ref (rc);
+    }
+
+  g_mutex_unlock (&message_center->priv->lock);
+
+  /* Notified outside of the lock, so removing the filter from another
+   * thread might be notified first */
+  g_message_center_filter_changed (message_center, filter_sender, filter_name, TRUE);
+
+  /* Let the new filter know about the current state right away */
+  if (retained != NULL)
+    {
+      guint i;
+
+      for (i = 0; i < retained->len && !g_atomic_int_get (&rc->removed); i++)
+        {
+          g_message_center_invoke_filter (message_center, rc, (GMessage **) &retained->pdata[i], 1);
+        }
+      g_ptr_array_unref (retained);
+      registered_callback_unref (rc);
+    }
+
+  return id;
+}
+
+/**
+ * g_message_center_filter_full:
+ * @message_center: a #GMessageCenter
+ * @sender: (nullable): only get messages sent by this object
+ * @message_name: (nullable): only get messages with this name
+ * @callback: function to call for every matching message
+ * @user_data: data to pass to @callback
+ * @destroy_notify: (nullable): function to free @user_data once the filter
+ * is removed and no longer in use
+ * @flags: flags for the filter
+ *
+ * Registers a filter on @message_center, like g_message_center_filter().
+ *
+ * If @flags contains %G_MESSAGE_CENTER_FILTER_INVOKE_IN_CONTEXT, @callback
+ * will always be called on the thread-default #GMainContext of the thread
+ * calling this function, whatever thread the messages are sent from.
+ *
+ * Returns: the ID of the filter, to be used with g_message_center_unfilter()
+ */
+guint
+g_message_center_filter_full (GMessageCenter *message_center,
+                              GObject *sender,
+                              const gchar *message_name,
+                              GMessageCenterFilterFunc callback,
+                              gpointer user_data,
+                              GDestroyNotify destroy_notify,
+                              GMessageCenterFilterFlags flags)
+{
+  g_return_val_if_fail (G_IS_MESSAGE_CENTER (message_center), 0);
+  g_return_val_if_fail (G_IS_OBJECT (sender) || message_name != NULL, 0);
+  g_return_val_if_fail (callback != NULL, 0);
+
+  return g_message_center_add_filter (message_center, sender, message_name,
+                                      callback, NULL, user_data, destroy_notify,
+                                      NULL, flags);
+}
+
+/**
+ * g_message_center_filter_object:
+ * @message_center: a #GMessageCenter
+ * @sender: (nullable): only get messages sent by this object
+ * @message_name: (nullable): only get messages with this name
+ * @callback: function to call for every matching message
+ * @object: object to pass as data to @callback
+ * @flags: flags for the filter
+ *
+ * Registers a filter on @message_center, like g_message_center_filter_full(),
+ * which is automatically removed when @object is finalized, in the same way
+ * as g_signal_connect_object() does for signals.
+ *
+ * Returns: the ID of the filter, to be used with g_message_center_unfilter()
+ */
+guint
+g_message_center_filter_object (GMessageCenter *message_center,
+                                GObject *sender,
+                                const gchar *message_name,
+                                GMessageCenterFilterFunc callback,
+                                gpointer object,
+                                GMessageCenterFilterFlags flags)
+{
+  g_return_val_if_fail (G_IS_MESSAGE_CENTER (message_center), 0);
+  g_return_val_if_fail (G_IS_OBJECT (sender) || message_name != NULL, 0);
+  g_return_val_if_fail (callback != NULL, 0);
+  g_return_val_if_fail (G_IS_OBJECT (object), 0);
+
+  return g_message_center_add_filter (message_center, sender, message_name,
+                                      callback, NULL, object, NULL,
+                                      object, flags);
+}
+
+/**
+ * g_message_center_filter_batch:
+ * @message_center: a #GMessageCenter
+ * @sender: (nullable): only get messages sent by this object
+ * @message_name: (nullable): only get messages with this name
+ * @callback: function to call for matching messages
+ * @user_data: data to pass to @callback
+ * @destroy_notify: (nullable): function to free @user_data once the filter
+ * is removed and no longer in use
+ * @flags: flags for the filter
+ *
+ * Registers a filter on @message_center, like g_message_center_filter_full(),
+ * whose callback gets all matching messages with the same sender and name
+ * sent together with g_message_center_send_many() at once. Messages sent
+ * any other way are passed to @callback one by one.
+ *
+ * Returns: the ID of the filter, to be used with g_message_center_unfilter()
+ */
+guint
+g_message_center_filter_batch (GMessageCenter *message_center,
+                               GObject *sender,
+                               const gchar *message_name,
+                               GMessageCenterBatchFilterFunc callback,
+                               gpointer user_data,
+                               GDestroyNotify destroy_notify,
+                               GMessageCenterFilterFlags flags)
+{
+  g_return_val_if_fail (G_IS_MESSAGE_CENTER (message_center), 0);
+  g_return_val_if_fail (G_IS_OBJECT (sender) || message_name != NULL, 0);
+  g_return_val_if_fail (callback != NULL, 0);
+
+  return g_message_center_add_filter (message_center, sender, message_name,
+                                      NULL, callback, user_data, destroy_notify,
+                                      NULL, flags);
+}
+
+/**
+ * g_message_center_unfilter:
+ * @message_center: a #GMessageCenter
+ * @filter_id: the ID of a filter, as returned by g_message_center_filter()
+ *
+ * Removes a filter from @message_center. This can be safely called from
+ * the filter callbacks, and from any thread. Once it returns, @callback
+ * will not be called for messages sent afterwards.
+ */
+void
+g_message_center_unfilter (GMessageCenter *message_center, guint filter_id)
+{
+  RegisteredCallback *rc;
+  GObject *sender = NULL;
+  GQuark message_name = 0;
+
+  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
+  g_return_if_fail (filter_id > 0);
+
+  g_mutex_lock (&message_center->priv->lock);
+
+  rc = g_hash_table_lookup (message_center->priv->filters_by_id, GUINT_TO_POINTER (filter_id));
+  if (rc != NULL)
+    {
+      sender = rc->sender;
+      message_name = rc->message_name;
+      g_message_center_remove_filter (message_center, rc);
+    }
+  else
+    {
+      g_warning ("%s: no filter with ID %u", G_STRFUNC, filter_id);
+    }
+
+  g_mutex_unlock (&message_center->priv->lock);
+
+  if (rc != NULL)
+    g_message_center_filter_changed (message_center, sender, message_name, FALSE);
+}
+
+/**
+ * g_message_center_coalesce_filter:
+ * @message_center: a #GMessageCenter
+ * @filter_id: the ID of a filter, as returned by g_message_center_filter()
+ * @window: the coalescing window, in milliseconds, or 0 to disable it
+ * @mode: how to coalesce messages
+ *
+ * Makes a filter get messages coalesced, like the ones sent with
+ * g_message_center_send_coalesced(), whatever way they are sent. Messages
+ * are coalesced separately for each sender and message name.
+ */
+void
+g_message_center_coalesce_filter (GMessageCenter *message_center,
+                                  guint filter_id,
+                                  guint window,
+                                  GMessageCenterCoalesceMode mode)
+{
+  RegisteredCallback *rc;
+
+  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
+  g_return_if_fail (filter_id > 0);
+  g_return_if_fail (window <= G_MAXINT);
+
+  g_mutex_lock (&message_center->priv->lock);
+
+  rc = g_hash_table_lookup (message_center->priv->filters_by_id, GUINT_TO_POINTER (filter_id));
+  if (rc != NULL)
+    {
+      g_atomic_int_set (&rc->coalesce_mode, mode);
+      g_atomic_int_set (&rc->coalesce_window, window);
+    }
+  else
+    {
+      g_warning ("%s: no filter with ID %u", G_STRFUNC, filter_id);
+    }
+
+  g_mutex_unlock (&message_center->priv->lock);
+}
+
+/**
+ * g_message_center_set_rate_limit:
+ * @message_center: a #GMessageCenter
+ * @sender: (nullable): the sender to limit, or %NULL for all senders
+ * @message_name: (nullable): the name of the messages to limit, or %NULL
+ * for all messages
+ * @rate: the number of messages allowed per second, or 0 to remove the
+ * limit
+ * @burst: the number of messages allowed in a row before @rate applies
+ * @policy: what to do with messages over the limit
+ *
+ * Limits the rate of messages sent by @sender, or with @message_name, or
+ * both, with a token bucket: each message takes a token, @rate tokens are
+ * added every second, and at most @burst are kept. Messages sent without
+ * tokens left are handled as told by @policy.
+ *
+ * A message must be allowed by all the limits matching it: its sender and
+ * name, its sender, and its name. Deferred messages are only held back by
+ * the limit which deferred them. Limits on a sender are removed when it is
+ * destroyed. Removing a limit sends its deferred messages right away.
+ *
+ * Counters of the messages over each limit are part of
+ * g_message_center_get_stats().
+ */
+void
+g_message_center_set_rate_limit (GMessageCenter *message_center,
+                                 GObject *sender,
+                                 const gchar *message_name,
+                                 guint rate,
+                                 guint burst,
+                                 GMessageCenterRateLimitPolicy policy)
+{
+  GMessageCenterPrivate *priv;
+  FilterKey key;
+  RateLimit *limit;
+  GList *deferred = NULL, *l;
+
+  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
+  g_return_if_fail (sender == NULL || G_IS_OBJECT (sender));
+  g_return_if_fail (sender != NULL || message_name != NULL);
+
+  priv = message_center->priv;
+  key.sender = sender;
+  key.message_name = message_name != NULL ? g_quark_from_string (message_name) : 0;
+
+  /* Coalesced and deferred messages need it */
+  g_message_center_get_scheduler (message_center);
+
+  g_mutex_lock (&priv->lock);
+
+  limit = g_hash_table_lookup (priv->rate_limits, &key);
+  if (rate == 0)
+    {
+      if (limit != NULL)
+        deferred = g_message_center_remove_rate_limit (message_center, limit);
+    }
+  else
+    {
+      if (limit == NULL)
+        {
+          limit = g_new0 (RateLimit, 1);
+          limit->key = key;
+          limit->message_center = message_center;
+          limit->last_refill = g_get_monotonic_time ();
+          g_queue_init (&limit->deferred);
+          limit->tokens = MAX (burst, 1);
+          if (sender != NULL)
+            {
+              g_object_weak_ref (sender, rate_limit_weak_notify, limit);
+              limit->watching_sender = TRUE;
+            }
+          g_hash_table_insert (priv->rate_limits, &limit->key, limit);
+          g_atomic_int_inc (&priv->n_rate_limits);
+        }
+      else
+        {
+          rate_limit_refill (limit, g_get_monotonic_time ());
+        }
+
+      /* Rates are kept in tokens per microsecond */
+      limit->rate = rate / (gdouble) G_USEC_PER_SEC;
+      limit->burst = MAX (burst, 1);
+      limit->tokens = MIN (limit->tokens, limit->burst);
+      limit->policy = policy;
+    }
+
+  g_mutex_unlock (&priv->lock);
+
+  for (l = deferred; l != NULL; l = l->next)
+    {
+      g_message_center_deliver (message_center, l->data);
+    }
+  g_list_free_full (deferred, g_object_unref);
+}
+
+/**
+ * g_message_center_set_journal:
+ * @message_center: a #GMessageCenter
+ * @path: (nullable): the journal file, or %NULL to stop journaling
+ * @error: return location for a #GError, or %NULL
+ *
+ * Records all messages sent to @message_center from now on in the journal
+ * file at @path, so that they can be sent again with
+ * g_message_center_replay(), for instance after a crash. If the file
+ * exists, messages are appended to the ones already in it.
+ *
+ * Only the names and payloads of messages are recorded, see
+ * g_message_new_with_payload(). The journal is a file mapped in memory, so
+ * journaling a message doesn't involve any system call, and it is synced
+ * to disk about every second while messages are sent, from a thread of its
+ * own, so whether a main loop runs doesn't matter.
+ *
+ * Returns: %TRUE if the journal was opened
+ */
+gboolean
+g_message_center_set_journal (GMessageCenter *message_center, const gchar *path, GError **error)
+{
+  GMessageCenterPrivate *priv;
+  GMessageJournal *journal;
+
+  g_return_val_if_fail (G_IS_MESSAGE_CENTER (message_center), FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  priv = message_center->priv;
+
+  g_mutex_lock (&priv->lock);
+  if (priv->journal == NULL)
+    {
+      g_atomic_pointer_set (&priv->journal, g_message_journal_new ());
+    }
+  journal = priv->journal;
+  g_mutex_unlock (&priv->lock);
+
+  g_message_journal_close (journal);
+
+  if (path == NULL)
+    return TRUE;
+
+  return g_message_journal_open (journal, path, error);
+}
+
+/**
+ * g_message_center_get_journal_offset:
+ * @message_center: a #GMessageCenter
+ *
+ * Gets the position in the journal the next message will be recorded at.
+ * An application can save it once it handled all the messages sent so
+ * far, and give it to g_message_center_replay() after a restart, to only
+ * replay the following ones.
+ *
+ * Returns: the position of the end of the journal, or 0 if there is no
+ * journal
+ */
+guint64
+g_message_center_get_journal_offset (GMessageCenter *message_center)
+{
+  GMessageJournal *journal;
+
+  g_return_val_if_fail (G_IS_MESSAGE_CENTER (message_center), 0);
+
+  journal = g_atomic_pointer_get (&message_center->priv->journal);
+
+  return journal != NULL ? g_message_journal_get_offset (journal) : 0;
+}
+
+static void
+replay_message_cb (const gchar *message_name, GVariant *payload, gpointer user_data)
+{
+  GMessageCenter *message_center = user_data;
+  GMessage *message;
+
+  if (payload != NULL)
+    message = g_message_new_with_payload (G_OBJECT (message_center), message_name, payload);
+  else
+    message = g_message_new (G_OBJECT (message_center), message_name, NULL);
+
+  g_message_center_send_now (message_center, message);
+  g_object_unref (message);
+}
+
+/**
+ * g_message_center_replay:
+ * @message_center: a #GMessageCenter
+ * @from_offset: a position returned by
+ * g_message_center_get_journal_offset(), or 0 to replay the whole journal
+ * @error: return location for a #GError, or %NULL
+ *
+ * Sends again the messages recorded in the journal set with
+ * g_message_center_set_journal(), from @from_offset up to the last one
+ * recorded when this is called. The messages are sent right away, with
+ * @message_center as their sender, and are not recorded again.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+g_message_center_replay (GMessageCenter *message_center, guint64 from_offset, GError **error)
+{
+  GMessageJournal *journal;
+
+  g_return_val_if_fail (G_IS_MESSAGE_CENTER (message_center), FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  journal = g_atomic_pointer_get (&message_center->priv->journal);
+  if (journal == NULL)
+    {
+      g_set_error_literal (error, G_FILE_ERROR, G_FILE_ERROR_BADF,
+                           "The message center has no journal");
+      return FALSE;
+    }
+
+  return g_message_journal_replay (journal, from_offset, replay_message_cb, message_center, error);
+}
+
+/**
+ * g_message_center_set_stats_enabled:
+ * @message_center: a #GMessageCenter
+ * @enabled: whether to collect statistics
+ *
+ * Enables or disables collecting the statistics returned by
+ * g_message_center_get_stats(). This is disabled by default, as it makes
+ * sending messages a bit slower.
+ */
+void
+g_message_center_set_stats_enabled (GMessageCenter *message_center, gboolean enabled)
+{
+  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
+
+  g_atomic_int_set (&message_center->priv->stats_enabled, enabled != FALSE);
+}
+
+/**
+ * g_message_center_get_stats:
+ * @message_center: a #GMessageCenter
+ *
+ * Gets the statistics collected since g_message_center_set_stats_enabled()
+ * was called, as a dictionary with these entries:
+ *
+ * - "topics" (a{st}): the number of messages sent for each message name
+ * - "filters" (a(usat)): for each filter, its ID, the name of the messages
+ *   it gets or an empty string, and a histogram of the time its callback
+ *   took: element i counts calls which took less than 2^i microseconds,
+ *   and more than the ones counted by element i-1, except the last one
+ *   which counts all longer calls
+ * - "rate-limits" (a(ssttt)): for each limit set with
+ *   g_message_center_set_rate_limit(), the type name of its sender and the
+ *   message name, or empty strings for wildcards, and the numbers of
+ *   messages it dropped, coalesced and deferred. These are always counted.
+ *
+ * Returns: (transfer full): the statistics, as a #GVariant of type a{sv}
+ */
+GVariant *
+g_message_center_get_stats (GMessageCenter *message_center)
+{
+  GVariantBuilder builder, topics, filters, limits;
+  TopicCounts *counts;
+  GHashTableIter iter;
+  gpointer value;
+  GPtrArray *rcs;
+  guint i, j;
+
+  g_return_val_if_fail (G_IS_MESSAGE_CENTER (message_center), NULL);
+
+  g_variant_builder_init (&topics, G_VARIANT_TYPE ("a{st}"));
+  g_mutex_lock (&message_center->priv->stats_lock);
+  counts = message_center->priv->topic_counts;
+  for (i = 0; counts != NULL && i < counts->n_chunks; i++)
+    {
+      if (counts->chunks[i] == NULL)
+        continue;
+
+      for (j = 0; j < TOPIC_COUNTS_CHUNK; j++)
+        {
+          gsize count = (gsize) g_atomic_pointer_get (&counts->chunks[i][j]);
+
+          if (count > 0)
+            g_variant_builder_add (&topics, "{st}", g_quark_to_string (i * TOPIC_COUNTS_CHUNK + j), (guint64) count);
+        }
+    }
+  g_mutex_unlock (&message_center->priv->stats_lock);
+
+  rcs = g_ptr_array_new_with_free_func (registered_callback_unref);
+  g_mutex_lock (&message_center->priv->lock);
+  g_hash_table_iter_init (&iter, message_center->priv->filters_by_id);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      g_ptr_array_add (rcs, registered_callback_ref (value));
+    }
+  g_mutex_unlock (&message_center->priv->lock);
+  g_ptr_array_sort (rcs, compare_filter_serials);
+
+  g_variant_builder_init (&filters, G_VARIANT_TYPE ("a(usat)"));
+  for (i = 0; i < rcs->len; i++)
+    {
+      RegisteredCallback *rc = g_ptr_array_index (rcs, i);
+
+      g_variant_builder_open (&filters, G_VARIANT_TYPE ("(usat)"));
+      g_variant_builder_add (&filters, "u", rc->id);
+      g_variant_builder_add (&filters, "s", rc->message_name != 0 ? g_quark_to_string (rc->message_name) : "");
+      g_variant_builder_open (&filters, G_VARIANT_TYPE ("at"));
+      for (j = 0; j < N_LATENCY_BUCKETS; j++)
+        {
+          g_variant_builder_add (&filters, "t", (guint64) g_atomic_int_get (&rc->latency_histogram[j]));
+        }
+      g_variant_builder_close (&filters);
+      g_variant_builder_close (&filters);
+    }
+  g_ptr_array_unref (rcs);
+
+  g_variant_builder_init (&limits, G_VARIANT_TYPE ("a(ssttt)"));
+  g_mutex_lock (&message_center->priv->lock);
+  g_hash_table_iter_init (&iter, message_center->priv->rate_limits);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      RateLimit *limit = value;
+
+      g_variant_builder_add (&limits, "(ssttt)",
+                             limit->key.sender != NULL ? G_OBJECT_TYPE_NAME (limit->key.sender) : "",
+                             limit->key.message_name != 0 ? g_quark_to_string (limit->key.message_name) : "",
+                             limit->n_dropped,
+                             limit->n_coalesced,
+                             limit->n_deferred);
+    }
+  g_mutex_unlock (&message_center->priv->lock);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&builder, "{sv}", "topics", g_variant_builder_end (&topics));
+  g_variant_builder_add (&builder, "{sv}", "filters", g_variant_builder_end (&filters));
+  g_variant_builder_add (&builder, "{sv}", "rate-limits", g_variant_builder_end (&limits));
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+/**
+ * g_message_center_set_dispatch_budget:
+ * @message_center: a #GMessageCenter
+ * @budget: the budget, in microseconds, or 0 to disable it
+ *
+ * Sets the longest time sending a message from a main loop can take
+ * calling filters, 2000 microseconds being a good value for applications
+ * drawing at 60 frames per second. This applies to messages sent while
+ * the thread default main context, see g_main_context_push_thread_default(),
+ * is owned by the calling thread, as it is while its loop runs. Once the
+ * budget is spent, the remaining filters are called from an idle source
+ * attached to that context, over as many of its iterations as needed,
+ * each spending at most @budget.
+ *
+ * Filters are still called in the same order, and messages sent from the
+ * context while others are not fully dispatched are queued behind them.
+ * Dispatches are only continued from one context at a time, so messages
+ * sent from another context meanwhile are not time sliced, nor are
+ * messages sent from threads which don't own their thread default context.
+ *
+ * This is disabled by default, in which case all filters are called
+ * before g_message_center_send() returns.
+ */
+void
+g_message_center_set_dispatch_budget (GMessageCenter *message_center, guint budget)
+{
+  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
+  g_return_if_fail (budget <= G_MAXINT);
+
+  g_atomic_int_set (&message_center->priv->dispatch_budget, budget);
+}
+
+/**
+ * g_message_center_set_handler_budget:
+ * @message_center: a #GMessageCenter
+ * @budget: the budget, in microseconds, or 0 to disable it
+ *
+ * Sets the time filter callbacks are expected to take at most. Whenever
+ * a callback takes longer, the #GMessageCenter::slow-handler signal is
+ * emitted.
+ */
+void
+g_message_center_set_handler_budget (GMessageCenter *message_center, guint budget)
+{
+  g_return_if_fail (G_IS_MESSAGE_CENTER (message_center));
+  g_return_if_fail (budget <= G_MAXINT);
 
-  message_center->priv->registered_callbacks = g_slist_append (message_center->priv->registered_callbacks, rc);
+  g_atomic_int_set (&message_center->priv->handler_budget, budget);
 }
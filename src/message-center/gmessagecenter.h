@@ -23,6 +23,7 @@
 #ifndef __G_MESSAGE_CENTER_H__
 #define __G_MESSAGE_CENTER_H__
 
+#include <gio/gio.h>
 #include "gmessage.h"
 
 G_BEGIN_DECLS
@@ -39,6 +40,77 @@ typedef struct _GMessageCenterClass   GMessageCenterClass;
 typedef struct _GMessageCenterPrivate GMessageCenterPrivate;
 
 typedef void (* GMessageCenterFilterFunc) (GMessageCenter *message_center, GMessage *message, gpointer user_data);
+typedef void (* GMessageCenterBatchFilterFunc) (GMessageCenter *message_center,
+                                                GMessage **messages,
+                                                guint n_messages,
+                                                gpointer user_data);
+
+/**
+ * GMessageCenterFilterFlags:
+ * @G_MESSAGE_CENTER_FILTER_DEFAULT: no flags, the filter is called on the
+ * thread sending the message
+ * @G_MESSAGE_CENTER_FILTER_INVOKE_IN_CONTEXT: the filter is called on the
+ * thread-default #GMainContext of the thread that registered it
+ *
+ * Flags for g_message_center_filter_full().
+ */
+typedef enum
+{
+  G_MESSAGE_CENTER_FILTER_DEFAULT           = 0,
+  G_MESSAGE_CENTER_FILTER_INVOKE_IN_CONTEXT = 1 << 0
+} GMessageCenterFilterFlags;
+
+/**
+ * GMessageCenterCoalesceMode:
+ * @G_MESSAGE_CENTER_COALESCE_THROTTLE: the first message starts the window,
+ * and the latest message is delivered when it ends, so at most one message
+ * is delivered per window
+ * @G_MESSAGE_CENTER_COALESCE_DEBOUNCE: every message restarts the window,
+ * and the latest message is delivered once no message came during a whole
+ * window
+ *
+ * How messages with the same sender and name are coalesced.
+ */
+typedef enum
+{
+  G_MESSAGE_CENTER_COALESCE_THROTTLE,
+  G_MESSAGE_CENTER_COALESCE_DEBOUNCE
+} GMessageCenterCoalesceMode;
+
+/**
+ * GMessageCenterPriority:
+ * @G_MESSAGE_CENTER_PRIORITY_URGENT: dispatched before anything else in the
+ * main loop, at %G_PRIORITY_HIGH
+ * @G_MESSAGE_CENTER_PRIORITY_NORMAL: dispatched at %G_PRIORITY_DEFAULT
+ * @G_MESSAGE_CENTER_PRIORITY_BULK: dispatched at %G_PRIORITY_LOW, a few at a
+ * time, so that they don't hold the main loop
+ *
+ * Priorities for g_message_center_send_with_priority().
+ */
+typedef enum
+{
+  G_MESSAGE_CENTER_PRIORITY_URGENT,
+  G_MESSAGE_CENTER_PRIORITY_NORMAL,
+  G_MESSAGE_CENTER_PRIORITY_BULK
+} GMessageCenterPriority;
+
+/**
+ * GMessageCenterRateLimitPolicy:
+ * @G_MESSAGE_CENTER_RATE_LIMIT_DROP: messages over the limit are dropped
+ * @G_MESSAGE_CENTER_RATE_LIMIT_COALESCE: messages over the limit are
+ * coalesced, like with g_message_center_send_coalesced(), until the limit
+ * lets the latest one through
+ * @G_MESSAGE_CENTER_RATE_LIMIT_DEFER: messages over the limit are queued,
+ * and sent in order as the limit lets them through
+ *
+ * Policies for g_message_center_set_rate_limit().
+ */
+typedef enum
+{
+  G_MESSAGE_CENTER_RATE_LIMIT_DROP,
+  G_MESSAGE_CENTER_RATE_LIMIT_COALESCE,
+  G_MESSAGE_CENTER_RATE_LIMIT_DEFER
+} GMessageCenterRateLimitPolicy;
 
 /**
  * GMessageCenter;
@@ -55,32 +127,123 @@ struct _GMessageCenter
   GMessageCenterPrivate *priv;
 };
 
+/**
+ * GMessageCenterClass:
+ * @parent_class: the parent class
+ * @message_received: class handler for the #GMessageCenter::message-received
+ * signal
+ * @slow_handler: class handler for the #GMessageCenter::slow-handler signal
+ * @filter_changed: called after a filter for @message_name, or for any
+ * message if %NULL, is added or removed, without any lock held. @sender
+ * is only to be compared with, as it might be being finalized
+ */
 struct _GMessageCenterClass
 {
   GObjectClass parent_class;
 
   void (* message_received) (GMessageCenter message_center, GMessage *message);
+  void (* slow_handler)     (GMessageCenter *message_center,
+                             GMessage *message,
+                             guint filter_id,
+                             gint64 elapsed);
+  void (* filter_changed)   (GMessageCenter *message_center,
+                             GObject *sender,
+                             const gchar *message_name,
+                             gboolean added);
 };
 
 GType           g_message_center_get_type             (void) G_GNUC_CONST;
 
 GMessageCenter *g_message_center_get                  (void);
 void            g_message_center_send                 (GMessageCenter *message_center, GMessage *message);
-void            g_message_center_send_with_delay      (GMessageCenter *message_center, GMessage *message, guint delay);
+guint           g_message_center_send_with_delay      (GMessageCenter *message_center, GMessage *message, guint delay);
+void            g_message_center_send_retained        (GMessageCenter *message_center, GMessage *message);
+void            g_message_center_clear_retained       (GMessageCenter *message_center, const gchar *message_name);
+void            g_message_center_send_many            (GMessageCenter *message_center,
+                                                       GMessage **messages,
+                                                       guint n_messages);
+void            g_message_center_send_async           (GMessageCenter *message_center, GMessage *message);
+void            g_message_center_send_with_priority   (GMessageCenter *message_center,
+                                                       GMessage *message,
+                                                       GMessageCenterPriority priority);
+gboolean        g_message_center_cancel_delayed       (GMessageCenter *message_center, guint handle);
+void            g_message_center_request_async        (GMessageCenter *message_center,
+                                                       GMessage *request,
+                                                       guint timeout,
+                                                       GCancellable *cancellable,
+                                                       GAsyncReadyCallback callback,
+                                                       gpointer user_data);
+GMessage       *g_message_center_request_finish       (GMessageCenter *message_center,
+                                                       GAsyncResult *result,
+                                                       GError **error);
+gboolean        g_message_center_reply                (GMessageCenter *message_center,
+                                                       GMessage *request,
+                                                       GMessage *reply);
 void            g_message_center_send_full            (GMessageCenter *message_center,
                                                        GObject *sender,
                                                        const gchar *message_name,
                                                        gpointer user_data);
-void            g_message_center_send_full_with_delay (GMessageCenter *message_center,
+void            g_message_center_send_coalesced       (GMessageCenter *message_center,
+                                                       GMessage *message,
+                                                       guint window,
+                                                       GMessageCenterCoalesceMode mode);
+void            g_message_center_emit                 (GMessageCenter *message_center,
+                                                       GObject *sender,
+                                                       GQuark message_name,
+                                                       gpointer user_data);
+guint           g_message_center_send_full_with_delay (GMessageCenter *message_center,
                                                        GObject *sender,
                                                        const gchar *message_name,
                                                        gpointer user_data,
                                                        guint delay);
-void            g_message_center_filter               (GMessageCenter *message_center,
+guint           g_message_center_filter               (GMessageCenter *message_center,
                                                        GObject *sender,
                                                        const gchar *message_name,
                                                        GMessageCenterFilterFunc callback,
                                                        gpointer user_data);
+guint           g_message_center_filter_full          (GMessageCenter *message_center,
+                                                       GObject *sender,
+                                                       const gchar *message_name,
+                                                       GMessageCenterFilterFunc callback,
+                                                       gpointer user_data,
+                                                       GDestroyNotify destroy_notify,
+                                                       GMessageCenterFilterFlags flags);
+guint           g_message_center_filter_batch         (GMessageCenter *message_center,
+                                                       GObject *sender,
+                                                       const gchar *message_name,
+                                                       GMessageCenterBatchFilterFunc callback,
+                                                       gpointer user_data,
+                                                       GDestroyNotify destroy_notify,
+                                                       GMessageCenterFilterFlags flags);
+guint           g_message_center_filter_object        (GMessageCenter *message_center,
+                                                       GObject *sender,
+                                                       const gchar *message_name,
+                                                       GMessageCenterFilterFunc callback,
+                                                       gpointer object,
+                                                       GMessageCenterFilterFlags flags);
+void            g_message_center_unfilter             (GMessageCenter *message_center,
+                                                       guint filter_id);
+void            g_message_center_set_rate_limit       (GMessageCenter *message_center,
+                                                       GObject *sender,
+                                                       const gchar *message_name,
+                                                       guint rate,
+                                                       guint burst,
+                                                       GMessageCenterRateLimitPolicy policy);
+gboolean        g_message_center_set_journal          (GMessageCenter *message_center,
+                                                       const gchar *path,
+                                                       GError **error);
+guint64         g_message_center_get_journal_offset   (GMessageCenter *message_center);
+gboolean        g_message_center_replay               (GMessageCenter *message_center,
+                                                       guint64 from_offset,
+                                                       GError **error);
+void            g_message_center_set_stats_enabled    (GMessageCenter *message_center, gboolean enabled);
+GVariant       *g_message_center_get_stats            (GMessageCenter *message_center);
+void            g_message_center_set_dispatch_budget  (GMessageCenter *message_center, guint budget);
+void            g_message_center_set_handler_budget   (GMessageCenter *message_center, guint budget);
+void            g_message_center_coalesce_filter      (GMessageCenter *message_center,
+                                                       guint filter_id,
+                                                       guint window,
+                                                       GMessageCenterCoalesceMode mode);
 
 G_END_DECLS
 
@@ -0,0 +1,740 @@
+/* GPattern - GLib software patterns implementation library
+ *
+ * Copyright (C) 2014 Rodrigo Moya
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Author: Rodrigo Moya <rodrigo@gnome.org>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gmessagejournal.h"
+
+/*
+ * GMessageJournal appends messages to a file mapped in memory, so that
+ * journaling a message is a copy into the mapping, without any system
+ * call. A thread of the journal syncs it to disk, once records have been
+ * waiting for JOURNAL_SYNC_INTERVAL, and grows the file to twice its size
+ * once half of it is used, with its blocks allocated and its pages mapped
+ * right away, so that appending neither takes page faults nor waits for
+ * the file system. Appending only grows the file itself if it outruns the
+ * thread.
+ *
+ * Records are timestamped with the coarse monotonic clock, which is much
+ * cheaper to read than the wall clock, relative to a wall clock time taken
+ * when the journal is opened and every time it is synced.
+ *
+ * The file starts with a JournalHeader, followed by the records. A record
+ * is a JournalRecord, the message name and the type string of the payload,
+ * both nul-terminated, then the serialized payload, aligned on 8 bytes.
+ * The size of a record is written last, after its contents, so a record
+ * with a size of 0 marks the end of the journal, which is where the zeroes
+ * the file is grown with start.
+ *
+ * Everything is in host byte order, journals are not meant to be moved to
+ * another machine.
+ */
+
+#define JOURNAL_MAGIC        "GMJOURN1"
+#define JOURNAL_INITIAL_SIZE (1024 * 1024)
+#define JOURNAL_ALIGN(size)  (((size) + 7) & ~(guint64) 7)
+
+/* Longest time records wait to be synced to disk, in microseconds */
+#define JOURNAL_SYNC_INTERVAL G_USEC_PER_SEC
+
+typedef struct
+{
+  gchar magic[8];
+  guint64 reserved;
+} JournalHeader;
+
+typedef struct
+{
+  guint32 size;
+  /* Lengths include the nul, type_length is 0 for messages without payload */
+  guint32 name_length;
+  guint32 type_length;
+  guint32 payload_size;
+  guint64 seq;
+  gint64 timestamp;
+} JournalRecord;
+
+struct _GMessageJournal
+{
+  /* Only fd is protected by sync_lock as well, so that syncing doesn't
+   * hold appending */
+  GMutex lock;
+  GMutex sync_lock;
+  gint is_open;
+  gchar *path;
+  gint fd;
+  guint8 *map;
+  gsize size;
+  gsize end;
+  guint64 next_seq;
+  /* Whether there are records to sync, and since when */
+  gboolean dirty;
+  gint64 dirty_since;
+  /* The wall clock time at base_time on the coarse monotonic clock */
+  gint64 base_real_time;
+  gint64 base_time;
+  /* Runs while the journal is open, woken up by cond. It also grows the
+   * journal once half of it is used */
+  GThread *sync_thread;
+  gboolean grow_failed;
+  gboolean populating;
+  GCond cond;
+  gboolean stopping;
+};
+
+static gint64
+journal_get_coarse_time (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+
+  return (gint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+/* Must be called with the lock held */
+static void
+journal_set_base_time (GMessageJournal *journal)
+{
+  journal->base_real_time = g_get_real_time ();
+  journal->base_time = journal_get_coarse_time ();
+}
+
+/* Returns the record at @offset, or NULL if there is no valid record */
+static JournalRecord *
+journal_record_at (const guint8 *data, gsize length, gsize offset)
+{
+  JournalRecord *record;
+  guint64 header_size;
+
+  if ((guint64) offset + sizeof (JournalRecord) > length)
+    return NULL;
+
+  record = (JournalRecord *) (data + offset);
+  if (record->size < sizeof (JournalRecord) || record->size > length - offset ||
+      record->size % 8 != 0 || record->name_length == 0)
+    return NULL;
+
+  header_size = JOURNAL_ALIGN ((guint64) sizeof (JournalRecord) + record->name_length + record->type_length);
+  if (header_size + record->payload_size > record->size)
+    return NULL;
+
+  /* Both strings must be nul-terminated */
+  data += offset + sizeof (JournalRecord);
+  if (data[record->name_length - 1] != '\0' ||
+      (record->type_length > 0 && data[record->name_length + record->type_length - 1] != '\0'))
+    return NULL;
+
+  return record;
+}
+
+/**
+ * g_message_journal_new:
+ *
+ * Creates a new journal, which needs to be opened with
+ * g_message_journal_open() before it can record anything.
+ *
+ * Returns: a new #GMessageJournal
+ */
+GMessageJournal *
+g_message_journal_new (void)
+{
+  GMessageJournal *journal = g_new0 (GMessageJournal, 1);
+
+  g_mutex_init (&journal->lock);
+  g_mutex_init (&journal->sync_lock);
+  g_cond_init (&journal->cond);
+  journal->fd = -1;
+
+  return journal;
+}
+
+/**
+ * g_message_journal_free:
+ * @journal: a #GMessageJournal
+ *
+ * Closes and frees @journal.
+ */
+void
+g_message_journal_free (GMessageJournal *journal)
+{
+  g_message_journal_close (journal);
+  g_cond_clear (&journal->cond);
+  g_mutex_clear (&journal->sync_lock);
+  g_mutex_clear (&journal->lock);
+  g_free (journal);
+}
+
+/* Grows the file to @size, doesn't need the lock */
+static gboolean
+journal_grow_file (gint fd, const gchar *path, gsize size, GError **error)
+{
+  gint ret;
+
+  /* Allocating the blocks now spares the file system doing it on the page
+   * faults of appending, falling back to a sparse file where it can't */
+  ret = fallocate (fd, 0, 0, size);
+  if (ret < 0 && (errno == EOPNOTSUPP || errno == ENOSYS))
+    ret = ftruncate (fd, size);
+  if (ret < 0)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "Could not grow message journal %s: %s", path, g_strerror (saved_errno));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Maps the first @size bytes of the file, keeping the pages already
+ * mapped. Must be called with the lock held */
+static gboolean
+g_message_journal_map (GMessageJournal *journal, gsize size, GError **error)
+{
+  guint8 *map;
+
+  if (journal->map == NULL)
+    map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, journal->fd, 0);
+  else
+    map = mremap (journal->map, journal->size, size, MREMAP_MAYMOVE);
+  if (map == MAP_FAILED)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "Could not map message journal %s: %s", journal->path, g_strerror (saved_errno));
+      return FALSE;
+    }
+
+  journal->map = map;
+  journal->size = size;
+  journal->grow_failed = FALSE;
+
+  return TRUE;
+}
+
+/* Faults in the pages of @map from @start to @end, so that appending only
+ * takes the cheap fault of writing to a page that is already mapped. Not
+ * for writing, which would have the zeroes written back to disk before the
+ * records. Older kernels only read ahead */
+static void
+journal_populate (guint8 *map, gsize start, gsize end)
+{
+  start &= ~(gsize) (sysconf (_SC_PAGESIZE) - 1);
+  if (start < end && madvise (map + start, end - start, MADV_POPULATE_READ) < 0)
+    madvise (map + start, end - start, MADV_WILLNEED);
+}
+
+/* Whether the sync thread should grow the journal ahead of appending, must
+ * be called with the lock held */
+static gboolean
+journal_needs_growing (GMessageJournal *journal)
+{
+  return journal->end > journal->size / 2 && !journal->grow_failed;
+}
+
+/* Doubles the journal, allocating and faulting in the new half without the
+ * lock so that appending isn't held. Called from the sync thread with the
+ * lock held */
+static void
+journal_grow (GMessageJournal *journal)
+{
+  GError *error = NULL;
+  gsize old_size = journal->size, size = old_size * 2;
+  gboolean ret;
+
+  g_mutex_unlock (&journal->lock);
+  ret = journal_grow_file (journal->fd, journal->path, size, &error);
+  g_mutex_lock (&journal->lock);
+
+  /* Unless appending ran out of room and grew it first */
+  if (ret && journal->size == old_size)
+    ret = g_message_journal_map (journal, size, &error);
+  if (!ret)
+    {
+      /* Appending will try again when it runs out of room */
+      g_warning ("%s", error->message);
+      g_error_free (error);
+      journal->grow_failed = TRUE;
+      return;
+    }
+
+  if (journal->size == size)
+    {
+      guint8 *map = journal->map;
+
+      /* Appending waits for this before moving the mapping */
+      journal->populating = TRUE;
+      g_mutex_unlock (&journal->lock);
+      journal_populate (map, old_size, size);
+      g_mutex_lock (&journal->lock);
+      journal->populating = FALSE;
+      g_cond_broadcast (&journal->cond);
+    }
+}
+
+static gpointer
+journal_sync_thread (gpointer data)
+{
+  GMessageJournal *journal = data;
+
+  g_mutex_lock (&journal->lock);
+  while (!journal->stopping)
+    {
+      GError *error = NULL;
+
+      if (journal_needs_growing (journal))
+        {
+          journal_grow (journal);
+          continue;
+        }
+      if (!journal->dirty)
+        {
+          g_cond_wait (&journal->cond, &journal->lock);
+          continue;
+        }
+      if (g_get_monotonic_time () < journal->dirty_since + JOURNAL_SYNC_INTERVAL)
+        {
+          g_cond_wait_until (&journal->cond, &journal->lock, journal->dirty_since + JOURNAL_SYNC_INTERVAL);
+          continue;
+        }
+
+      g_mutex_unlock (&journal->lock);
+      if (!g_message_journal_sync (journal, &error))
+        {
+          g_warning ("%s", error->message);
+          g_error_free (error);
+        }
+      g_mutex_lock (&journal->lock);
+    }
+  g_mutex_unlock (&journal->lock);
+
+  return NULL;
+}
+
+/**
+ * g_message_journal_open:
+ * @journal: a #GMessageJournal
+ * @path: the journal file
+ * @error: return location for a #GError, or %NULL
+ *
+ * Opens the journal file at @path, creating it if needed. Messages are
+ * appended after the ones already in it.
+ *
+ * Returns: %TRUE if the journal was opened
+ */
+gboolean
+g_message_journal_open (GMessageJournal *journal, const gchar *path, GError **error)
+{
+  JournalRecord *record;
+  struct stat st;
+  gboolean ret = FALSE;
+
+  g_return_val_if_fail (path != NULL, FALSE);
+  g_return_val_if_fail (!g_message_journal_is_open (journal), FALSE);
+
+  g_mutex_lock (&journal->lock);
+
+  journal->path = g_strdup (path);
+  journal->fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (journal->fd < 0 || fstat (journal->fd, &st) < 0)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "Could not open message journal %s: %s", path, g_strerror (saved_errno));
+      goto out;
+    }
+
+  if (st.st_size != 0 && st.st_size < (goffset) sizeof (JournalHeader))
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "%s is not a message journal", path);
+      goto out;
+    }
+
+  if (!journal_grow_file (journal->fd, path, MAX (st.st_size, JOURNAL_INITIAL_SIZE), error) ||
+      !g_message_journal_map (journal, MAX (st.st_size, JOURNAL_INITIAL_SIZE), error))
+    goto out;
+  journal_populate (journal->map, st.st_size, journal->size);
+
+  if (st.st_size == 0)
+    {
+      memcpy (journal->map, JOURNAL_MAGIC, sizeof (((JournalHeader *) NULL)->magic));
+    }
+  else if (memcmp (journal->map, JOURNAL_MAGIC, sizeof (((JournalHeader *) NULL)->magic)) != 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "%s is not a message journal", path);
+      goto out;
+    }
+
+  /* Find the end of the records, anything after a torn record is lost */
+  journal->end = sizeof (JournalHeader);
+  journal->next_seq = 1;
+  while ((record = journal_record_at (journal->map, journal->size, journal->end)) != NULL)
+    {
+      journal->next_seq = record->seq + 1;
+      journal->end += record->size;
+    }
+  memset (journal->map + journal->end, 0, journal->size - journal->end);
+
+  journal->dirty = FALSE;
+  journal_set_base_time (journal);
+  journal->stopping = FALSE;
+  journal->sync_thread = g_thread_new ("gmessage-journal", journal_sync_thread, journal);
+  g_atomic_int_set (&journal->is_open, TRUE);
+  ret = TRUE;
+
+ out:
+  if (!ret)
+    {
+      if (journal->map != NULL)
+        {
+          munmap (journal->map, journal->size);
+          journal->map = NULL;
+        }
+      if (journal->fd >= 0)
+        {
+          close (journal->fd);
+          journal->fd = -1;
+        }
+      g_clear_pointer (&journal->path, g_free);
+    }
+  g_mutex_unlock (&journal->lock);
+
+  return ret;
+}
+
+/**
+ * g_message_journal_close:
+ * @journal: a #GMessageJournal
+ *
+ * Syncs and closes the journal file, if it is open.
+ */
+void
+g_message_journal_close (GMessageJournal *journal)
+{
+  GThread *sync_thread;
+
+  /* The thread syncs with sync_lock, so it is stopped first */
+  g_mutex_lock (&journal->lock);
+  sync_thread = journal->sync_thread;
+  journal->sync_thread = NULL;
+  journal->stopping = TRUE;
+  g_cond_signal (&journal->cond);
+  g_mutex_unlock (&journal->lock);
+
+  if (sync_thread != NULL)
+    g_thread_join (sync_thread);
+
+  g_mutex_lock (&journal->sync_lock);
+  g_mutex_lock (&journal->lock);
+
+  if (journal->is_open)
+    {
+      g_atomic_int_set (&journal->is_open, FALSE);
+
+      munmap (journal->map, journal->size);
+      journal->map = NULL;
+      /* Don't leave the room reserved for new records */
+      if (ftruncate (journal->fd, journal->end) < 0 || fsync (journal->fd) < 0)
+        {
+          g_warning ("Could not sync message journal %s: %s", journal->path, g_strerror (errno));
+        }
+      close (journal->fd);
+      journal->fd = -1;
+      g_clear_pointer (&journal->path, g_free);
+    }
+
+  g_mutex_unlock (&journal->lock);
+  g_mutex_unlock (&journal->sync_lock);
+}
+
+/**
+ * g_message_journal_is_open:
+ * @journal: a #GMessageJournal
+ *
+ * Returns: whether @journal is recording messages
+ */
+gboolean
+g_message_journal_is_open (GMessageJournal *journal)
+{
+  return g_atomic_int_get (&journal->is_open);
+}
+
+/**
+ * g_message_journal_append:
+ * @journal: a #GMessageJournal
+ * @message: the message to record
+ *
+ * Appends the name and payload of @message to the journal, if it is open.
+ * This can be called from any thread. The record is synced to disk within
+ * JOURNAL_SYNC_INTERVAL.
+ *
+ * Returns: %TRUE if @message was recorded
+ */
+gboolean
+g_message_journal_append (GMessageJournal *journal, GMessage *message)
+{
+  const gchar *name, *type = NULL;
+  GVariant *payload;
+  JournalRecord *record;
+  guint32 name_length, type_length = 0;
+  gsize payload_size = 0;
+  guint64 header_size, size;
+  gboolean recorded = FALSE;
+
+  if (!g_atomic_int_get (&journal->is_open))
+    return FALSE;
+
+  name = g_message_get_name (message);
+  name_length = strlen (name) + 1;
+  payload = g_message_get_payload (message);
+  if (payload != NULL)
+    {
+      type = g_variant_get_type_string (payload);
+      type_length = strlen (type) + 1;
+      /* This serializes the payload if needed, better outside the lock */
+      payload_size = g_variant_get_size (payload);
+    }
+  header_size = JOURNAL_ALIGN ((guint64) sizeof (JournalRecord) + name_length + type_length);
+  size = JOURNAL_ALIGN (header_size + payload_size);
+  g_return_val_if_fail (size <= G_MAXUINT32, FALSE);
+
+  g_mutex_lock (&journal->lock);
+
+  if (!journal->is_open)
+    goto out;
+
+  /* Outrunning the sync thread growing the journal */
+  while (journal->end + size > journal->size && journal->populating)
+    g_cond_wait (&journal->cond, &journal->lock);
+  if (journal->end + size > journal->size)
+    {
+      GError *error = NULL;
+      gsize old_size = journal->size, new_size = old_size;
+
+      while (new_size < journal->end + size)
+        new_size *= 2;
+
+      if (!journal_grow_file (journal->fd, journal->path, new_size, &error) ||
+          !g_message_journal_map (journal, new_size, &error))
+        {
+          g_warning ("%s", error->message);
+          g_error_free (error);
+          goto out;
+        }
+      journal_populate (journal->map, old_size, new_size);
+    }
+
+  record = (JournalRecord *) (journal->map + journal->end);
+  record->name_length = name_length;
+  record->type_length = type_length;
+  record->payload_size = payload_size;
+  record->seq = journal->next_seq++;
+  record->timestamp = journal->base_real_time + (journal_get_coarse_time () - journal->base_time);
+  memcpy ((gchar *) (record + 1), name, name_length);
+  if (payload != NULL)
+    {
+      memcpy ((gchar *) (record + 1) + name_length, type, type_length);
+      g_variant_store (payload, journal->map + journal->end + header_size);
+    }
+  /* Last, so that a record is either complete or not there */
+  g_atomic_int_set ((gint *) &record->size, (gint) size);
+
+  journal->end += size;
+  if (!journal->dirty)
+    {
+      journal->dirty = TRUE;
+      journal->dirty_since = g_get_monotonic_time ();
+      g_cond_signal (&journal->cond);
+    }
+  else if (journal->end - size <= journal->size / 2 && journal_needs_growing (journal))
+    g_cond_signal (&journal->cond);
+  recorded = TRUE;
+
+ out:
+  g_mutex_unlock (&journal->lock);
+
+  return recorded;
+}
+
+/**
+ * g_message_journal_sync:
+ * @journal: a #GMessageJournal
+ * @error: return location for a #GError, or %NULL
+ *
+ * Writes the records appended so far to disk. This doesn't hold appending
+ * new records.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+g_message_journal_sync (GMessageJournal *journal, GError **error)
+{
+  gboolean ret = TRUE;
+  gint fd;
+
+  g_mutex_lock (&journal->sync_lock);
+
+  g_mutex_lock (&journal->lock);
+  fd = journal->fd;
+  journal->dirty = FALSE;
+  /* The monotonic clock drifts from the wall clock */
+  journal_set_base_time (journal);
+  g_mutex_unlock (&journal->lock);
+
+  /* The mapping is shared, so its dirty pages are written back by fsync */
+  if (fd >= 0 && fsync (fd) < 0)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "Could not sync message journal: %s", g_strerror (saved_errno));
+      ret = FALSE;
+    }
+
+  g_mutex_unlock (&journal->sync_lock);
+
+  return ret;
+}
+
+/**
+ * g_message_journal_get_offset:
+ * @journal: a #GMessageJournal
+ *
+ * Gets the offset the next record will be written at, to be given to
+ * g_message_journal_replay() to replay messages appended from now on.
+ *
+ * Returns: the offset of the end of the journal, or 0 if it is not open
+ */
+guint64
+g_message_journal_get_offset (GMessageJournal *journal)
+{
+  guint64 offset = 0;
+
+  g_mutex_lock (&journal->lock);
+  if (journal->is_open)
+    {
+      offset = journal->end;
+    }
+  g_mutex_unlock (&journal->lock);
+
+  return offset;
+}
+
+/**
+ * g_message_journal_replay:
+ * @journal: a #GMessageJournal
+ * @from_offset: an offset returned by g_message_journal_get_offset(), or 0
+ * to start from the first record
+ * @func: function to call for each record
+ * @user_data: data to pass to @func
+ * @error: return location for a #GError, or %NULL
+ *
+ * Calls @func for the records of the journal from @from_offset, up to the
+ * last one appended when this is called. The journal is read from its own
+ * mapping, so @func can append records, and payloads point into it instead
+ * of being copied.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+g_message_journal_replay (GMessageJournal *journal,
+                          guint64 from_offset,
+                          GMessageJournalFunc func,
+                          gpointer user_data,
+                          GError **error)
+{
+  GMappedFile *file;
+  const guint8 *data;
+  JournalRecord *record;
+  gchar *path;
+  gsize end, offset;
+
+  g_mutex_lock (&journal->lock);
+  path = g_strdup (journal->path);
+  end = journal->end;
+  g_mutex_unlock (&journal->lock);
+
+  if (path == NULL)
+    {
+      g_set_error_literal (error, G_FILE_ERROR, G_FILE_ERROR_BADF,
+                           "The message journal is not open");
+      return FALSE;
+    }
+
+  file = g_mapped_file_new (path, FALSE, error);
+  g_free (path);
+  if (file == NULL)
+    return FALSE;
+
+  data = (const guint8 *) g_mapped_file_get_contents (file);
+  end = MIN (end, g_mapped_file_get_length (file));
+  offset = MAX (from_offset, sizeof (JournalHeader));
+
+  while ((record = journal_record_at (data, end, offset)) != NULL)
+    {
+      const gchar *name = (const gchar *) (record + 1);
+      GVariant *payload = NULL;
+
+      if (record->type_length > 0)
+        {
+          const gchar *type = name + record->name_length;
+          guint64 header_size = JOURNAL_ALIGN ((guint64) sizeof (JournalRecord) + record->name_length + record->type_length);
+
+          if (!g_variant_type_string_is_valid (type))
+            break;
+
+          payload = g_variant_new_from_data (G_VARIANT_TYPE (type),
+                                             data + offset + header_size,
+                                             record->payload_size,
+                                             FALSE,
+                                             (GDestroyNotify) g_mapped_file_unref,
+                                             g_mapped_file_ref (file));
+          g_variant_ref_sink (payload);
+        }
+
+      func (name, payload, user_data);
+
+      if (payload != NULL)
+        {
+          g_variant_unref (payload);
+        }
+      offset += record->size;
+    }
+
+  g_mapped_file_unref (file);
+
+  return TRUE;
+}
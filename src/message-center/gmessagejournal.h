@@ -0,0 +1,56 @@
+/* GPattern - GLib software patterns implementation library
+ *
+ * Copyright (C) 2014 Rodrigo Moya
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Author: Rodrigo Moya <rodrigo@gnome.org>
+ */
+
+#ifndef __G_MESSAGE_JOURNAL_H__
+#define __G_MESSAGE_JOURNAL_H__
+
+#include "gmessage.h"
+
+G_BEGIN_DECLS
+
+/* Private to the message center implementation, not installed */
+
+typedef struct _GMessageJournal GMessageJournal;
+
+typedef void (* GMessageJournalFunc) (const gchar *message_name,
+                                      GVariant *payload,
+                                      gpointer user_data);
+
+GMessageJournal *g_message_journal_new        (void);
+void             g_message_journal_free       (GMessageJournal *journal);
+
+gboolean         g_message_journal_open       (GMessageJournal *journal, const gchar *path, GError **error);
+void             g_message_journal_close      (GMessageJournal *journal);
+gboolean         g_message_journal_is_open    (GMessageJournal *journal);
+
+gboolean         g_message_journal_append     (GMessageJournal *journal, GMessage *message);
+gboolean         g_message_journal_sync       (GMessageJournal *journal, GError **error);
+guint64          g_message_journal_get_offset (GMessageJournal *journal);
+gboolean         g_message_journal_replay     (GMessageJournal *journal,
+                                               guint64 from_offset,
+                                               GMessageJournalFunc func,
+                                               gpointer user_data,
+                                               GError **error);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,40 @@
+/* GPattern - GLib software patterns implementation library
+ *
+ * Copyright (C) 2014 Rodrigo Moya
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Author: Rodrigo Moya <rodrigo@gnome.org>
+ */
+
+#ifndef __G_MESSAGE_PRIVATE_H__
+#define __G_MESSAGE_PRIVATE_H__
+
+#include "gmessage.h"
+
+G_BEGIN_DECLS
+
+/* Private to the message center implementation, not installed */
+
+GMessage *g_message_pool_acquire        (GObject *sender, GQuark message_name, gpointer user_data);
+void      g_message_pool_release        (GMessage *message);
+
+GMessage *g_message_copy                (GMessage *message);
+void      g_message_set_coalesced_count (GMessage *message, guint count);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,574 @@
+/* GPattern - GLib software patterns implementation library
+ *
+ * Copyright (C) 2014 Rodrigo Moya
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Author: Rodrigo Moya <rodrigo@gnome.org>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "gmessagering.h"
+
+/*
+ * GMessageRing is a single-producer single-consumer ring of records in
+ * memory shared between two processes, through a memfd. The producer
+ * writes records in place, and publishes them by moving the head; the
+ * consumer gets them as #GBytes pointing into the ring, and the space they
+ * take is only given back to the producer, by moving the tail, once those
+ * are freed, so that records can be decoded in place. As the tail only
+ * moves in order, a record which is kept holds back the space of all the
+ * ones after it.
+ *
+ * Each side tells the other that something changed with an eventfd, only
+ * when the other side said it was waiting, so that a busy ring doesn't
+ * need any system call. A side waits by setting its flag, then looking at
+ * the ring again, and the other side clears the flag before signalling,
+ * so that no change is missed.
+ *
+ * The producer also writes when it started waiting for space, so that
+ * both sides can tell how long it was stalled by the consumer, the
+ * monotonic clock being the same for all the processes of a host.
+ *
+ * The memfd starts with a RingHeader, with the head and the tail in
+ * separate cache lines, followed by the records. A record is a RingRecord
+ * followed by its contents, aligned on 8 bytes; records don't wrap around
+ * the end of the ring, which is filled with a padding record instead.
+ */
+
+#define RING_MAGIC       "GMRING01"
+#define RING_HEADER_SIZE 4096
+#define RING_ALIGN(size) (((size) + 7) & ~(gsize) 7)
+#define RING_PADDING     G_MAXUINT32
+
+typedef struct
+{
+  gchar magic[8];
+  guint32 size;
+  guint32 reserved;
+  guint8 padding0[48];
+
+  /* Written by the producer. Positions count bytes since the start, and
+   * wrap around */
+  gint head;
+  gint consumer_waiting;
+  guint8 padding1[56];
+
+  /* Written by the consumer, but for when the producer started waiting,
+   * in monotonic time */
+  gint tail;
+  gint producer_waiting;
+  gint64 producer_stalled_since;
+} RingHeader;
+
+typedef struct
+{
+  /* Of the whole record, a multiple of 8 */
+  guint32 size;
+  /* Of the contents, RING_PADDING for padding */
+  guint32 length;
+} RingRecord;
+
+/* A record the consumer got, which the tail can't move past until it is
+ * released */
+typedef struct
+{
+  GMessageRing *ring;
+  guint32 end;
+  gboolean released;
+} RingSpan;
+
+struct _GMessageRing
+{
+  gint ref_count;
+  gint memfd;
+  gint data_fd;
+  gint space_fd;
+  RingHeader *header;
+  guint8 *data;
+  guint32 size;
+
+  /* Producer side, head and the size of the reserved record, not published
+   * yet, and since when it waits for space, or 0 */
+  guint32 head;
+  guint32 reserved;
+  gint64 stalled_since;
+
+  /* Consumer side, spans are protected by lock as records might be freed
+   * from any thread, as well as the time the producer was stalled until
+   * which is counted already */
+  guint32 read_pos;
+  GMutex lock;
+  GQueue spans;
+  gint64 stall_counted_until;
+
+  /* On either side, the time the producer was stalled, in microseconds,
+   * protected by lock */
+  gint64 stalled_time;
+};
+
+static GMessageRing *
+g_message_ring_map (gint memfd, gint data_fd, gint space_fd, guint32 size, GError **error)
+{
+  GMessageRing *ring;
+  gpointer map;
+
+  map = mmap (NULL, RING_HEADER_SIZE + size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (map == MAP_FAILED)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "Could not map message ring: %s", g_strerror (saved_errno));
+      return NULL;
+    }
+
+  ring = g_new0 (GMessageRing, 1);
+  ring->ref_count = 1;
+  ring->memfd = memfd;
+  ring->data_fd = data_fd;
+  ring->space_fd = space_fd;
+  ring->header = map;
+  ring->data = (guint8 *) map + RING_HEADER_SIZE;
+  ring->size = size;
+  g_mutex_init (&ring->lock);
+  g_queue_init (&ring->spans);
+
+  return ring;
+}
+
+/**
+ * g_message_ring_new:
+ * @size: the size of the ring, a power of 2
+ * @error: return location for a #GError, or %NULL
+ *
+ * Creates a ring to produce records in. The consumer attaches to it with
+ * g_message_ring_attach(), using the file descriptors given by
+ * g_message_ring_get_fds().
+ *
+ * Returns: a new #GMessageRing, or %NULL on error
+ */
+GMessageRing *
+g_message_ring_new (gsize size, GError **error)
+{
+  GMessageRing *ring;
+  gint memfd, data_fd = -1, space_fd = -1;
+
+  g_return_val_if_fail (size >= 4096 && size <= G_MAXINT32 && (size & (size - 1)) == 0, NULL);
+
+  memfd = memfd_create ("gpattern-message-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (memfd >= 0 && ftruncate (memfd, RING_HEADER_SIZE + size) == 0 &&
+      fcntl (memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0)
+    {
+      data_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+      space_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    }
+
+  if (data_fd < 0 || space_fd < 0)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "Could not create message ring: %s", g_strerror (saved_errno));
+      ring = NULL;
+    }
+  else
+    {
+      ring = g_message_ring_map (memfd, data_fd, space_fd, size, error);
+    }
+
+  if (ring == NULL)
+    {
+      if (memfd >= 0)
+        close (memfd);
+      if (data_fd >= 0)
+        close (data_fd);
+      if (space_fd >= 0)
+        close (space_fd);
+      return NULL;
+    }
+
+  memcpy (ring->header->magic, RING_MAGIC, sizeof (ring->header->magic));
+  ring->header->size = size;
+
+  return ring;
+}
+
+/**
+ * g_message_ring_attach:
+ * @memfd: the memfd of the ring
+ * @data_fd: the eventfd signalling new records
+ * @space_fd: the eventfd signalling free space
+ * @error: return location for a #GError, or %NULL
+ *
+ * Attaches to a ring created by another process, to consume its records.
+ * @memfd must be sealed against shrinking and growing, as
+ * g_message_ring_new() does. The file descriptors are owned by the ring,
+ * even on error.
+ *
+ * Returns: a new #GMessageRing, or %NULL on error
+ */
+GMessageRing *
+g_message_ring_attach (gint memfd, gint data_fd, gint space_fd, GError **error)
+{
+  GMessageRing *ring = NULL;
+  RingHeader header;
+  struct stat st;
+  gint seals;
+
+  /* Without the seals, the peer could shrink the memfd under our mapping,
+   * and have us killed by SIGBUS */
+  seals = fcntl (memfd, F_GET_SEALS);
+  if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) != (F_SEAL_SHRINK | F_SEAL_GROW) ||
+      fstat (memfd, &st) < 0 || st.st_size < RING_HEADER_SIZE ||
+      pread (memfd, &header, sizeof (header), 0) != sizeof (header) ||
+      memcmp (header.magic, RING_MAGIC, sizeof (header.magic)) != 0 ||
+      header.size == 0 || (header.size & (header.size - 1)) != 0 ||
+      st.st_size != RING_HEADER_SIZE + (goffset) header.size)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid message ring");
+    }
+  else
+    {
+      ring = g_message_ring_map (memfd, data_fd, space_fd, header.size, error);
+    }
+
+  if (ring == NULL)
+    {
+      close (memfd);
+      close (data_fd);
+      close (space_fd);
+      return NULL;
+    }
+
+  ring->read_pos = (guint32) g_atomic_int_get (&ring->header->tail);
+
+  return ring;
+}
+
+GMessageRing *
+g_message_ring_ref (GMessageRing *ring)
+{
+  g_atomic_int_inc (&ring->ref_count);
+
+  return ring;
+}
+
+void
+g_message_ring_unref (GMessageRing *ring)
+{
+  if (!g_atomic_int_dec_and_test (&ring->ref_count))
+    return;
+
+  munmap (ring->header, RING_HEADER_SIZE + ring->size);
+  close (ring->memfd);
+  close (ring->data_fd);
+  close (ring->space_fd);
+  g_mutex_clear (&ring->lock);
+  g_free (ring);
+}
+
+/**
+ * g_message_ring_get_fds:
+ * @ring: a #GMessageRing
+ * @memfd: (out): return location for the memfd of the ring
+ * @data_fd: (out): return location for the eventfd signalling new records,
+ * watched by the consumer
+ * @space_fd: (out): return location for the eventfd signalling free space,
+ * watched by the producer
+ *
+ * Gets the file descriptors of @ring, which remain owned by it.
+ */
+void
+g_message_ring_get_fds (GMessageRing *ring, gint *memfd, gint *data_fd, gint *space_fd)
+{
+  *memfd = ring->memfd;
+  *data_fd = ring->data_fd;
+  *space_fd = ring->space_fd;
+}
+
+/**
+ * g_message_ring_get_max_record:
+ * @ring: a #GMessageRing
+ *
+ * Gets the size of the largest record that can be written in @ring, which
+ * is kept to a fraction of the ring so that a few records fit at once.
+ *
+ * Returns: the maximum length of a record
+ */
+gsize
+g_message_ring_get_max_record (GMessageRing *ring)
+{
+  return ring->size / 4 - sizeof (RingRecord);
+}
+
+/**
+ * g_message_ring_clear_event:
+ * @fd: the data or space eventfd of a ring
+ *
+ * Clears the event, once the ring is being looked at after it was
+ * signalled.
+ */
+void
+g_message_ring_clear_event (gint fd)
+{
+  eventfd_t value;
+
+  eventfd_read (fd, &value);
+}
+
+static gboolean
+ring_has_space (GMessageRing *ring, guint32 needed)
+{
+  guint32 used = ring->head - (guint32) g_atomic_int_get (&ring->header->tail);
+
+  return ring->size - used >= needed;
+}
+
+/**
+ * g_message_ring_reserve:
+ * @ring: a #GMessageRing
+ * @length: the length of the record, at most g_message_ring_get_max_record()
+ *
+ * Reserves a record in @ring, to be written in place and published with
+ * g_message_ring_commit(), before reserving another one. When there isn't
+ * enough space, the space eventfd is signalled once the consumer frees
+ * some.
+ *
+ * Returns: (nullable): the contents of the record, aligned on 8 bytes, or
+ * %NULL if the ring is full
+ */
+gpointer
+g_message_ring_reserve (GMessageRing *ring, gsize length)
+{
+  RingRecord *record;
+  guint32 offset, skip, total;
+
+  g_return_val_if_fail (length <= g_message_ring_get_max_record (ring), NULL);
+
+  total = sizeof (RingRecord) + RING_ALIGN (length);
+  offset = ring->head & (ring->size - 1);
+  skip = ring->size - offset < total ? ring->size - offset : 0;
+
+  if (!ring_has_space (ring, skip + total))
+    {
+      if (ring->stalled_since == 0)
+        {
+          ring->stalled_since = g_get_monotonic_time ();
+          ring->header->producer_stalled_since = ring->stalled_since;
+        }
+      g_atomic_int_set (&ring->header->producer_waiting, TRUE);
+      if (!ring_has_space (ring, skip + total))
+        return NULL;
+      g_atomic_int_set (&ring->header->producer_waiting, FALSE);
+    }
+
+  if (ring->stalled_since != 0)
+    {
+      g_mutex_lock (&ring->lock);
+      ring->stalled_time += g_get_monotonic_time () - ring->stalled_since;
+      ring->stalled_since = 0;
+      g_mutex_unlock (&ring->lock);
+    }
+
+  if (skip > 0)
+    {
+      record = (RingRecord *) (ring->data + offset);
+      record->size = skip;
+      record->length = RING_PADDING;
+      ring->head += skip;
+      offset = 0;
+    }
+
+  record = (RingRecord *) (ring->data + offset);
+  record->size = total;
+  record->length = length;
+  ring->reserved = total;
+
+  return record + 1;
+}
+
+/**
+ * g_message_ring_commit:
+ * @ring: a #GMessageRing
+ *
+ * Publishes the record reserved with g_message_ring_reserve().
+ */
+void
+g_message_ring_commit (GMessageRing *ring)
+{
+  ring->head += ring->reserved;
+  ring->reserved = 0;
+  g_atomic_int_set (&ring->header->head, (gint) ring->head);
+
+  if (g_atomic_int_compare_and_exchange (&ring->header->consumer_waiting, TRUE, FALSE))
+    eventfd_write (ring->data_fd, 1);
+}
+
+static void
+ring_span_release (gpointer data)
+{
+  RingSpan *span = data;
+  GMessageRing *ring = span->ring;
+  gboolean advanced = FALSE;
+  guint32 tail = 0;
+
+  g_mutex_lock (&ring->lock);
+  span->released = TRUE;
+  while ((span = g_queue_peek_head (&ring->spans)) != NULL && span->released)
+    {
+      g_queue_pop_head (&ring->spans);
+      tail = span->end;
+      advanced = TRUE;
+      g_free (span);
+    }
+  if (advanced)
+    g_atomic_int_set (&ring->header->tail, (gint) tail);
+
+  /* The producer says since when it waits, which is not trusted any more
+   * than the rest, as long as it only makes for a wrong figure */
+  if (advanced && g_atomic_int_compare_and_exchange (&ring->header->producer_waiting, TRUE, FALSE))
+    {
+      gint64 now = g_get_monotonic_time ();
+      gint64 since = MAX (ring->header->producer_stalled_since, ring->stall_counted_until);
+
+      if (since < now)
+        ring->stalled_time += now - since;
+      ring->stall_counted_until = now;
+      eventfd_write (ring->space_fd, 1);
+    }
+  g_mutex_unlock (&ring->lock);
+
+  g_message_ring_unref (ring);
+}
+
+static RingSpan *
+ring_span_new (GMessageRing *ring, guint32 end)
+{
+  RingSpan *span = g_new0 (RingSpan, 1);
+
+  span->ring = g_message_ring_ref (ring);
+  span->end = end;
+
+  g_mutex_lock (&ring->lock);
+  g_queue_push_tail (&ring->spans, span);
+  g_mutex_unlock (&ring->lock);
+
+  return span;
+}
+
+/**
+ * g_message_ring_read:
+ * @ring: a #GMessageRing
+ * @record: (out): return location for the next record, or %NULL if there
+ * is none
+ *
+ * Gets the next record of @ring, pointing into the ring. Its space is
+ * given back to the producer once it is freed, and as this happens in
+ * order, records should not be kept for long. When there is no record,
+ * the data eventfd is signalled once the producer publishes some.
+ *
+ * Returns: %FALSE if the ring is corrupted
+ */
+gboolean
+g_message_ring_read (GMessageRing *ring, GBytes **record)
+{
+  *record = NULL;
+
+  for (;;)
+    {
+      guint32 head = (guint32) g_atomic_int_get (&ring->header->head);
+      guint32 offset, size, length;
+      RingRecord *ring_record;
+
+      if (ring->read_pos == head)
+        {
+          g_atomic_int_set (&ring->header->consumer_waiting, TRUE);
+          if ((guint32) g_atomic_int_get (&ring->header->head) == ring->read_pos)
+            return TRUE;
+          g_atomic_int_set (&ring->header->consumer_waiting, FALSE);
+          continue;
+        }
+
+      /* The producer might be another process, so nothing is trusted */
+      offset = ring->read_pos & (ring->size - 1);
+      ring_record = (RingRecord *) (ring->data + offset);
+      size = ring_record->size;
+      length = ring_record->length;
+      if (size < sizeof (RingRecord) || size % 8 != 0 ||
+          size > ring->size - offset || size > head - ring->read_pos ||
+          (length != RING_PADDING && length > size - sizeof (RingRecord)))
+        return FALSE;
+
+      ring->read_pos += size;
+      if (length == RING_PADDING)
+        {
+          ring_span_release (ring_span_new (ring, ring->read_pos));
+          continue;
+        }
+
+      *record = g_bytes_new_with_free_func (ring_record + 1,
+                                            length,
+                                            ring_span_release,
+                                            ring_span_new (ring, ring->read_pos));
+      return TRUE;
+    }
+}
+
+/**
+ * g_message_ring_get_stalled_time:
+ * @ring: a #GMessageRing
+ *
+ * Gets how long the producer waited for space in @ring. On the consumer
+ * side, this only counts the waits which are over.
+ *
+ * Returns: the time, in microseconds
+ */
+gint64
+g_message_ring_get_stalled_time (GMessageRing *ring)
+{
+  gint64 stalled_time;
+
+  g_mutex_lock (&ring->lock);
+  stalled_time = ring->stalled_time;
+  if (ring->stalled_since != 0)
+    stalled_time += g_get_monotonic_time () - ring->stalled_since;
+  g_mutex_unlock (&ring->lock);
+
+  return stalled_time;
+}
+
+/**
+ * g_message_ring_wakeup:
+ * @ring: a #GMessageRing
+ *
+ * Signals the data eventfd of @ring, so that the consumer looks at it
+ * again, when it stopped before reading all the records.
+ */
+void
+g_message_ring_wakeup (GMessageRing *ring)
+{
+  eventfd_write (ring->data_fd, 1);
+}
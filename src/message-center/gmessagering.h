@@ -0,0 +1,54 @@
+/* GPattern - GLib software patterns implementation library
+ *
+ * Copyright (C) 2014 Rodrigo Moya
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Author: Rodrigo Moya <rodrigo@gnome.org>
+ */
+
+#ifndef __G_MESSAGE_RING_H__
+#define __G_MESSAGE_RING_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Private to the message center implementation, not installed */
+
+typedef struct _GMessageRing GMessageRing;
+
+GMessageRing *g_message_ring_new              (gsize size, GError **error);
+GMessageRing *g_message_ring_attach           (gint memfd, gint data_fd, gint space_fd, GError **error);
+GMessageRing *g_message_ring_ref              (GMessageRing *ring);
+void          g_message_ring_unref            (GMessageRing *ring);
+
+void          g_message_ring_get_fds          (GMessageRing *ring,
+                                               gint *memfd,
+                                               gint *data_fd,
+                                               gint *space_fd);
+gsize         g_message_ring_get_max_record   (GMessageRing *ring);
+void          g_message_ring_clear_event      (gint fd);
+
+gpointer      g_message_ring_reserve          (GMessageRing *ring, gsize length);
+void          g_message_ring_commit           (GMessageRing *ring);
+gboolean      g_message_ring_read             (GMessageRing *ring, GBytes **record);
+void          g_message_ring_wakeup           (GMessageRing *ring);
+gint64        g_message_ring_get_stalled_time (GMessageRing *ring);
+
+G_END_DECLS
+
+#endif
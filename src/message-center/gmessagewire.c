@@ -0,0 +1,331 @@
+/* GPattern - GLib software patterns implementation library
+ *
+ * Copyright (C) 2014 Rodrigo Moya
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Author: Rodrigo Moya <rodrigo@gnome.org>
+ */
+
+#include <string.h>
+
+#include "gmessagewire.h"
+
+/*
+ * The body of a message frame is a WireHeader, followed by the message
+ * name if the topic is new, the payload type string, padding to 8 bytes,
+ * and the payload in its serialized form, which the receiver uses as it is
+ * with g_variant_new_from_bytes(). Payloads sent in a blob of their own
+ * are left out, the frame ending with the type string.
+ *
+ * Message names are only sent the first time, along with the topic they
+ * get, which is the number of topics defined before it: each side keeps a
+ * GMessageWireTable per channel and direction, and later messages only
+ * carry the topic. Topics are never forgotten, as quarks aren't either.
+ */
+
+#define WIRE_ALIGN(size) (((size) + 7) & ~(gsize) 7)
+
+typedef struct
+{
+  guint8 version;
+  guint8 reserved;
+  /* Both including the nul, name_length being 0 unless the topic is new,
+   * and type_length being 0 for messages without payload */
+  guint16 name_length;
+  guint16 type_length;
+  guint16 reserved2;
+  guint32 topic;
+  guint8 sender[G_MESSAGE_WIRE_UUID_SIZE];
+} WireHeader;
+
+struct _GMessageWireTable
+{
+  /* Sending side, quark -> topic + 1 */
+  GHashTable *topics;
+  /* Receiving side, topic -> quark */
+  GArray *names;
+};
+
+GMessageWireTable *
+g_message_wire_table_new (void)
+{
+  GMessageWireTable *table = g_new0 (GMessageWireTable, 1);
+
+  table->topics = g_hash_table_new (g_direct_hash, g_direct_equal);
+  table->names = g_array_new (FALSE, FALSE, sizeof (GQuark));
+
+  return table;
+}
+
+void
+g_message_wire_table_free (GMessageWireTable *table)
+{
+  g_hash_table_destroy (table->topics);
+  g_array_free (table->names, TRUE);
+  g_free (table);
+}
+
+/* Returns the offset of the payload from the start of the body */
+static gsize
+wire_payload_offset (gsize name_length, gsize type_length)
+{
+  return WIRE_ALIGN (sizeof (WireHeader) + name_length + type_length);
+}
+
+/**
+ * g_message_wire_get_size:
+ * @table: the table of the channel the message goes to
+ * @name: the message name
+ * @payload: (allow-none): the message payload
+ * @with_payload: whether the payload goes in the frame
+ *
+ * Gets the size of the frame body g_message_wire_encode() writes, without
+ * defining the topic of @name yet, so that it can be called before knowing
+ * if the message is sent.
+ *
+ * Returns: the size of the body, or 0 if the message can't be encoded
+ */
+gsize
+g_message_wire_get_size (GMessageWireTable *table,
+                         GQuark name,
+                         GVariant *payload,
+                         gboolean with_payload)
+{
+  gsize name_length = 0, type_length = 0;
+
+  if (!g_hash_table_contains (table->topics, GUINT_TO_POINTER (name)))
+    name_length = strlen (g_quark_to_string (name)) + 1;
+  if (payload != NULL)
+    type_length = strlen (g_variant_get_type_string (payload)) + 1;
+
+  if (name_length > G_MAXUINT16 || type_length > G_MAXUINT16)
+    return 0;
+
+  if (!with_payload)
+    return sizeof (WireHeader) + name_length + type_length;
+
+  return wire_payload_offset (name_length, type_length) + (payload != NULL ? g_variant_get_size (payload) : 0);
+}
+
+/**
+ * g_message_wire_encode:
+ * @table: the table of the channel the message goes to
+ * @sender: the %G_MESSAGE_WIRE_UUID_SIZE bytes of the sending process UUID
+ * @name: the message name
+ * @payload: (allow-none): the message payload
+ * @with_payload: whether the payload goes in the frame
+ * @buffer: where to write the body, of the size g_message_wire_get_size()
+ * returned, aligned on 8 bytes
+ *
+ * Writes the body of a message frame, the payload being copied once,
+ * straight from its serialized form. The topic of @name is defined if it
+ * is new, so the frame must then be sent.
+ */
+void
+g_message_wire_encode (GMessageWireTable *table,
+                       const guint8 *sender,
+                       GQuark name,
+                       GVariant *payload,
+                       gboolean with_payload,
+                       gpointer buffer)
+{
+  WireHeader *header = buffer;
+  guint8 *strings = (guint8 *) (header + 1);
+  gpointer topic;
+
+  header->version = G_MESSAGE_WIRE_VERSION;
+  header->reserved = 0;
+  header->reserved2 = 0;
+  memcpy (header->sender, sender, sizeof (header->sender));
+
+  topic = g_hash_table_lookup (table->topics, GUINT_TO_POINTER (name));
+  if (topic != NULL)
+    {
+      header->topic = GPOINTER_TO_UINT (topic) - 1;
+      header->name_length = 0;
+    }
+  else
+    {
+      const gchar *string = g_quark_to_string (name);
+
+      header->topic = g_hash_table_size (table->topics);
+      header->name_length = strlen (string) + 1;
+      memcpy (strings, string, header->name_length);
+      g_hash_table_insert (table->topics, GUINT_TO_POINTER (name), GUINT_TO_POINTER (header->topic + 1));
+    }
+
+  if (payload != NULL)
+    {
+      const gchar *type = g_variant_get_type_string (payload);
+
+      header->type_length = strlen (type) + 1;
+      memcpy (strings + header->name_length, type, header->type_length);
+    }
+  else
+    {
+      header->type_length = 0;
+    }
+
+  if (with_payload)
+    {
+      gsize end = sizeof (WireHeader) + header->name_length + header->type_length;
+      gsize offset = wire_payload_offset (header->name_length, header->type_length);
+
+      memset ((guint8 *) buffer + end, 0, offset - end);
+      if (payload != NULL)
+        g_variant_store (payload, (guint8 *) buffer + offset);
+    }
+}
+
+/**
+ * g_message_wire_decode:
+ * @table: the table of the channel the message comes from
+ * @data: the frame body
+ * @size: the size of @data
+ * @owner: (allow-none): the #GBytes holding @data, if any
+ * @blob: (allow-none): the payload, for frames without it
+ * @name: (out): return location for the message name
+ * @payload: (out): return location for the payload, or %NULL
+ * @sender: (out caller-allocates): where to copy the
+ * %G_MESSAGE_WIRE_UUID_SIZE bytes of the sending process UUID
+ *
+ * Decodes the body of a message frame. The payload is @blob if given, or
+ * the end of @data, used in place if @owner holds it, and copied if not.
+ * Nothing in @data is trusted, as it comes from another process, which
+ * may even still be writing it: everything but the payload is copied out
+ * of it before being checked, and only the copies are used.
+ *
+ * Returns: %FALSE if @data is not a valid message
+ */
+gboolean
+g_message_wire_decode (GMessageWireTable *table,
+                       gconstpointer data,
+                       gsize size,
+                       GBytes *owner,
+                       GBytes *blob,
+                       GQuark *name,
+                       GVariant **payload,
+                       guint8 *sender)
+{
+  WireHeader header;
+  gchar type_buffer[64], *type = NULL;
+  GBytes *bytes = NULL;
+  gboolean ret = FALSE;
+  gsize offset;
+
+  if (size < sizeof (WireHeader))
+    return FALSE;
+  memcpy (&header, data, sizeof (WireHeader));
+
+  if (header.version != G_MESSAGE_WIRE_VERSION ||
+      (gsize) header.name_length + header.type_length > size - sizeof (WireHeader))
+    return FALSE;
+
+  /* New topics come in order */
+  if (header.name_length > 0 ? header.topic != table->names->len : header.topic >= table->names->len)
+    return FALSE;
+
+  if (header.type_length > 0)
+    {
+      /* Type strings are short, and parsed for every message */
+      type = header.type_length <= sizeof (type_buffer) ? type_buffer : g_malloc (header.type_length);
+      memcpy (type, (const guint8 *) data + sizeof (WireHeader) + header.name_length, header.type_length);
+      if (type[header.type_length - 1] != '\0' || !g_variant_type_string_is_valid (type))
+        goto out;
+
+      offset = wire_payload_offset (header.name_length, header.type_length);
+      if (blob != NULL)
+        bytes = g_bytes_ref (blob);
+      else if (offset > size)
+        goto out;
+      else if (owner != NULL)
+        bytes = g_bytes_new_from_bytes (owner,
+                                        (const guint8 *) data + offset - (const guint8 *) g_bytes_get_data (owner, NULL),
+                                        size - offset);
+      else
+        bytes = g_bytes_new ((const guint8 *) data + offset, size - offset);
+    }
+  else if (blob != NULL)
+    goto out;
+
+  if (header.name_length > 0)
+    {
+      gchar *string = g_memdup2 ((const guint8 *) data + sizeof (WireHeader), header.name_length);
+      GQuark quark = 0;
+
+      if (string[header.name_length - 1] == '\0')
+        quark = g_quark_from_string (string);
+      g_free (string);
+      if (quark == 0)
+        goto out;
+
+      g_array_append_val (table->names, quark);
+    }
+  *name = g_array_index (table->names, GQuark, header.topic);
+
+  /* Not trusted, as the payload comes from another process */
+  *payload = NULL;
+  if (bytes != NULL)
+    *payload = g_variant_new_from_bytes (G_VARIANT_TYPE (type), bytes, FALSE);
+  memcpy (sender, header.sender, G_MESSAGE_WIRE_UUID_SIZE);
+  ret = TRUE;
+
+ out:
+  if (bytes != NULL)
+    g_bytes_unref (bytes);
+  if (type != type_buffer)
+    g_free (type);
+
+  return ret;
+}
+
+/**
+ * g_message_wire_uuid_generate:
+ * @uuid: where to write the %G_MESSAGE_WIRE_UUID_SIZE bytes of the UUID
+ *
+ * Generates a random, version 4, UUID.
+ */
+void
+g_message_wire_uuid_generate (guint8 *uuid)
+{
+  guint i;
+
+  for (i = 0; i < G_MESSAGE_WIRE_UUID_SIZE; i += 4)
+    {
+      guint32 random = g_random_int ();
+
+      memcpy (uuid + i, &random, 4);
+    }
+  uuid[6] = (uuid[6] & 0x0f) | 0x40;
+  uuid[8] = (uuid[8] & 0x3f) | 0x80;
+}
+
+/**
+ * g_message_wire_uuid_to_string:
+ * @uuid: the %G_MESSAGE_WIRE_UUID_SIZE bytes of a UUID
+ *
+ * Formats @uuid the usual way.
+ *
+ * Returns: a newly allocated string
+ */
+gchar *
+g_message_wire_uuid_to_string (const guint8 *uuid)
+{
+  return g_strdup_printf ("%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+                          uuid[0], uuid[1], uuid[2], uuid[3], uuid[4], uuid[5], uuid[6], uuid[7],
+                          uuid[8], uuid[9], uuid[10], uuid[11], uuid[12], uuid[13], uuid[14], uuid[15]);
+}
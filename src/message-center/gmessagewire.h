@@ -0,0 +1,64 @@
+/* GPattern - GLib software patterns implementation library
+ *
+ * Copyright (C) 2014 Rodrigo Moya
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Author: Rodrigo Moya <rodrigo@gnome.org>
+ */
+
+#ifndef __G_MESSAGE_WIRE_H__
+#define __G_MESSAGE_WIRE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Private to the message center implementation, not installed */
+
+#define G_MESSAGE_WIRE_VERSION   1
+#define G_MESSAGE_WIRE_UUID_SIZE 16
+
+typedef struct _GMessageWireTable GMessageWireTable;
+
+GMessageWireTable *g_message_wire_table_new      (void);
+void               g_message_wire_table_free     (GMessageWireTable *table);
+
+gsize              g_message_wire_get_size       (GMessageWireTable *table,
+                                                  GQuark name,
+                                                  GVariant *payload,
+                                                  gboolean with_payload);
+void               g_message_wire_encode         (GMessageWireTable *table,
+                                                  const guint8 *sender,
+                                                  GQuark name,
+                                                  GVariant *payload,
+                                                  gboolean with_payload,
+                                                  gpointer buffer);
+gboolean           g_message_wire_decode         (GMessageWireTable *table,
+                                                  gconstpointer data,
+                                                  gsize size,
+                                                  GBytes *owner,
+                                                  GBytes *blob,
+                                                  GQuark *name,
+                                                  GVariant **payload,
+                                                  guint8 *sender);
+
+void               g_message_wire_uuid_generate  (guint8 *uuid);
+gchar             *g_message_wire_uuid_to_string (const guint8 *uuid);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,523 @@
+/* GPattern - GLib software patterns implementation library
+ *
+ * Copyright (C) 2014 Rodrigo Moya
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Author: Rodrigo Moya <rodrigo@gnome.org>
+ */
+
+#include "gtimerwheel.h"
+
+/*
+ * GTimerWheel runs callbacks after a delay, in milliseconds, from a single
+ * GSource, however many of them are pending.
+ *
+ * Timers are kept in a hierarchical timing wheel: 4 levels of 64 slots,
+ * each slot of a level spanning a whole turn of the level below, so with a
+ * tick of 1ms the wheel covers about 4.6 hours. Timers further away go to
+ * an overflow list, which is looked at again every time the wheel turns
+ * completely. A timer is put in the lowest level whose span covers it, and
+ * is moved down a level when the slot it is in is reached, so adding and
+ * removing a timer are O(1), and only timers about to expire are looked at.
+ *
+ * The GSource is only woken up when the next non-empty slot is reached,
+ * which is found with a bitmap of the non-empty slots of every level.
+ *
+ * The wheel is reference counted internally, the source holding a
+ * reference while it dispatches, so that a timer whose callback or destroy
+ * notify leads to g_timer_wheel_free() doesn't pull the wheel from under
+ * the dispatch.
+ */
+
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+/* Ticks covered by a slot at @level */
+#define LEVEL_SPAN(level) (G_GUINT64_CONSTANT (1) << ((level) * WHEEL_BITS))
+#define LEVEL_INDEX(tick, level) (((tick) >> ((level) * WHEEL_BITS)) & WHEEL_MASK)
+
+typedef struct
+{
+  /* link.data points back to the timer, so that it can be unlinked from
+   * whatever list it is in without looking for it */
+  GList link;
+  GQueue *queue;
+  /* level * WHEEL_SIZE + index if queue is a slot of the wheel, or -1 */
+  gint slot;
+  guint id;
+  guint64 expires;
+  GTimerWheelFunc func;
+  gpointer user_data;
+  GDestroyNotify destroy_notify;
+} Timer;
+
+typedef struct
+{
+  GSource source;
+  GTimerWheel *wheel;
+} TimerWheelSource;
+
+struct _GTimerWheel
+{
+  gint ref_count;
+  GMutex lock;
+  GSource *source;
+  gint64 start_time;
+
+  /* Next tick to process */
+  guint64 next_tick;
+  GQueue slots[WHEEL_LEVELS][WHEEL_SIZE];
+  guint64 occupied[WHEEL_LEVELS];
+  GQueue overflow;
+  /* Timers due, waiting to be run by the source */
+  GQueue expired;
+
+  GHashTable *timers;
+  guint next_id;
+};
+
+static void
+timer_free (Timer *timer)
+{
+  if (timer->destroy_notify != NULL)
+    {
+      timer->destroy_notify (timer->user_data);
+    }
+  g_free (timer);
+}
+
+static void
+g_timer_wheel_unlink (GTimerWheel *wheel, Timer *timer)
+{
+  GQueue *queue = timer->queue;
+
+  g_queue_unlink (queue, &timer->link);
+  timer->queue = NULL;
+
+  if (timer->slot >= 0 && g_queue_is_empty (queue))
+    {
+      wheel->occupied[timer->slot / WHEEL_SIZE] &= ~(G_GUINT64_CONSTANT (1) << (timer->slot % WHEEL_SIZE));
+    }
+  timer->slot = -1;
+}
+
+static void
+g_timer_wheel_insert (GTimerWheel *wheel, Timer *timer)
+{
+  guint64 expires;
+  guint level;
+
+  /* Timers already due go in the slot processed next */
+  expires = MAX (timer->expires, wheel->next_tick);
+
+  for (level = 0; level < WHEEL_LEVELS; level++)
+    {
+      if (expires - wheel->next_tick < LEVEL_SPAN (level + 1))
+        {
+          guint index = LEVEL_INDEX (expires, level);
+
+          timer->queue = &wheel->slots[level][index];
+          timer->slot = level * WHEEL_SIZE + index;
+          wheel->occupied[level] |= G_GUINT64_CONSTANT (1) << index;
+          g_queue_push_tail_link (timer->queue, &timer->link);
+          return;
+        }
+    }
+
+  timer->queue = &wheel->overflow;
+  g_queue_push_tail_link (timer->queue, &timer->link);
+}
+
+/* Moves all timers in @queue to where they belong now */
+static void
+g_timer_wheel_cascade (GTimerWheel *wheel, GQueue *queue)
+{
+  GQueue timers = G_QUEUE_INIT;
+  GList *link;
+
+  while ((link = queue->head) != NULL)
+    {
+      Timer *timer = link->data;
+
+      g_timer_wheel_unlink (wheel, timer);
+      g_queue_push_tail_link (&timers, link);
+    }
+
+  while ((link = g_queue_pop_head_link (&timers)) != NULL)
+    {
+      g_timer_wheel_insert (wheel, link->data);
+    }
+}
+
+/* Moves all timers due at @now_tick to the expired list */
+static void
+g_timer_wheel_process (GTimerWheel *wheel, guint64 now_tick)
+{
+  guint level;
+
+  for (level = 0; level < WHEEL_LEVELS; level++)
+    {
+      if (wheel->occupied[level] != 0)
+        break;
+    }
+  if (level == WHEEL_LEVELS && g_queue_is_empty (&wheel->overflow))
+    {
+      wheel->next_tick = MAX (wheel->next_tick, now_tick + 1);
+      return;
+    }
+
+  while (wheel->next_tick <= now_tick)
+    {
+      guint index = LEVEL_INDEX (wheel->next_tick, 0);
+      GList *link;
+
+      if (index == 0)
+        {
+          for (level = 1; level < WHEEL_LEVELS; level++)
+            {
+              guint level_index = LEVEL_INDEX (wheel->next_tick, level);
+
+              g_timer_wheel_cascade (wheel, &wheel->slots[level][level_index]);
+              if (level_index != 0)
+                break;
+            }
+          if (level == WHEEL_LEVELS)
+            {
+              g_timer_wheel_cascade (wheel, &wheel->overflow);
+            }
+        }
+      else if (wheel->occupied[0] == 0)
+        {
+          /* Nothing can expire before the next turn of the first level */
+          wheel->next_tick = MIN ((wheel->next_tick | WHEEL_MASK) + 1, now_tick + 1);
+          continue;
+        }
+
+      while ((link = wheel->slots[0][index].head) != NULL)
+        {
+          Timer *timer = link->data;
+
+          g_timer_wheel_unlink (wheel, timer);
+          timer->queue = &wheel->expired;
+          g_queue_push_tail_link (&wheel->expired, link);
+        }
+
+      wheel->next_tick++;
+    }
+}
+
+/* Returns the offset of the first bit set in @bitmap, starting at @start
+ * and wrapping around, or -1 if none is set */
+static gint
+find_next_occupied (guint64 bitmap, guint start)
+{
+  guint64 rotated;
+  guint32 low;
+  gint bit;
+
+  if (bitmap == 0)
+    return -1;
+
+  rotated = start == 0 ? bitmap : (bitmap >> start) | (bitmap << (WHEEL_SIZE - start));
+  low = rotated & G_MAXUINT32;
+  if (low != 0)
+    {
+      bit = g_bit_nth_lsf (low, -1);
+    }
+  else
+    {
+      bit = 32 + g_bit_nth_lsf ((guint32) (rotated >> 32), -1);
+    }
+
+  return bit;
+}
+
+/* Returns the tick at which the source needs to be woken up next, or
+ * G_MAXUINT64 if there are no timers */
+static guint64
+g_timer_wheel_get_next_deadline (GTimerWheel *wheel)
+{
+  guint64 deadline = G_MAXUINT64;
+  guint level;
+
+  if (!g_queue_is_empty (&wheel->expired))
+    return 0;
+
+  /* A slot in a level is looked at when the level below completes a turn,
+   * so take the earliest of these turns leading to a non-empty slot */
+  for (level = 0; level < WHEEL_LEVELS; level++)
+    {
+      guint64 span = LEVEL_SPAN (level);
+      guint64 boundary = (wheel->next_tick + span - 1) & ~(span - 1);
+      gint offset;
+
+      offset = find_next_occupied (wheel->occupied[level], LEVEL_INDEX (boundary, level));
+      if (offset >= 0)
+        {
+          deadline = MIN (deadline, boundary + offset * span);
+        }
+    }
+
+  if (!g_queue_is_empty (&wheel->overflow))
+    {
+      guint64 span = LEVEL_SPAN (WHEEL_LEVELS);
+
+      deadline = MIN (deadline, (wheel->next_tick + span - 1) & ~(span - 1));
+    }
+
+  return deadline;
+}
+
+/* Must be called with the lock held */
+static void
+g_timer_wheel_update_ready_time (GTimerWheel *wheel)
+{
+  guint64 deadline = g_timer_wheel_get_next_deadline (wheel);
+  gint64 ready_time;
+
+  if (deadline == G_MAXUINT64)
+    {
+      ready_time = -1;
+    }
+  else
+    {
+      ready_time = wheel->start_time + (gint64) deadline * 1000;
+    }
+
+  if (g_source_get_ready_time (wheel->source) != ready_time)
+    {
+      g_source_set_ready_time (wheel->source, ready_time);
+    }
+}
+
+static GTimerWheel *
+g_timer_wheel_ref (GTimerWheel *wheel)
+{
+  g_atomic_int_inc (&wheel->ref_count);
+
+  return wheel;
+}
+
+static void
+g_timer_wheel_unref (GTimerWheel *wheel)
+{
+  if (!g_atomic_int_dec_and_test (&wheel->ref_count))
+    return;
+
+  g_source_unref (wheel->source);
+  g_hash_table_destroy (wheel->timers);
+  g_mutex_clear (&wheel->lock);
+  g_free (wheel);
+}
+
+static gboolean
+timer_wheel_source_dispatch (GSource *source, GSourceFunc callback, gpointer user_data)
+{
+  GTimerWheel *wheel = g_timer_wheel_ref (((TimerWheelSource *) source)->wheel);
+  gint64 now = g_source_get_time (source);
+  GList *link;
+
+  g_mutex_lock (&wheel->lock);
+
+  if (now >= wheel->start_time)
+    {
+      g_timer_wheel_process (wheel, (now - wheel->start_time) / 1000);
+    }
+
+  /* Timers can be cancelled or added by the callbacks, so pick them one
+   * by one. The wheel might be freed by them, which empties the expired
+   * list */
+  while ((link = g_queue_pop_head_link (&wheel->expired)) != NULL)
+    {
+      Timer *timer = link->data;
+
+      timer->queue = NULL;
+      g_hash_table_remove (wheel->timers, GUINT_TO_POINTER (timer->id));
+      g_mutex_unlock (&wheel->lock);
+
+      timer->func (timer->user_data);
+      timer_free (timer);
+
+      g_mutex_lock (&wheel->lock);
+    }
+
+  if (!g_source_is_destroyed (source))
+    g_timer_wheel_update_ready_time (wheel);
+
+  g_mutex_unlock (&wheel->lock);
+  g_timer_wheel_unref (wheel);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs timer_wheel_source_funcs = {
+  NULL,
+  NULL,
+  timer_wheel_source_dispatch,
+  NULL
+};
+
+/**
+ * g_timer_wheel_new:
+ * @context: (nullable): the #GMainContext to run the timers on
+ *
+ * Returns: a new #GTimerWheel
+ */
+GTimerWheel *
+g_timer_wheel_new (GMainContext *context)
+{
+  GTimerWheel *wheel;
+  guint level, index;
+
+  wheel = g_new0 (GTimerWheel, 1);
+  wheel->ref_count = 1;
+  g_mutex_init (&wheel->lock);
+  for (level = 0; level < WHEEL_LEVELS; level++)
+    {
+      for (index = 0; index < WHEEL_SIZE; index++)
+        {
+          g_queue_init (&wheel->slots[level][index]);
+        }
+    }
+  g_queue_init (&wheel->overflow);
+  g_queue_init (&wheel->expired);
+  wheel->timers = g_hash_table_new (NULL, NULL);
+  wheel->next_id = 1;
+  wheel->start_time = g_get_monotonic_time ();
+
+  wheel->source = g_source_new (&timer_wheel_source_funcs, sizeof (TimerWheelSource));
+  ((TimerWheelSource *) wheel->source)->wheel = wheel;
+  g_source_set_name (wheel->source, "GTimerWheel");
+  g_source_attach (wheel->source, context);
+
+  return wheel;
+}
+
+/**
+ * g_timer_wheel_free:
+ * @wheel: a #GTimerWheel
+ *
+ * Frees @wheel, and all pending timers, without running them, including
+ * the ones already due. This can be called from a timer, in which case the
+ * wheel goes away once the timer returns.
+ */
+void
+g_timer_wheel_free (GTimerWheel *wheel)
+{
+  GList *timers;
+
+  g_source_destroy (wheel->source);
+
+  /* Due timers are in the table until they run */
+  g_mutex_lock (&wheel->lock);
+  timers = g_hash_table_get_values (wheel->timers);
+  g_hash_table_remove_all (wheel->timers);
+  g_queue_init (&wheel->expired);
+  g_mutex_unlock (&wheel->lock);
+
+  g_list_free_full (timers, (GDestroyNotify) timer_free);
+
+  g_timer_wheel_unref (wheel);
+}
+
+/**
+ * g_timer_wheel_add:
+ * @wheel: a #GTimerWheel
+ * @delay: the delay, in milliseconds
+ * @func: function to call once @delay is elapsed
+ * @user_data: data to pass to @func
+ * @destroy_notify: (nullable): function to free @user_data
+ *
+ * Adds a timer to @wheel. This can be called from any thread.
+ *
+ * Returns: the ID of the timer, to be used with g_timer_wheel_cancel()
+ */
+guint
+g_timer_wheel_add (GTimerWheel *wheel,
+                   guint delay,
+                   GTimerWheelFunc func,
+                   gpointer user_data,
+                   GDestroyNotify destroy_notify)
+{
+  Timer *timer;
+  gint64 now;
+  guint id;
+
+  timer = g_new0 (Timer, 1);
+  timer->link.data = timer;
+  timer->slot = -1;
+  timer->func = func;
+  timer->user_data = user_data;
+  timer->destroy_notify = destroy_notify;
+
+  /* Round up, so that timers never run early */
+  now = g_get_monotonic_time ();
+  timer->expires = (now - wheel->start_time + 999) / 1000 + delay;
+
+  g_mutex_lock (&wheel->lock);
+
+  do
+    {
+      id = wheel->next_id++;
+    }
+  while (id == 0 || g_hash_table_contains (wheel->timers, GUINT_TO_POINTER (id)));
+  timer->id = id;
+  g_hash_table_insert (wheel->timers, GUINT_TO_POINTER (id), timer);
+
+  g_timer_wheel_insert (wheel, timer);
+  g_timer_wheel_update_ready_time (wheel);
+
+  g_mutex_unlock (&wheel->lock);
+
+  return id;
+}
+
+/**
+ * g_timer_wheel_cancel:
+ * @wheel: a #GTimerWheel
+ * @id: the ID of a timer, as returned by g_timer_wheel_add()
+ *
+ * Removes a timer which didn't run yet. This can be called from any thread.
+ *
+ * Returns: %TRUE if the timer was removed, %FALSE if it already ran
+ */
+gboolean
+g_timer_wheel_cancel (GTimerWheel *wheel, guint id)
+{
+  Timer *timer;
+
+  g_mutex_lock (&wheel->lock);
+
+  timer = g_hash_table_lookup (wheel->timers, GUINT_TO_POINTER (id));
+  if (timer == NULL)
+    {
+      g_mutex_unlock (&wheel->lock);
+      return FALSE;
+    }
+
+  g_hash_table_remove (wheel->timers, GUINT_TO_POINTER (id));
+  g_timer_wheel_unlink (wheel, timer);
+
+  /* No need to update the ready time, waking up for nothing is harmless */
+  g_mutex_unlock (&wheel->lock);
+
+  timer_free (timer);
+
+  return TRUE;
+}
@@ -0,0 +1,48 @@
+/* GPattern - GLib software patterns implementation library
+ *
+ * Copyright (C) 2014 Rodrigo Moya
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Author: Rodrigo Moya <rodrigo@gnome.org>
+ */
+
+#ifndef __G_TIMER_WHEEL_H__
+#define __G_TIMER_WHEEL_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Private to the message center implementation, not installed */
+
+typedef struct _GTimerWheel GTimerWheel;
+
+typedef void (* GTimerWheelFunc) (gpointer user_data);
+
+GTimerWheel *g_timer_wheel_new     (GMainContext *context);
+void         g_timer_wheel_free    (GTimerWheel *wheel);
+
+guint        g_timer_wheel_add     (GTimerWheel *wheel,
+                                    guint delay,
+                                    GTimerWheelFunc func,
+                                    gpointer user_data,
+                                    GDestroyNotify destroy_notify);
+gboolean     g_timer_wheel_cancel  (GTimerWheel *wheel, guint id);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,793 @@
+/* GPattern - GLib software patterns implementation library
+ *
+ * Copyright (C) 2014 Rodrigo Moya
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Author: Rodrigo Moya <rodrigo@gnome.org>
+ */
+
+#include "gtopictrie.h"
+
+#include <string.h>
+
+/*
+ * GTopicTrie stores values for dotted topic patterns, like "test.message.*"
+ * or "test.#", and finds all the patterns matching a given topic.
+ *
+ * Patterns are split in segments on '.', and each segment is a level in the
+ * trie. A segment consisting of a single '*' matches exactly one segment of
+ * the topic, and a segment consisting of a single '#' matches zero or more
+ * segments. Matching a topic only walks the trie along the topic's segments,
+ * so its cost depends on the depth of the topic, not on the number of
+ * patterns stored in the trie.
+ *
+ * Consecutive '#' segments match the same as a single one, and are stored
+ * as one, so "test.#.#" and "test.#" are the same pattern. A '#' node can
+ * still be reached from several positions in the topic, through other '#'
+ * nodes above it, so matching remembers the first position each of them
+ * was visited from: visiting it from a later one would only repeat work,
+ * and emit values again. This keeps matching linear in the number of
+ * nodes times the number of topic segments.
+ */
+
+#define PREALLOC_SEGMENTS 16
+#define PREALLOC_VISITED  16
+
+typedef struct
+{
+  const gchar *str;
+  gsize len;
+} Segment;
+
+typedef struct _TrieNode TrieNode;
+
+struct _TrieNode
+{
+  GHashTable *children;
+  TrieNode *any_one;
+  TrieNode *any_many;
+  gpointer value;
+};
+
+struct _GTopicTrie
+{
+  TrieNode *root;
+  GDestroyNotify value_destroy;
+  guint n_values;
+};
+
+typedef struct
+{
+  TrieNode *node;
+  guint first;
+} Visit;
+
+typedef struct
+{
+  Segment *segments;
+  guint n_segments;
+  GTopicTrieMatchFunc func;
+  gpointer user_data;
+  /* '#' node -> first position it was visited from */
+  Visit visited[PREALLOC_VISITED];
+  guint n_visited;
+  GHashTable *visited_overflow;
+} MatchState;
+
+static guint
+segment_hash (gconstpointer v)
+{
+  const Segment *segment = v;
+  guint hash = 5381;
+  gsize i;
+
+  for (i = 0; i < segment->len; i++)
+    hash = (hash << 5) + hash + (guchar) segment->str[i];
+
+  return hash;
+}
+
+static gboolean
+segment_equal (gconstpointer a, gconstpointer b)
+{
+  const Segment *segment_a = a;
+  const Segment *segment_b = b;
+
+  return segment_a->len == segment_b->len &&
+    memcmp (segment_a->str, segment_b->str, segment_a->len) == 0;
+}
+
+static void
+segment_free (gpointer data)
+{
+  Segment *segment = data;
+
+  g_free ((gchar *) segment->str);
+  g_free (segment);
+}
+
+static gboolean
+segment_is (const Segment *segment, gchar c)
+{
+  return segment->len == 1 && segment->str[0] == c;
+}
+
+/* Splits @topic in segments pointing into @topic itself. @prealloc is used
+ * if big enough, otherwise a new array is allocated.
+ */
+static Segment *
+split_topic (const gchar *topic, Segment *prealloc, guint *n_segments)
+{
+  Segment *segments = prealloc;
+  guint allocated = PREALLOC_SEGMENTS;
+  guint n = 0;
+  const gchar *start = topic, *p;
+
+  for (p = topic; ; p++)
+    {
+      if (*p != '.' && *p != '\0')
+        continue;
+
+      if (n == allocated)
+        {
+          allocated *= 2;
+          if (segments == prealloc)
+            {
+              segments = g_new (Segment, allocated);
+              memcpy (segments, prealloc, sizeof (Segment) * n);
+            }
+          else
+            segments = g_renew (Segment, segments, allocated);
+        }
+
+      segments[n].str = start;
+      segments[n].len = p - start;
+      n++;
+
+      if (*p == '\0')
+        break;
+      start = p + 1;
+    }
+
+  *n_segments = n;
+
+  return segments;
+}
+
+/* Like split_topic(), but keeps a single '#' for consecutive ones */
+static Segment *
+split_pattern (const gchar *pattern, Segment *prealloc, guint *n_segments)
+{
+  Segment *segments = split_topic (pattern, prealloc, n_segments);
+  guint i, n = 0;
+
+  for (i = 0; i < *n_segments; i++)
+    {
+      if (n > 0 && segment_is (&segments[i], '#') && segment_is (&segments[n - 1], '#'))
+        continue;
+      segments[n++] = segments[i];
+    }
+  *n_segments = n;
+
+  return segments;
+}
+
+/**
+ * g_topic_is_pattern:
+ * @topic: a dotted topic name
+ *
+ * Returns: %TRUE if @topic contains any '*' or '#' wildcard segment.
+ */
+gboolean
+g_topic_is_pattern (const gchar *topic)
+{
+  const gchar *p;
+
+  if (topic == NULL)
+    return FALSE;
+
+  for (p = topic; *p != '\0'; p++)
+    {
+      if ((*p == '*' || *p == '#') &&
+          (p == topic || p[-1] == '.') &&
+          (p[1] == '.' || p[1] == '\0'))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+segment_matches (const Segment *pattern, const Segment *topic)
+{
+  return segment_is (pattern, '*') ||
+    (pattern->len == topic->len && memcmp (pattern->str, topic->str, topic->len) == 0);
+}
+
+/* Only the last '#' seen needs to be retried with one more segment: what
+ * comes before it already matched as early as possible, and any later way
+ * for it to match is also a way for the last '#' to match. So this takes
+ * O(n_pattern * n_topic) steps, however many '#' there are */
+static gboolean
+segments_match (const Segment *pattern, guint n_pattern, const Segment *topic, guint n_topic)
+{
+  guint p = 0, t = 0;
+  guint retry_p = G_MAXUINT, retry_t = 0;
+
+  while (t < n_topic)
+    {
+      if (p < n_pattern && segment_is (&pattern[p], '#'))
+        {
+          retry_p = p++;
+          retry_t = t;
+        }
+      else if (p < n_pattern && segment_matches (&pattern[p], &topic[t]))
+        {
+          p++;
+          t++;
+        }
+      else if (retry_p != G_MAXUINT)
+        {
+          p = retry_p + 1;
+          t = ++retry_t;
+        }
+      else
+        {
+          return FALSE;
+        }
+    }
+
+  while (p < n_pattern && segment_is (&pattern[p], '#'))
+    p++;
+
+  return p == n_pattern;
+}
+
+/**
+ * g_topic_normalize:
+ * @pattern: a dotted topic pattern
+ *
+ * Gets the form of @pattern a #GTopicTrie stores it as, with consecutive
+ * '#' segments replaced by a single one, so that patterns which are the
+ * same for the trie can be told apart from different ones.
+ *
+ * Returns: (transfer full): the normalized pattern
+ */
+gchar *
+g_topic_normalize (const gchar *pattern)
+{
+  Segment prealloc[PREALLOC_SEGMENTS];
+  Segment *segments;
+  GString *normalized;
+  guint n_segments, i;
+
+  g_return_val_if_fail (pattern != NULL, NULL);
+
+  segments = split_pattern (pattern, prealloc, &n_segments);
+  normalized = g_string_sized_new (strlen (pattern));
+  for (i = 0; i < n_segments; i++)
+    {
+      if (i > 0)
+        g_string_append_c (normalized, '.');
+      g_string_append_len (normalized, segments[i].str, segments[i].len);
+    }
+
+  if (segments != prealloc)
+    g_free (segments);
+
+  return g_string_free (normalized, FALSE);
+}
+
+/**
+ * g_topic_matches:
+ * @pattern: a dotted topic pattern
+ * @topic: a dotted topic name
+ *
+ * Checks a single topic against a single pattern, with the same rules as
+ * g_topic_trie_match().
+ *
+ * Returns: %TRUE if @topic matches @pattern
+ */
+gboolean
+g_topic_matches (const gchar *pattern, const gchar *topic)
+{
+  Segment pattern_prealloc[PREALLOC_SEGMENTS], topic_prealloc[PREALLOC_SEGMENTS];
+  Segment *pattern_segments, *topic_segments;
+  guint n_pattern, n_topic;
+  gboolean matches;
+
+  pattern_segments = split_pattern (pattern, pattern_prealloc, &n_pattern);
+  topic_segments = split_topic (topic, topic_prealloc, &n_topic);
+
+  matches = segments_match (pattern_segments, n_pattern, topic_segments, n_topic);
+
+  if (pattern_segments != pattern_prealloc)
+    g_free (pattern_segments);
+  if (topic_segments != topic_prealloc)
+    g_free (topic_segments);
+
+  return matches;
+}
+
+static TrieNode *
+trie_node_new (void)
+{
+  return g_new0 (TrieNode, 1);
+}
+
+static void
+trie_node_free (GTopicTrie *trie, TrieNode *node)
+{
+  if (node == NULL)
+    return;
+
+  if (node->children != NULL)
+    {
+      GHashTableIter iter;
+      gpointer child;
+
+      g_hash_table_iter_init (&iter, node->children);
+      while (g_hash_table_iter_next (&iter, NULL, &child))
+        trie_node_free (trie, child);
+
+      g_hash_table_destroy (node->children);
+    }
+
+  trie_node_free (trie, node->any_one);
+  trie_node_free (trie, node->any_many);
+
+  if (node->value != NULL && trie->value_destroy != NULL)
+    trie->value_destroy (node->value);
+
+  g_free (node);
+}
+
+static gboolean
+trie_node_is_empty (TrieNode *node)
+{
+  return node->value == NULL &&
+    node->any_one == NULL &&
+    node->any_many == NULL &&
+    (node->children == NULL || g_hash_table_size (node->children) == 0);
+}
+
+static TrieNode *
+trie_node_get_child (TrieNode *node, const Segment *segment)
+{
+  if (segment_is (segment, '*'))
+    return node->any_one;
+  if (segment_is (segment, '#'))
+    return node->any_many;
+  if (node->children == NULL)
+    return NULL;
+
+  return g_hash_table_lookup (node->children, segment);
+}
+
+static TrieNode *
+trie_node_ensure_child (GTopicTrie *trie, TrieNode *node, const Segment *segment)
+{
+  TrieNode *child = trie_node_get_child (node, segment);
+  Segment *key;
+
+  if (child != NULL)
+    return child;
+
+  child = trie_node_new ();
+
+  if (segment_is (segment, '*'))
+    {
+      node->any_one = child;
+    }
+  else if (segment_is (segment, '#'))
+    {
+      node->any_many = child;
+    }
+  else
+    {
+      if (node->children == NULL)
+        node->children = g_hash_table_new_full (segment_hash, segment_equal, segment_free, NULL);
+
+      key = g_new (Segment, 1);
+      key->str = g_strndup (segment->str, segment->len);
+      key->len = segment->len;
+      g_hash_table_insert (node->children, key, child);
+    }
+
+  return child;
+}
+
+/**
+ * g_topic_trie_new:
+ * @value_destroy: (nullable): function to free the values stored in the trie
+ *
+ * Returns: a new, empty #GTopicTrie
+ */
+GTopicTrie *
+g_topic_trie_new (GDestroyNotify value_destroy)
+{
+  GTopicTrie *trie = g_new0 (GTopicTrie, 1);
+
+  trie->root = trie_node_new ();
+  trie->value_destroy = value_destroy;
+
+  return trie;
+}
+
+static TrieNode *
+trie_node_copy (TrieNode *node, GCopyFunc value_copy, gpointer user_data)
+{
+  TrieNode *copy;
+
+  if (node == NULL)
+    return NULL;
+
+  copy = trie_node_new ();
+
+  if (node->children != NULL)
+    {
+      GHashTableIter iter;
+      gpointer key, child;
+
+      copy->children = g_hash_table_new_full (segment_hash, segment_equal, segment_free, NULL);
+
+      g_hash_table_iter_init (&iter, node->children);
+      while (g_hash_table_iter_next (&iter, &key, &child))
+        {
+          Segment *segment = key;
+          Segment *segment_copy = g_new (Segment, 1);
+
+          segment_copy->str = g_strndup (segment->str, segment->len);
+          segment_copy->len = segment->len;
+          g_hash_table_insert (copy->children, segment_copy, trie_node_copy (child, value_copy, user_data));
+        }
+    }
+
+  copy->any_one = trie_node_copy (node->any_one, value_copy, user_data);
+  copy->any_many = trie_node_copy (node->any_many, value_copy, user_data);
+
+  if (node->value != NULL)
+    copy->value = value_copy != NULL ? value_copy (node->value, user_data) : node->value;
+
+  return copy;
+}
+
+/**
+ * g_topic_trie_copy:
+ * @trie: a #GTopicTrie
+ * @value_copy: (nullable): function to copy the values stored in the trie
+ * @user_data: data to pass to @value_copy
+ *
+ * Makes a copy of @trie, which uses the same function to free its values.
+ * If @value_copy is %NULL, values are shared between both tries.
+ *
+ * Returns: a new #GTopicTrie
+ */
+GTopicTrie *
+g_topic_trie_copy (GTopicTrie *trie, GCopyFunc value_copy, gpointer user_data)
+{
+  GTopicTrie *copy;
+
+  g_return_val_if_fail (trie != NULL, NULL);
+
+  copy = g_new0 (GTopicTrie, 1);
+  copy->root = trie_node_copy (trie->root, value_copy, user_data);
+  copy->value_destroy = trie->value_destroy;
+  copy->n_values = trie->n_values;
+
+  return copy;
+}
+
+/**
+ * g_topic_trie_free:
+ * @trie: a #GTopicTrie
+ *
+ * Frees @trie and all the values stored in it.
+ */
+void
+g_topic_trie_free (GTopicTrie *trie)
+{
+  g_return_if_fail (trie != NULL);
+
+  trie_node_free (trie, trie->root);
+  g_free (trie);
+}
+
+/**
+ * g_topic_trie_is_empty:
+ * @trie: a #GTopicTrie
+ *
+ * Returns: %TRUE if no values are stored in @trie
+ */
+gboolean
+g_topic_trie_is_empty (GTopicTrie *trie)
+{
+  g_return_val_if_fail (trie != NULL, TRUE);
+
+  return trie->n_values == 0;
+}
+
+/**
+ * g_topic_trie_lookup:
+ * @trie: a #GTopicTrie
+ * @pattern: a topic pattern
+ *
+ * Looks up the value stored for exactly @pattern, without doing any
+ * wildcard matching.
+ *
+ * Returns: the value stored for @pattern, or %NULL
+ */
+gpointer
+g_topic_trie_lookup (GTopicTrie *trie, const gchar *pattern)
+{
+  Segment prealloc[PREALLOC_SEGMENTS];
+  Segment *segments;
+  TrieNode *node;
+  guint n_segments, i;
+
+  g_return_val_if_fail (trie != NULL, NULL);
+  g_return_val_if_fail (pattern != NULL, NULL);
+
+  segments = split_pattern (pattern, prealloc, &n_segments);
+
+  node = trie->root;
+  for (i = 0; i < n_segments && node != NULL; i++)
+    node = trie_node_get_child (node, &segments[i]);
+
+  if (segments != prealloc)
+    g_free (segments);
+
+  return node != NULL ? node->value : NULL;
+}
+
+/**
+ * g_topic_trie_insert:
+ * @trie: a #GTopicTrie
+ * @pattern: a topic pattern
+ * @value: the value to store for @pattern
+ *
+ * Stores @value for @pattern, replacing (and freeing) any previous value.
+ */
+void
+g_topic_trie_insert (GTopicTrie *trie, const gchar *pattern, gpointer value)
+{
+  Segment prealloc[PREALLOC_SEGMENTS];
+  Segment *segments;
+  TrieNode *node;
+  guint n_segments, i;
+
+  g_return_if_fail (trie != NULL);
+  g_return_if_fail (pattern != NULL);
+  g_return_if_fail (value != NULL);
+
+  segments = split_pattern (pattern, prealloc, &n_segments);
+
+  node = trie->root;
+  for (i = 0; i < n_segments; i++)
+    node = trie_node_ensure_child (trie, node, &segments[i]);
+
+  if (segments != prealloc)
+    g_free (segments);
+
+  if (node->value == NULL)
+    trie->n_values++;
+  else if (node->value != value && trie->value_destroy != NULL)
+    trie->value_destroy (node->value);
+
+  node->value = value;
+}
+
+static gboolean
+trie_node_remove (GTopicTrie *trie, TrieNode *node, Segment *segments, guint n_segments)
+{
+  TrieNode *child;
+  gboolean removed;
+
+  if (n_segments == 0)
+    {
+      if (node->value == NULL)
+        return FALSE;
+
+      if (trie->value_destroy != NULL)
+        trie->value_destroy (node->value);
+      node->value = NULL;
+      trie->n_values--;
+
+      return TRUE;
+    }
+
+  child = trie_node_get_child (node, &segments[0]);
+  if (child == NULL)
+    return FALSE;
+
+  removed = trie_node_remove (trie, child, segments + 1, n_segments - 1);
+
+  /* Prune the branch if it does not hold anything anymore */
+  if (removed && trie_node_is_empty (child))
+    {
+      if (child == node->any_one)
+        {
+          node->any_one = NULL;
+        }
+      else if (child == node->any_many)
+        {
+          node->any_many = NULL;
+        }
+      else
+        {
+          g_hash_table_remove (node->children, &segments[0]);
+        }
+
+      trie_node_free (trie, child);
+    }
+
+  return removed;
+}
+
+/**
+ * g_topic_trie_remove:
+ * @trie: a #GTopicTrie
+ * @pattern: a topic pattern
+ *
+ * Removes (and frees) the value stored for exactly @pattern.
+ *
+ * Returns: %TRUE if there was a value stored for @pattern
+ */
+gboolean
+g_topic_trie_remove (GTopicTrie *trie, const gchar *pattern)
+{
+  Segment prealloc[PREALLOC_SEGMENTS];
+  Segment *segments;
+  guint n_segments;
+  gboolean removed;
+
+  g_return_val_if_fail (trie != NULL, FALSE);
+  g_return_val_if_fail (pattern != NULL, FALSE);
+
+  segments = split_pattern (pattern, prealloc, &n_segments);
+  removed = trie_node_remove (trie, trie->root, segments, n_segments);
+
+  if (segments != prealloc)
+    g_free (segments);
+
+  return removed;
+}
+
+/* Records that the '#' @node is visited from position @i, and returns the
+ * first position it was visited from before, or G_MAXUINT */
+static guint
+match_visit (MatchState *state, TrieNode *node, guint i)
+{
+  gpointer first;
+  guint k;
+
+  for (k = 0; k < state->n_visited; k++)
+    {
+      if (state->visited[k].node == node)
+        {
+          guint previous = state->visited[k].first;
+
+          state->visited[k].first = MIN (previous, i);
+          return previous;
+        }
+    }
+
+  if (state->visited_overflow != NULL &&
+      g_hash_table_lookup_extended (state->visited_overflow, node, NULL, &first))
+    {
+      if (i < GPOINTER_TO_UINT (first))
+        g_hash_table_insert (state->visited_overflow, node, GUINT_TO_POINTER (i));
+      return GPOINTER_TO_UINT (first);
+    }
+
+  if (state->n_visited < PREALLOC_VISITED)
+    {
+      state->visited[state->n_visited].node = node;
+      state->visited[state->n_visited].first = i;
+      state->n_visited++;
+    }
+  else
+    {
+      if (state->visited_overflow == NULL)
+        state->visited_overflow = g_hash_table_new (NULL, NULL);
+      g_hash_table_insert (state->visited_overflow, node, GUINT_TO_POINTER (i));
+    }
+
+  return G_MAXUINT;
+}
+
+static void match_node (MatchState *state, TrieNode *node, guint i);
+
+/* '#' matches from zero to all of the remaining segments. Positions from
+ * the first one it was visited from on were all tried already */
+static void
+match_any_many (MatchState *state, TrieNode *node, guint i)
+{
+  guint end = MIN (match_visit (state, node, i), state->n_segments + 1);
+  guint j;
+
+  for (j = i; j < end; j++)
+    match_node (state, node, j);
+}
+
+static void
+match_node (MatchState *state, TrieNode *node, guint i)
+{
+  if (i == state->n_segments)
+    {
+      if (node->value != NULL)
+        state->func (node->value, state->user_data);
+
+      /* '#' also matches zero segments */
+      if (node->any_many != NULL)
+        match_any_many (state, node->any_many, i);
+
+      return;
+    }
+
+  if (node->children != NULL)
+    {
+      TrieNode *child = g_hash_table_lookup (node->children, &state->segments[i]);
+      if (child != NULL)
+        match_node (state, child, i + 1);
+    }
+
+  if (node->any_one != NULL)
+    match_node (state, node->any_one, i + 1);
+
+  if (node->any_many != NULL)
+    match_any_many (state, node->any_many, i);
+}
+
+/**
+ * g_topic_trie_match:
+ * @trie: a #GTopicTrie
+ * @topic: a topic name, without wildcards
+ * @func: function to call for every value whose pattern matches @topic
+ * @user_data: data to pass to @func
+ *
+ * Calls @func once for every pattern stored in @trie that matches @topic.
+ */
+void
+g_topic_trie_match (GTopicTrie *trie,
+                    const gchar *topic,
+                    GTopicTrieMatchFunc func,
+                    gpointer user_data)
+{
+  Segment prealloc[PREALLOC_SEGMENTS];
+  MatchState state;
+
+  g_return_if_fail (trie != NULL);
+  g_return_if_fail (topic != NULL);
+  g_return_if_fail (func != NULL);
+
+  if (trie->n_values == 0)
+    return;
+
+  state.segments = split_topic (topic, prealloc, &state.n_segments);
+  state.func = func;
+  state.user_data = user_data;
+  state.n_visited = 0;
+  state.visited_overflow = NULL;
+
+  match_node (&state, trie->root, 0);
+
+  if (state.visited_overflow != NULL)
+    g_hash_table_destroy (state.visited_overflow);
+  if (state.segments != prealloc)
+    g_free (state.segments);
+}
@@ -0,0 +1,55 @@
+/* GPattern - GLib software patterns implementation library
+ *
+ * Copyright (C) 2014 Rodrigo Moya
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Author: Rodrigo Moya <rodrigo@gnome.org>
+ */
+
+#ifndef __G_TOPIC_TRIE_H__
+#define __G_TOPIC_TRIE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Private to the message center implementation, not installed */
+
+typedef struct _GTopicTrie GTopicTrie;
+
+typedef void (* GTopicTrieMatchFunc) (gpointer value, gpointer user_data);
+
+gboolean    g_topic_is_pattern     (const gchar *topic);
+gboolean    g_topic_matches        (const gchar *pattern, const gchar *topic);
+gchar      *g_topic_normalize      (const gchar *pattern);
+
+GTopicTrie *g_topic_trie_new       (GDestroyNotify value_destroy);
+GTopicTrie *g_topic_trie_copy      (GTopicTrie *trie, GCopyFunc value_copy, gpointer user_data);
+void        g_topic_trie_free      (GTopicTrie *trie);
+gboolean    g_topic_trie_is_empty  (GTopicTrie *trie);
+
+gpointer    g_topic_trie_lookup    (GTopicTrie *trie, const gchar *pattern);
+void        g_topic_trie_insert    (GTopicTrie *trie, const gchar *pattern, gpointer value);
+gboolean    g_topic_trie_remove    (GTopicTrie *trie, const gchar *pattern);
+void        g_topic_trie_match     (GTopicTrie *trie,
+                                    const gchar *topic,
+                                    GTopicTrieMatchFunc func,
+                                    gpointer user_data);
+
+G_END_DECLS
+
+#endif
@@ -1,6 +1,12 @@
-#include "gmessagecenter.h"
+#include <string.h>
+#include <unistd.h>
+
+#include "gdistributedmessagecenter.h"
+#include "gmessagering.h"
+#include "gtopictrie.h"
 
 GMainLoop *main_loop;
+static GThread *main_thread;
 
 static void
 filter_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
@@ -31,8 +37,8 @@ monitor_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
   g_print ("Got message %s\n", g_message_get_name (msg));
 }
 
-int
-main (int argc, char *argv[])
+static void
+test_send_with_delay (void)
 {
   GMessageCenter *msg_center = g_message_center_get ();
   g_signal_connect (G_OBJECT (msg_center), "message-received", G_CALLBACK (monitor_cb), NULL);
@@ -41,6 +47,1844 @@ main (int argc, char *argv[])
   main_loop = g_main_loop_new (NULL, TRUE);
   g_timeout_add (1000, timeout_cb, msg_center);
   g_main_loop_run (main_loop);
+}
+
+static void
+append_tag_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  g_string_append (g_object_get_data (G_OBJECT (msg_center), "tags"), user_data);
+}
+
+static void
+test_filter_index (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  GObject *sender = g_object_new (G_TYPE_OBJECT, NULL);
+  GObject *other_sender = g_object_new (G_TYPE_OBJECT, NULL);
+  GString *tags = g_string_new (NULL);
+  gint i;
+
+  g_object_set_data (G_OBJECT (msg_center), "tags", tags);
+
+  /* Lots of unrelated filters that must never be called */
+  for (i = 0; i < 1000; i++)
+    {
+      gchar *name = g_strdup_printf ("test.unrelated.%d", i);
+      g_message_center_filter (msg_center, NULL, name, append_tag_cb, "x");
+      g_message_center_filter (msg_center, other_sender, name, append_tag_cb, "x");
+      g_free (name);
+    }
+
+  g_message_center_filter (msg_center, sender, NULL, append_tag_cb, "a");
+  g_message_center_filter (msg_center, NULL, "test.index", append_tag_cb, "b");
+  g_message_center_filter (msg_center, other_sender, "test.index", append_tag_cb, "x");
+  g_message_center_filter (msg_center, sender, "test.index", append_tag_cb, "c");
+  g_message_center_filter (msg_center, NULL, "test.index", append_tag_cb, "d");
+
+  g_message_center_send_full (msg_center, sender, "test.index", NULL);
+  g_assert_cmpstr (tags->str, ==, "abcd");
+
+  g_string_truncate (tags, 0);
+  g_message_center_send_full (msg_center, sender, "test.never.registered", NULL);
+  g_assert_cmpstr (tags->str, ==, "a");
+
+  g_string_free (tags, TRUE);
+  g_object_unref (msg_center);
+  g_object_unref (other_sender);
+  g_object_unref (sender);
+}
+
+static void
+test_quark_names (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  GString *tags = g_string_new (NULL);
+  GMessage *msg;
+
+  g_object_set_data (G_OBJECT (msg_center), "tags", tags);
+  g_message_center_filter (msg_center, NULL, "test.quark", append_tag_cb, "q");
+
+  msg = g_message_new_static (G_OBJECT (msg_center), "test.quark", NULL);
+  g_assert_cmpuint (g_message_get_name_quark (msg), ==, g_quark_try_string ("test.quark"));
+  g_message_center_send (msg_center, msg);
+  g_object_unref (msg);
+
+  msg = g_message_new_quark (G_OBJECT (msg_center), g_quark_from_static_string ("test.quark"), NULL);
+  g_assert_cmpstr (g_message_get_name (msg), ==, "test.quark");
+  g_message_center_send (msg_center, msg);
+  g_object_unref (msg);
+
+  g_assert_cmpstr (tags->str, ==, "qq");
+
+  g_string_free (tags, TRUE);
+  g_object_unref (msg_center);
+}
+
+static void
+test_wildcards (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  GObject *sender = g_object_new (G_TYPE_OBJECT, NULL);
+  GString *tags = g_string_new (NULL);
+
+  g_object_set_data (G_OBJECT (msg_center), "tags", tags);
+  g_message_center_filter (msg_center, NULL, "test.message.*", append_tag_cb, "a");
+  g_message_center_filter (msg_center, NULL, "test.#", append_tag_cb, "b");
+  g_message_center_filter (msg_center, NULL, "test.message.count", append_tag_cb, "c");
+  g_message_center_filter (msg_center, NULL, "#.count", append_tag_cb, "d");
+  g_message_center_filter (msg_center, NULL, "*.*.*.*", append_tag_cb, "e");
+  g_message_center_filter (msg_center, sender, "test.*.count", append_tag_cb, "f");
+  g_message_center_filter (msg_center, NULL, "#.#", append_tag_cb, "g");
+
+  g_message_center_send_full (msg_center, G_OBJECT (msg_center), "test.message.count", NULL);
+  g_assert_cmpstr (tags->str, ==, "abcdg");
+
+  g_string_truncate (tags, 0);
+  g_message_center_send_full (msg_center, sender, "test.message.count", NULL);
+  g_assert_cmpstr (tags->str, ==, "abcdfg");
+
+  g_string_truncate (tags, 0);
+  g_message_center_send_full (msg_center, sender, "test", NULL);
+  g_assert_cmpstr (tags->str, ==, "bg");
+
+  g_string_truncate (tags, 0);
+  g_message_center_send_full (msg_center, sender, "other.message.x.count", NULL);
+  g_assert_cmpstr (tags->str, ==, "deg");
+
+  g_string_free (tags, TRUE);
+  g_object_unref (msg_center);
+  g_object_unref (sender);
+}
+
+static void
+test_wildcards_deep (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  GString *tags = g_string_new (NULL);
+  GString *topic = g_string_new ("a");
+  gint i;
+
+  /* trying every split of the topic between the '#' would take forever */
+  for (i = 1; i < 200; i++)
+    g_string_append (topic, ".a");
+
+  g_object_set_data (G_OBJECT (msg_center), "tags", tags);
+  g_message_center_filter (msg_center, NULL, "#.#.#.#.#.#.#.#", append_tag_cb, "a");
+  g_message_center_filter (msg_center, NULL, "#.a.#.a.#.a.#.a.#.a.#", append_tag_cb, "b");
+  g_message_center_filter (msg_center, NULL, "#.a.#.a.#.a.#.a.#.a.#.b", append_tag_cb, "x");
+  g_message_center_filter (msg_center, NULL, "#.#", append_tag_cb, "c");
+
+  /* each matching filter is called once, and "#.#" is the same as "#.#.#.#.#.#.#.#" */
+  g_message_center_send_full (msg_center, G_OBJECT (msg_center), topic->str, NULL);
+  g_assert_cmpstr (tags->str, ==, "abc");
+
+  g_assert_true (g_topic_matches ("#.a.#.a.#.a.#.a.#.a.#", topic->str));
+  g_assert_false (g_topic_matches ("#.a.#.a.#.a.#.a.#.a.#.b", topic->str));
+  g_assert_true (g_topic_matches ("#.*.#", "a"));
+  g_assert_false (g_topic_matches ("#.*.*.#", "a"));
+
+  g_string_free (topic, TRUE);
+  g_string_free (tags, TRUE);
+  g_object_unref (msg_center);
+}
+
+static void
+unfilter_self_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  guint *filter_id = user_data;
+
+  g_message_center_unfilter (msg_center, *filter_id);
+  g_string_append (g_object_get_data (G_OBJECT (msg_center), "tags"), "s");
+}
+
+static void
+object_tag_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  g_string_append (g_object_get_data (G_OBJECT (user_data), "tags"), "o");
+}
+
+static void
+test_unfilter (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  GObject *sender = g_object_new (G_TYPE_OBJECT, NULL);
+  GObject *object = g_object_new (G_TYPE_OBJECT, NULL);
+  GString *tags = g_string_new (NULL);
+  guint ids[100], self_id, id;
+  gint i;
+
+  g_object_set_data (G_OBJECT (msg_center), "tags", tags);
+
+  /* enough removals to rebuild the index a few times */
+  for (i = 0; i < 1000; i++)
+    {
+      ids[i % 100] = g_message_center_filter (msg_center, NULL, "test.unfilter", append_tag_cb, "x");
+      if (i % 100 == 99)
+        {
+          gint j;
+
+          for (j = 0; j < 100; j++)
+            g_message_center_unfilter (msg_center, ids[j]);
+        }
+    }
+
+  id = g_message_center_filter (msg_center, NULL, "test.unfilter", append_tag_cb, "a");
+  g_assert_cmpuint (id, >, 0);
+  self_id = g_message_center_filter (msg_center, NULL, "test.#", unfilter_self_cb, &self_id);
+  g_message_center_filter (msg_center, sender, NULL, append_tag_cb, "b");
+  g_object_set_data (object, "tags", tags);
+  g_message_center_filter_object (msg_center, NULL, "test.unfilter", object_tag_cb, object, 0);
+
+  g_message_center_send_full (msg_center, sender, "test.unfilter", NULL);
+  g_assert_cmpstr (tags->str, ==, "asbo");
+
+  /* filters on the sender and the watched object go away with them */
+  g_string_truncate (tags, 0);
+  g_object_unref (sender);
+  g_object_unref (object);
+  g_message_center_send_full (msg_center, G_OBJECT (msg_center), "test.unfilter", NULL);
+  g_assert_cmpstr (tags->str, ==, "a");
+
+  g_string_truncate (tags, 0);
+  g_message_center_unfilter (msg_center, id);
+  g_message_center_send_full (msg_center, G_OBJECT (msg_center), "test.unfilter", NULL);
+  g_assert_cmpstr (tags->str, ==, "");
+
+  g_string_free (tags, TRUE);
+  g_object_unref (msg_center);
+}
+
+static void
+remember_message_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  *((GMessage **) user_data) = msg;
+}
+
+static void
+keep_message_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  *((GMessage **) user_data) = g_object_ref (msg);
+}
+
+static void
+test_emit (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  GObject *sender = g_object_new (G_TYPE_OBJECT, NULL);
+  GQuark name = g_quark_from_static_string ("test.emit");
+  GMessage *first = NULL, *msg = NULL, *kept = NULL;
+  gint i;
+
+  g_message_center_filter (msg_center, NULL, "test.emit", remember_message_cb, &msg);
+
+  /* messages are recycled */
+  g_message_center_emit (msg_center, sender, name, NULL);
+  first = msg;
+  for (i = 0; i < 100; i++)
+    {
+      g_message_center_emit (msg_center, sender, name, GINT_TO_POINTER (i));
+      g_assert_true (msg == first);
+    }
+
+  /* unless somebody keeps them, in which case they keep their sender */
+  g_message_center_filter (msg_center, NULL, "test.emit.keep", keep_message_cb, &kept);
+  g_message_center_emit (msg_center, sender, g_quark_from_static_string ("test.emit.keep"), NULL);
+  g_assert_nonnull (kept);
+  g_object_add_weak_pointer (sender, (gpointer *) &sender);
+  g_object_unref (sender);
+  g_assert_nonnull (sender);
+  g_assert_true (g_message_get_sender (kept) == sender);
+  g_assert_cmpstr (g_message_get_name (kept), ==, "test.emit.keep");
+
+  g_object_unref (kept);
+  g_assert_null (sender);
+
+  g_object_unref (msg_center);
+}
+
+#define N_DELAYED 2000
+
+typedef struct
+{
+  gint64 due[N_DELAYED];
+  gboolean received[N_DELAYED];
+  gint n_expected;
+  gint n_received;
+} DelayedData;
+
+static void
+delayed_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  DelayedData *data = user_data;
+  gint i = GPOINTER_TO_INT (g_message_get_user_data (msg));
+
+  g_assert_false (data->received[i]);
+  g_assert_cmpint (g_get_monotonic_time (), >=, data->due[i]);
+  data->received[i] = TRUE;
+
+  if (++data->n_received == data->n_expected)
+    g_main_loop_quit (main_loop);
+}
+
+static void
+test_delayed (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  DelayedData *data = g_new0 (DelayedData, 1);
+  guint handles[N_DELAYED];
+  gint i;
+
+  g_message_center_filter (msg_center, NULL, "test.delayed", delayed_cb, data);
+
+  for (i = 0; i < N_DELAYED; i++)
+    {
+      guint delay = g_random_int_range (1, 200);
+
+      data->due[i] = g_get_monotonic_time () + delay * 1000;
+      handles[i] = g_message_center_send_full_with_delay (msg_center, G_OBJECT (msg_center),
+                                                          "test.delayed", GINT_TO_POINTER (i),
+                                                          delay);
+      g_assert_cmpuint (handles[i], >, 0);
+    }
+
+  for (i = 0; i < N_DELAYED; i += 2)
+    g_assert_true (g_message_center_cancel_delayed (msg_center, handles[i]));
+  data->n_expected = N_DELAYED / 2;
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+  g_main_loop_run (main_loop);
+  g_main_loop_unref (main_loop);
+
+  for (i = 0; i < N_DELAYED; i++)
+    g_assert_cmpint (data->received[i], ==, i % 2 == 1);
+  g_assert_false (g_message_center_cancel_delayed (msg_center, handles[1]));
+
+  g_free (data);
+  g_object_unref (msg_center);
+}
+
+static void
+count_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  (*(guint *) user_data)++;
+}
+
+static void
+test_delayed_last_ref (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  gint64 deadline = g_get_monotonic_time () + 5 * G_USEC_PER_SEC;
+  guint n_received = 0;
+  gint i;
+
+  g_message_center_filter (msg_center, NULL, "test.delayed.last", count_cb, &n_received);
+  for (i = 0; i < 2; i++)
+    g_message_center_send_full_with_delay (msg_center, G_OBJECT (msg_center), "test.delayed.last", NULL, 10);
+
+  /* the delayed messages hold the last references, and the center goes
+   * away from the timer dispatch */
+  g_object_add_weak_pointer (G_OBJECT (msg_center), (gpointer *) &msg_center);
+  g_object_unref (msg_center);
+  g_assert_nonnull (msg_center);
+
+  while (msg_center != NULL)
+    {
+      g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+      if (!g_main_context_iteration (NULL, FALSE))
+        g_usleep (1000);
+    }
+  g_assert_cmpuint (n_received, ==, 2);
+}
+
+typedef struct
+{
+  gint n_calls;
+  guint count;
+  gpointer last_user_data;
+} CoalesceData;
+
+static void
+coalesce_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  CoalesceData *data = user_data;
+
+  data->n_calls++;
+  data->count += g_message_get_coalesced_count (msg);
+  data->last_user_data = g_message_get_user_data (msg);
+}
+
+static gboolean
+quit_loop_cb (gpointer user_data)
+{
+  g_main_loop_quit (main_loop);
+  return G_SOURCE_REMOVE;
+}
+
+static void
+test_coalesce (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  CoalesceData throttled = { 0, }, debounced = { 0, }, all = { 0, };
+  guint id;
+  gint i;
+
+  g_message_center_filter (msg_center, NULL, "test.coalesce.sender", coalesce_cb, &throttled);
+  id = g_message_center_filter (msg_center, NULL, "test.coalesce.filter", coalesce_cb, &debounced);
+  g_message_center_coalesce_filter (msg_center, id, 30, G_MESSAGE_CENTER_COALESCE_DEBOUNCE);
+  g_message_center_filter (msg_center, NULL, "test.coalesce.filter", coalesce_cb, &all);
+
+  for (i = 1; i <= 100; i++)
+    {
+      GMessage *msg = g_message_new (G_OBJECT (msg_center), "test.coalesce.sender", GINT_TO_POINTER (i));
+
+      g_message_center_send_coalesced (msg_center, msg, 30, G_MESSAGE_CENTER_COALESCE_THROTTLE);
+      g_object_unref (msg);
+
+      g_message_center_send_full (msg_center, G_OBJECT (msg_center), "test.coalesce.filter", GINT_TO_POINTER (i));
+    }
+
+  /* coalesced messages are only delivered from the main loop */
+  g_assert_cmpint (throttled.n_calls, ==, 0);
+  g_assert_cmpint (debounced.n_calls, ==, 0);
+  g_assert_cmpint (all.n_calls, ==, 100);
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+  g_timeout_add (100, quit_loop_cb, NULL);
+  g_main_loop_run (main_loop);
+  g_main_loop_unref (main_loop);
+
+  g_assert_cmpint (throttled.n_calls, ==, 1);
+  g_assert_cmpuint (throttled.count, ==, 100);
+  g_assert_cmpint (GPOINTER_TO_INT (throttled.last_user_data), ==, 100);
+  g_assert_cmpint (debounced.n_calls, ==, 1);
+  g_assert_cmpuint (debounced.count, ==, 100);
+  g_assert_cmpint (GPOINTER_TO_INT (debounced.last_user_data), ==, 100);
+  g_assert_cmpuint (all.count, ==, 100);
+
+  g_object_unref (msg_center);
+}
+
+#define N_BULK 1000
+
+typedef struct
+{
+  gint n_bulk;
+  gint bulk_at_urgent;
+  gint bulk_at_normal;
+  gint bulk_at_send;
+} PriorityData;
+
+static void
+bulk_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  PriorityData *data = user_data;
+  gint64 end = g_get_monotonic_time () + 50;
+
+  /* pretend to do some work */
+  while (g_get_monotonic_time () < end);
+
+  if (++data->n_bulk == N_BULK / 2)
+    {
+      GMessage *control;
+
+      data->bulk_at_send = data->n_bulk;
+      control = g_message_new (G_OBJECT (msg_center), "test.priority.normal", NULL);
+      g_message_center_send_with_priority (msg_center, control, G_MESSAGE_CENTER_PRIORITY_NORMAL);
+      g_object_unref (control);
+      control = g_message_new (G_OBJECT (msg_center), "test.priority.urgent", NULL);
+      g_message_center_send_with_priority (msg_center, control, G_MESSAGE_CENTER_PRIORITY_URGENT);
+      g_object_unref (control);
+    }
+  else if (data->n_bulk == N_BULK)
+    {
+      g_main_loop_quit (main_loop);
+    }
+}
+
+static void
+urgent_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  PriorityData *data = user_data;
+
+  g_assert_cmpint (data->bulk_at_normal, ==, 0);
+  data->bulk_at_urgent = data->n_bulk;
+}
+
+static void
+normal_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  PriorityData *data = user_data;
+
+  data->bulk_at_normal = data->n_bulk;
+}
+
+static void
+test_priority (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  PriorityData data = { 0, };
+  gint i;
+
+  g_message_center_filter (msg_center, NULL, "test.priority.bulk", bulk_cb, &data);
+  g_message_center_filter (msg_center, NULL, "test.priority.urgent", urgent_cb, &data);
+  g_message_center_filter (msg_center, NULL, "test.priority.normal", normal_cb, &data);
+
+  for (i = 0; i < N_BULK; i++)
+    {
+      GMessage *msg = g_message_new (G_OBJECT (msg_center), "test.priority.bulk", NULL);
+
+      g_message_center_send_with_priority (msg_center, msg, G_MESSAGE_CENTER_PRIORITY_BULK);
+      g_object_unref (msg);
+    }
+  g_assert_cmpint (data.n_bulk, ==, 0);
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+  g_main_loop_run (main_loop);
+  g_main_loop_unref (main_loop);
+
+  /* control messages don't wait for the bulk ones to be done */
+  g_assert_cmpint (data.bulk_at_urgent, ==, data.bulk_at_send);
+  g_assert_cmpint (data.bulk_at_normal, ==, data.bulk_at_send);
+
+  g_object_unref (msg_center);
+}
+
+#define N_ASYNC_SENDERS  8
+#define N_ASYNC_MESSAGES 500
+
+typedef struct
+{
+  GMutex lock;
+  GCond cond;
+  gint last_seq[N_ASYNC_SENDERS];
+  gint n_received;
+} AsyncData;
+
+static void
+async_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  AsyncData *data = user_data;
+  gint sender_id = GPOINTER_TO_INT (g_object_get_data (g_message_get_sender (msg), "id"));
+  gint seq = GPOINTER_TO_INT (g_message_get_user_data (msg));
+
+  g_assert_true (g_thread_self () != main_thread);
+
+  /* messages from the same sender are never dispatched concurrently */
+  g_assert_cmpint (seq, ==, data->last_seq[sender_id] + 1);
+  g_usleep (10);
+  data->last_seq[sender_id] = seq;
+
+  g_mutex_lock (&data->lock);
+  if (++data->n_received == N_ASYNC_SENDERS * N_ASYNC_MESSAGES)
+    g_cond_signal (&data->cond);
+  g_mutex_unlock (&data->lock);
+}
+
+static void
+test_async (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  GObject *senders[N_ASYNC_SENDERS];
+  AsyncData data;
+  gint i, j;
+
+  main_thread = g_thread_self ();
+  memset (&data, 0, sizeof (data));
+  g_mutex_init (&data.lock);
+  g_cond_init (&data.cond);
+
+  g_message_center_filter (msg_center, NULL, "test.async", async_cb, &data);
+
+  for (i = 0; i < N_ASYNC_SENDERS; i++)
+    {
+      senders[i] = g_object_new (G_TYPE_OBJECT, NULL);
+      g_object_set_data (senders[i], "id", GINT_TO_POINTER (i));
+    }
+
+  for (j = 1; j <= N_ASYNC_MESSAGES; j++)
+    {
+      for (i = 0; i < N_ASYNC_SENDERS; i++)
+        {
+          GMessage *msg = g_message_new (senders[i], "test.async", GINT_TO_POINTER (j));
+
+          g_message_center_send_async (msg_center, msg);
+          g_object_unref (msg);
+        }
+    }
+
+  g_mutex_lock (&data.lock);
+  while (data.n_received < N_ASYNC_SENDERS * N_ASYNC_MESSAGES)
+    g_cond_wait (&data.cond, &data.lock);
+  g_mutex_unlock (&data.lock);
+
+  for (i = 0; i < N_ASYNC_SENDERS; i++)
+    {
+      g_assert_cmpint (data.last_seq[i], ==, N_ASYNC_MESSAGES);
+      g_object_unref (senders[i]);
+    }
+
+  g_object_unref (msg_center);
+  g_mutex_clear (&data.lock);
+  g_cond_clear (&data.cond);
+}
+
+static void
+nop_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+}
+
+static void
+test_send_performance (void)
+{
+  const struct {
+    guint n_filters;
+    gboolean journaled;
+  } runs[] = { { 0, FALSE }, { 1, FALSE }, { 100, FALSE }, { 1, TRUE } };
+  guint i, j, n;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("only run in performance mode");
+      return;
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (runs); i++)
+    {
+      GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+      GMessage *msg = g_message_new (G_OBJECT (msg_center), "test.perf", NULL);
+      gchar *dir = NULL, *path = NULL;
+      gdouble elapsed;
+
+      for (j = 0; j < runs[i].n_filters; j++)
+        g_message_center_filter (msg_center, NULL, "test.perf", nop_cb, NULL);
+
+      if (runs[i].journaled)
+        {
+          dir = g_dir_make_tmp ("testmessagecenter-XXXXXX", NULL);
+          path = g_build_filename (dir, "journal", NULL);
+          g_assert_true (g_message_center_set_journal (msg_center, path, NULL));
+        }
+
+      n = 2000000 / (runs[i].n_filters + 1);
+      g_test_timer_start ();
+      for (j = 0; j < n; j++)
+        g_message_center_send (msg_center, msg);
+      elapsed = g_test_timer_elapsed ();
+
+      g_test_maximized_result (n / elapsed, "%u filters%s: %.0f sends/s",
+                               runs[i].n_filters, runs[i].journaled ? ", journaled" : "", n / elapsed);
+
+      g_object_unref (msg);
+      if (path != NULL)
+        {
+          g_message_center_set_journal (msg_center, NULL, NULL);
+          g_unlink (path);
+          g_rmdir (dir);
+          g_free (path);
+          g_free (dir);
+        }
+      g_object_unref (msg_center);
+    }
+}
+
+static void
+slow_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  g_usleep (2000);
+}
+
+static void
+slow_handler_cb (GMessageCenter *msg_center, GMessage *msg, guint filter_id, gint64 elapsed, gpointer user_data)
+{
+  guint *slow_filter_id = user_data;
+
+  g_assert_cmpuint (filter_id, ==, *slow_filter_id);
+  g_assert_cmpint (elapsed, >=, 2000);
+  *slow_filter_id = 0;
+}
+
+static void
+test_stats (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  GVariant *stats, *topics, *filters, *histogram;
+  guint64 count, total = 0;
+  guint slow_id, id, reported_id;
+  const gchar *name;
+  gsize i;
+
+  g_message_center_set_stats_enabled (msg_center, TRUE);
+  g_message_center_set_handler_budget (msg_center, 1000);
+  g_signal_connect (msg_center, "slow-handler", G_CALLBACK (slow_handler_cb), &reported_id);
+
+  slow_id = g_message_center_filter (msg_center, NULL, "test.stats.slow", slow_cb, NULL);
+  g_message_center_filter (msg_center, NULL, "test.stats.fast", nop_cb, NULL);
+
+  for (i = 0; i < 3; i++)
+    {
+      reported_id = slow_id;
+      g_message_center_send_full (msg_center, G_OBJECT (msg_center), "test.stats.slow", NULL);
+      g_assert_cmpuint (reported_id, ==, 0);
+    }
+  g_message_center_send_full (msg_center, G_OBJECT (msg_center), "test.stats.fast", NULL);
+  g_message_center_send_full (msg_center, G_OBJECT (msg_center), "test.stats.nobody", NULL);
+
+  stats = g_message_center_get_stats (msg_center);
+  topics = g_variant_lookup_value (stats, "topics", G_VARIANT_TYPE ("a{st}"));
+  g_assert_true (g_variant_lookup (topics, "test.stats.slow", "t", &count));
+  g_assert_cmpuint (count, ==, 3);
+  g_assert_true (g_variant_lookup (topics, "test.stats.nobody", "t", &count));
+  g_assert_cmpuint (count, ==, 1);
+
+  filters = g_variant_lookup_value (stats, "filters", G_VARIANT_TYPE ("a(usat)"));
+  g_assert_cmpuint (g_variant_n_children (filters), ==, 2);
+  g_variant_get_child (filters, 0, "(u&s@at)", &id, &name, &histogram);
+  g_assert_cmpuint (id, ==, slow_id);
+  g_assert_cmpstr (name, ==, "test.stats.slow");
+  for (i = 0; i < g_variant_n_children (histogram); i++)
+    {
+      g_variant_get_child (histogram, i, "t", &count);
+      /* 2ms and more, 2000us to 2047us falling in bucket 11 */
+      if (count > 0)
+        g_assert_cmpuint (i, >=, 11);
+      total += count;
+    }
+  g_assert_cmpuint (total, ==, 3);
+
+  g_variant_unref (histogram);
+  g_variant_unref (filters);
+  g_variant_unref (topics);
+  g_variant_unref (stats);
+  g_object_unref (msg_center);
+}
+
+static void
+batch_cb (GMessageCenter *msg_center, GMessage **msgs, guint n_msgs, gpointer user_data)
+{
+  GString *tags = g_object_get_data (G_OBJECT (msg_center), "tags");
+  guint i;
+
+  g_string_append_c (tags, '[');
+  for (i = 0; i < n_msgs; i++)
+    g_string_append (tags, g_message_get_user_data (msgs[i]));
+  g_string_append_c (tags, ']');
+}
+
+static void
+tag_from_message_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  g_string_append (g_object_get_data (G_OBJECT (msg_center), "tags"), g_message_get_user_data (msg));
+}
+
+static void
+test_send_many (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  GObject *sender = g_object_new (G_TYPE_OBJECT, NULL);
+  GString *tags = g_string_new (NULL);
+  GMessage *msgs[5];
+  guint i;
+
+  g_object_set_data (G_OBJECT (msg_center), "tags", tags);
+  g_message_center_filter_batch (msg_center, NULL, "test.batch.#", batch_cb, NULL, NULL, 0);
+  g_message_center_filter (msg_center, NULL, "test.batch.a", tag_from_message_cb, NULL);
+
+  msgs[0] = g_message_new (sender, "test.batch.a", "1");
+  msgs[1] = g_message_new (sender, "test.batch.b", "2");
+  msgs[2] = g_message_new (sender, "test.batch.a", "3");
+  msgs[3] = g_message_new (G_OBJECT (msg_center), "test.batch.a", "4");
+  msgs[4] = g_message_new (sender, "test.batch.a", "5");
+
+  g_message_center_send_many (msg_center, msgs, G_N_ELEMENTS (msgs));
+  g_assert_cmpstr (tags->str, ==, "[135]135[2][4]4");
+
+  g_string_truncate (tags, 0);
+  g_message_center_send (msg_center, msgs[1]);
+  g_assert_cmpstr (tags->str, ==, "[2]");
+
+  for (i = 0; i < G_N_ELEMENTS (msgs); i++)
+    g_object_unref (msgs[i]);
+  g_string_free (tags, TRUE);
+  g_object_unref (msg_center);
+  g_object_unref (sender);
+}
+
+static void
+test_retained (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  GObject *sender = g_object_new (G_TYPE_OBJECT, NULL);
+  GString *tags = g_string_new (NULL);
+  GMessage *msg;
+
+  g_object_set_data (G_OBJECT (msg_center), "tags", tags);
+
+  msg = g_message_new (sender, "test.retained.a", "1");
+  g_message_center_send_retained (msg_center, msg);
+  g_object_unref (msg);
+  msg = g_message_new (sender, "test.retained.a", "2");
+  g_message_center_send_retained (msg_center, msg);
+  g_object_unref (msg);
+  msg = g_message_new (G_OBJECT (msg_center), "test.retained.b", "3");
+  g_message_center_send_retained (msg_center, msg);
+  g_object_unref (msg);
+
+  /* late filters get the latest value right away */
+  g_message_center_filter (msg_center, NULL, "test.retained.a", tag_from_message_cb, NULL);
+  g_assert_cmpstr (tags->str, ==, "2");
+
+  g_string_truncate (tags, 0);
+  g_message_center_filter (msg_center, NULL, "test.retained.*", tag_from_message_cb, NULL);
+  g_assert_cmpuint (tags->len, ==, 2);
+  g_assert_nonnull (strchr (tags->str, '2'));
+  g_assert_nonnull (strchr (tags->str, '3'));
+
+  g_string_truncate (tags, 0);
+  g_message_center_filter (msg_center, sender, NULL, tag_from_message_cb, NULL);
+  g_message_center_filter (msg_center, sender, "test.retained.b", tag_from_message_cb, NULL);
+  g_assert_cmpstr (tags->str, ==, "2");
+
+  g_string_truncate (tags, 0);
+  g_message_center_clear_retained (msg_center, "test.retained.a");
+  g_message_center_filter (msg_center, NULL, "test.retained.a", tag_from_message_cb, NULL);
+  g_assert_cmpstr (tags->str, ==, "");
+
+  g_string_free (tags, TRUE);
+  g_object_unref (msg_center);
+  g_object_unref (sender);
+}
+
+static void
+echo_request_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  GMessage *reply;
+
+  g_assert_cmpuint (g_message_get_correlation_id (msg), !=, 0);
+
+  reply = g_message_new (G_OBJECT (msg_center), "test.request.reply", g_message_get_user_data (msg));
+  g_assert_true (g_message_center_reply (msg_center, msg, reply));
+  /* only the first reply counts */
+  g_assert_false (g_message_center_reply (msg_center, msg, reply));
+  g_object_unref (reply);
+}
+
+static void
+request_done_cb (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+  GMessage **reply = user_data;
+  GError *error = NULL;
+
+  *reply = g_message_center_request_finish (G_MESSAGE_CENTER (source), result, &error);
+  if (*reply == NULL)
+    {
+      g_object_set_data_full (source, "error", error, (GDestroyNotify) g_error_free);
+    }
+  g_main_loop_quit (main_loop);
+}
+
+static void
+test_request (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  GObject *sender = g_object_new (G_TYPE_OBJECT, NULL);
+  GCancellable *cancellable;
+  GMessage *msg, *reply;
+  GError *error;
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+
+  g_message_center_filter (msg_center, NULL, "test.request.echo", echo_request_cb, NULL);
+  g_message_center_filter (msg_center, NULL, "test.request.ignored", nop_cb, NULL);
+
+  msg = g_message_new (sender, "test.request.echo", "ping");
+  g_message_center_request_async (msg_center, msg, 1000, NULL, request_done_cb, &reply);
+  g_main_loop_run (main_loop);
+  g_assert_nonnull (reply);
+  g_assert_cmpstr (g_message_get_user_data (reply), ==, "ping");
+  g_assert_cmpuint (g_message_get_correlation_id (reply), !=, 0);
+  /* the request is sent as a copy */
+  g_assert_cmpuint (g_message_get_correlation_id (msg), ==, 0);
+  g_object_unref (reply);
+  g_object_unref (msg);
+
+  msg = g_message_new (sender, "test.request.ignored", NULL);
+  g_message_center_request_async (msg_center, msg, 10, NULL, request_done_cb, &reply);
+  g_main_loop_run (main_loop);
+  g_assert_null (reply);
+  error = g_object_get_data (G_OBJECT (msg_center), "error");
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT);
+
+  cancellable = g_cancellable_new ();
+  g_message_center_request_async (msg_center, msg, 0, cancellable, request_done_cb, &reply);
+  g_cancellable_cancel (cancellable);
+  g_main_loop_run (main_loop);
+  g_assert_null (reply);
+  error = g_object_get_data (G_OBJECT (msg_center), "error");
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_object_unref (cancellable);
+  g_object_unref (msg);
+
+  g_main_loop_unref (main_loop);
+  g_object_unref (msg_center);
+  g_object_unref (sender);
+}
+
+static void
+collect_payload_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  GPtrArray *payloads = user_data;
+
+  g_ptr_array_add (payloads, g_variant_ref (g_message_get_payload (msg)));
+}
+
+static void
+test_payload (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  GObject *sender = g_object_new (G_TYPE_OBJECT, NULL);
+  GPtrArray *payloads = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+  GVariant *payload;
+  GMessage *msg;
+
+  g_message_center_filter (msg_center, NULL, "test.payload", collect_payload_cb, payloads);
+  g_message_center_filter (msg_center, sender, "test.payload", collect_payload_cb, payloads);
+
+  payload = g_variant_new ("(su)", "hello", 42);
+  msg = g_message_new_with_payload (sender, "test.payload", payload);
+  g_assert_false (g_variant_is_floating (payload));
+  g_assert_true (g_message_get_payload (msg) == payload);
+  g_assert_null (g_message_get_user_data (msg));
+
+  g_message_center_send (msg_center, msg);
+  g_object_unref (msg);
+
+  /* every filter got the very same payload, which outlives the message */
+  g_assert_cmpuint (payloads->len, ==, 2);
+  g_assert_true (payloads->pdata[0] == payload);
+  g_assert_true (payloads->pdata[1] == payload);
+  g_assert_true (g_variant_is_of_type (payload, G_VARIANT_TYPE ("(su)")));
+
+  /* and so do late filters of retained messages */
+  msg = g_message_new_with_payload (sender, "test.payload", g_variant_new_uint32 (7));
+  g_message_center_send_retained (msg_center, msg);
+  g_object_unref (msg);
+  g_ptr_array_set_size (payloads, 0);
+  g_message_center_filter (msg_center, NULL, "test.payload", collect_payload_cb, payloads);
+  g_assert_cmpuint (payloads->len, ==, 1);
+  g_assert_cmpuint (g_variant_get_uint32 (payloads->pdata[0]), ==, 7);
+
+  g_ptr_array_unref (payloads);
+  g_object_unref (msg_center);
+  g_object_unref (sender);
+}
+
+static void
+test_rate_limit (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  GObject *noisy = g_object_new (G_TYPE_OBJECT, NULL);
+  GObject *other = g_object_new (G_TYPE_OBJECT, NULL);
+  CoalesceData dropped = { 0, }, deferred = { 0, }, coalesced = { 0, };
+  GVariant *stats, *limits;
+  gint i;
+
+  g_message_center_filter (msg_center, NULL, "test.limit.drop", coalesce_cb, &dropped);
+  g_message_center_filter (msg_center, NULL, "test.limit.defer", coalesce_cb, &deferred);
+  g_message_center_filter (msg_center, NULL, "test.limit.coalesce", coalesce_cb, &coalesced);
+
+  g_message_center_set_rate_limit (msg_center, noisy, NULL, 1, 3, G_MESSAGE_CENTER_RATE_LIMIT_DROP);
+  g_message_center_set_rate_limit (msg_center, NULL, "test.limit.defer", 200, 2, G_MESSAGE_CENTER_RATE_LIMIT_DEFER);
+  g_message_center_set_rate_limit (msg_center, other, "test.limit.coalesce", 50, 1, G_MESSAGE_CENTER_RATE_LIMIT_COALESCE);
+
+  for (i = 1; i <= 5; i++)
+    {
+      g_message_center_send_full (msg_center, noisy, "test.limit.drop", GINT_TO_POINTER (i));
+      g_message_center_send_full (msg_center, other, "test.limit.drop", GINT_TO_POINTER (i));
+      g_message_center_send_full (msg_center, other, "test.limit.defer", GINT_TO_POINTER (i));
+      g_message_center_send_full (msg_center, other, "test.limit.coalesce", GINT_TO_POINTER (i));
+    }
+
+  /* only the noisy sender is limited */
+  g_assert_cmpint (dropped.n_calls, ==, 8);
+  g_assert_cmpint (deferred.n_calls, ==, 2);
+  g_assert_cmpint (coalesced.n_calls, ==, 1);
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+  g_timeout_add (100, quit_loop_cb, NULL);
+  g_main_loop_run (main_loop);
+  g_main_loop_unref (main_loop);
+
+  /* deferred messages all come, in order, and coalesced ones as one */
+  g_assert_cmpint (deferred.n_calls, ==, 5);
+  g_assert_cmpint (GPOINTER_TO_INT (deferred.last_user_data), ==, 5);
+  g_assert_cmpint (coalesced.n_calls, ==, 2);
+  g_assert_cmpuint (coalesced.count, ==, 5);
+  g_assert_cmpint (GPOINTER_TO_INT (coalesced.last_user_data), ==, 5);
+
+  stats = g_message_center_get_stats (msg_center);
+  limits = g_variant_lookup_value (stats, "rate-limits", G_VARIANT_TYPE ("a(ssttt)"));
+  g_assert_cmpuint (g_variant_n_children (limits), ==, 3);
+  for (i = 0; i < 3; i++)
+    {
+      const gchar *type_name, *message_name;
+      guint64 n_dropped, n_coalesced, n_deferred;
+
+      g_variant_get_child (limits, i, "(&s&sttt)", &type_name, &message_name, &n_dropped, &n_coalesced, &n_deferred);
+      if (g_str_equal (message_name, ""))
+        {
+          g_assert_cmpstr (type_name, ==, "GObject");
+          g_assert_cmpuint (n_dropped, ==, 2);
+        }
+      else if (g_str_equal (message_name, "test.limit.defer"))
+        {
+          g_assert_cmpstr (type_name, ==, "");
+          g_assert_cmpuint (n_deferred, ==, 3);
+        }
+      else
+        {
+          g_assert_cmpuint (n_coalesced, ==, 4);
+        }
+    }
+  g_variant_unref (limits);
+  g_variant_unref (stats);
+
+  /* limits go away with their sender, or when set to 0 */
+  g_object_unref (noisy);
+  g_message_center_set_rate_limit (msg_center, NULL, "test.limit.defer", 0, 0, G_MESSAGE_CENTER_RATE_LIMIT_DEFER);
+  for (i = 0; i < 5; i++)
+    {
+      g_message_center_send_full (msg_center, other, "test.limit.defer", NULL);
+    }
+  g_assert_cmpint (deferred.n_calls, ==, 10);
+
+  stats = g_message_center_get_stats (msg_center);
+  limits = g_variant_lookup_value (stats, "rate-limits", G_VARIANT_TYPE ("a(ssttt)"));
+  g_assert_cmpuint (g_variant_n_children (limits), ==, 1);
+  g_variant_unref (limits);
+  g_variant_unref (stats);
+
+  g_object_unref (msg_center);
+  g_object_unref (other);
+}
+
+static void
+journal_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  GString *names = user_data;
+  GVariant *payload = g_message_get_payload (msg);
+
+  /* replayed messages are sent by the center */
+  if (g_message_get_sender (msg) != G_OBJECT (msg_center))
+    return;
+
+  g_string_append (names, g_message_get_name (msg) + strlen ("test.journal."));
+  if (payload != NULL && g_variant_is_of_type (payload, G_VARIANT_TYPE_STRING))
+    {
+      g_string_append (names, g_variant_get_string (payload, NULL));
+    }
+  else if (payload != NULL)
+    {
+      g_string_append_c (names, '#');
+    }
+}
+
+#define N_JOURNAL_BLOBS 600
+
+static void
+test_journal (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  GObject *sender = g_object_new (G_TYPE_OBJECT, NULL);
+  GString *names = g_string_new (NULL);
+  GMessage *msgs[2];
+  GError *error = NULL;
+  gchar *dir, *path;
+  guint64 offset;
+  guint8 blob[4096] = { 0, };
+  gint i;
+
+  dir = g_dir_make_tmp ("testmessagecenter-XXXXXX", &error);
+  g_assert_no_error (error);
+  path = g_build_filename (dir, "journal", NULL);
+
+  g_assert_cmpuint (g_message_center_get_journal_offset (msg_center), ==, 0);
+  g_assert_true (g_message_center_set_journal (msg_center, path, &error));
+  g_assert_no_error (error);
+
+  msgs[0] = g_message_new_with_payload (sender, "test.journal.a", g_variant_new_string ("1"));
+  g_message_center_send (msg_center, msgs[0]);
+  g_object_unref (msgs[0]);
+  g_message_center_send_full (msg_center, sender, "test.journal.b", NULL);
+  offset = g_message_center_get_journal_offset (msg_center);
+  g_assert_cmpuint (offset, >, 0);
+
+  msgs[0] = g_message_new_with_payload (sender, "test.journal.c", g_variant_new_string ("2"));
+  msgs[1] = g_message_new_with_payload (sender, "test.journal.d", g_variant_new_string ("3"));
+  g_message_center_send_many (msg_center, msgs, 2);
+  g_object_unref (msgs[0]);
+  g_object_unref (msgs[1]);
+  /* recorded when sent, not when delivered */
+  msgs[0] = g_message_new (sender, "test.journal.e", NULL);
+  g_message_center_cancel_delayed (msg_center, g_message_center_send_with_delay (msg_center, msgs[0], 10000));
+  g_object_unref (msgs[0]);
+
+  /* the journal outlives the center, like after a crash */
+  g_object_unref (msg_center);
+  g_assert_true (g_file_test (path, G_FILE_TEST_EXISTS));
+
+  msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  g_message_center_filter (msg_center, NULL, "test.journal.*", journal_cb, names);
+  g_assert_false (g_message_center_replay (msg_center, 0, &error));
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_BADF);
+  g_clear_error (&error);
+
+  g_assert_true (g_message_center_set_journal (msg_center, path, &error));
+  g_assert_no_error (error);
+  g_assert_true (g_message_center_replay (msg_center, 0, &error));
+  g_assert_no_error (error);
+  g_assert_cmpstr (names->str, ==, "a1bc2d3e");
+
+  /* replayed messages are not recorded again */
+  g_string_truncate (names, 0);
+  g_assert_true (g_message_center_replay (msg_center, offset, &error));
+  g_assert_cmpstr (names->str, ==, "c2d3e");
+
+  /* new messages go after the old ones, growing the file as needed */
+  offset = g_message_center_get_journal_offset (msg_center);
+  for (i = 0; i < N_JOURNAL_BLOBS; i++)
+    {
+      GVariant *payload = g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, blob, sizeof (blob), 1);
+      GMessage *msg = g_message_new_with_payload (sender, "test.journal.f", payload);
+
+      g_message_center_send (msg_center, msg);
+      g_object_unref (msg);
+    }
+  g_string_truncate (names, 0);
+  g_assert_true (g_message_center_replay (msg_center, offset, &error));
+  g_assert_cmpuint (names->len, ==, 2 * N_JOURNAL_BLOBS);
+
+  g_assert_true (g_message_center_set_journal (msg_center, NULL, &error));
+  g_assert_cmpuint (g_message_center_get_journal_offset (msg_center), ==, 0);
+
+  g_object_unref (msg_center);
+  g_object_unref (sender);
+  g_string_free (names, TRUE);
+  g_unlink (path);
+  g_rmdir (dir);
+  g_free (path);
+  g_free (dir);
+}
+
+static void
+sleep_tag_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  GString *tags = g_object_get_data (G_OBJECT (msg_center), "tags");
+
+  g_usleep (500);
+  g_string_append_printf (tags, "%s%s ", (gchar *) g_message_get_user_data (msg), (gchar *) user_data);
+}
+
+#define N_SLICED_FILTERS 10
+
+static gboolean
+send_sliced_cb (gpointer user_data)
+{
+  GMessageCenter *msg_center = user_data;
+  GString *tags = g_object_get_data (G_OBJECT (msg_center), "tags");
+  GObject *sender = g_object_get_data (G_OBJECT (msg_center), "sender");
+  gint64 start = g_get_monotonic_time ();
+
+  g_message_center_send_full (msg_center, sender, "test.sliced", "a");
+  /* queued behind the first one */
+  g_message_center_send_full (msg_center, sender, "test.sliced", "b");
+
+  /* not all filters had time to run */
+  g_assert_cmpint (g_get_monotonic_time () - start, <, N_SLICED_FILTERS * 500);
+  g_assert_nonnull (strstr (tags->str, "a0 "));
+  g_assert_null (strstr (tags->str, "b0 "));
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+check_sliced_cb (gpointer user_data)
+{
+  GString *tags = user_data;
+
+  if (strstr (tags->str, "b9 ") == NULL)
+    return G_SOURCE_CONTINUE;
+
+  g_main_loop_quit (main_loop);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Sends messages from a loop running @context, checking they are time
+ * sliced */
+static void
+run_sliced (GMessageCenter *msg_center, GMainContext *context)
+{
+  GString *tags = g_object_get_data (G_OBJECT (msg_center), "tags");
+  GString *expected = g_string_new (NULL);
+  GSource *source;
+  gint i;
+
+  g_string_truncate (tags, 0);
+  main_loop = g_main_loop_new (context, FALSE);
+  source = g_idle_source_new ();
+  g_source_set_callback (source, send_sliced_cb, msg_center, NULL);
+  g_source_attach (source, context);
+  g_source_unref (source);
+  source = g_timeout_source_new (1);
+  g_source_set_callback (source, check_sliced_cb, tags, NULL);
+  g_source_attach (source, context);
+  g_source_unref (source);
+  g_main_loop_run (main_loop);
+  g_main_loop_unref (main_loop);
+
+  /* all filters were called, in order */
+  for (i = 0; i < N_SLICED_FILTERS; i++)
+    g_string_append_printf (expected, "a%d ", i);
+  for (i = 0; i < N_SLICED_FILTERS; i++)
+    g_string_append_printf (expected, "b%d ", i);
+  g_assert_cmpstr (tags->str, ==, expected->str);
+
+  g_string_free (expected, TRUE);
+}
+
+static void
+test_dispatch_budget (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  GObject *sender = g_object_new (G_TYPE_OBJECT, NULL);
+  GString *tags = g_string_new (NULL);
+  GMainContext *context;
+  static const gchar *indexes[N_SLICED_FILTERS] = { "0", "1", "2", "3", "4", "5", "6", "7", "8", "9" };
+  gint i;
+
+  g_object_set_data (G_OBJECT (msg_center), "tags", tags);
+  g_object_set_data (G_OBJECT (msg_center), "sender", sender);
+  for (i = 0; i < N_SLICED_FILTERS; i++)
+    {
+      g_message_center_filter (msg_center, i % 2 ? sender : NULL, "test.sliced", sleep_tag_cb, (gpointer) indexes[i]);
+    }
+  g_message_center_set_dispatch_budget (msg_center, 1200);
+
+  /* outside of the main loop, everything is dispatched right away */
+  g_message_center_send_full (msg_center, sender, "test.sliced", "x");
+  g_assert_nonnull (strstr (tags->str, "x9 "));
+
+  run_sliced (msg_center, NULL);
+
+  /* as is a loop running the thread default context */
+  context = g_main_context_new ();
+  g_main_context_push_thread_default (context);
+  run_sliced (msg_center, context);
+  g_main_context_pop_thread_default (context);
+  g_main_context_unref (context);
+
+  g_string_free (tags, TRUE);
+  g_object_unref (msg_center);
+  g_object_unref (sender);
+}
+
+/* the UUID of the center sending to the others */
+static const gchar *distributed_origin;
+
+static void
+distributed_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  GString *names = user_data;
+  GVariant *payload = g_message_get_payload (msg);
+  const gchar *origin = g_distributed_message_center_get_message_origin (msg);
+
+  /* received messages are sent by the center, and tell where they come
+   * from */
+  g_assert_true (g_message_get_sender (msg) == G_OBJECT (msg_center));
+  if (origin != NULL)
+    {
+      g_assert_cmpstr (origin, ==, distributed_origin);
+      g_assert_cmpstr (origin, !=, g_distributed_message_center_get_uuid (G_DISTRIBUTED_MESSAGE_CENTER (msg_center)));
+    }
+
+  g_string_append (names, g_message_get_name (msg) + strlen ("test.distributed."));
+  if (payload != NULL)
+    g_string_append (names, g_variant_get_string (payload, NULL));
+}
+
+/* Runs the main context until the centers see @n_peers peers each, or
+ * until @n_bytes names were received */
+static void
+iterate_until (GDistributedMessageCenter **centers, guint n_centers, guint n_peers, GString *names, gsize n_bytes)
+{
+  gint64 deadline = g_get_monotonic_time () + 5 * G_USEC_PER_SEC;
+  gboolean done = FALSE;
+  guint i;
+
+  while (!done)
+    {
+      g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+      while (g_main_context_iteration (NULL, FALSE));
+      g_usleep (1000);
+
+      done = names == NULL || names->len >= n_bytes;
+      for (i = 0; i < n_centers; i++)
+        done = done && g_distributed_message_center_get_n_peers (centers[i]) == n_peers;
+    }
+}
+
+/* Runs the main context until @n_listeners peers of @center listen to
+ * @message_name */
+static void
+wait_for_listeners (GDistributedMessageCenter *center, const gchar *message_name, guint n_listeners)
+{
+  gint64 deadline = g_get_monotonic_time () + 5 * G_USEC_PER_SEC;
+
+  while (g_distributed_message_center_get_n_listeners (center, message_name) != n_listeners)
+    {
+      g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+      if (!g_main_context_iteration (NULL, FALSE))
+        g_usleep (1000);
+    }
+}
+
+static void
+test_distributed (void)
+{
+  GDistributedMessageCenter *centers[3];
+  GString *names = g_string_new (NULL);
+  GMessage *msg;
+  GError *error = NULL;
+  gchar *dir, *path;
+  gint i;
+
+  dir = g_dir_make_tmp ("testmessagecenter-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  for (i = 0; i < 3; i++)
+    {
+      centers[i] = g_distributed_message_center_new (dir, &error);
+      g_assert_no_error (error);
+      g_message_center_filter (G_MESSAGE_CENTER (centers[i]), NULL, "test.distributed.*", distributed_cb, names);
+    }
+  iterate_until (centers, 3, 2, NULL, 0);
+  wait_for_listeners (centers[0], "test.distributed.a", 2);
+  distributed_origin = g_distributed_message_center_get_uuid (centers[0]);
+  g_assert_cmpuint (strlen (distributed_origin), ==, 36);
+  g_assert_cmpstr (distributed_origin, !=, g_distributed_message_center_get_uuid (centers[1]));
+
+  /* delivered locally right away, and once to each of the other processes */
+  msg = g_message_new_with_payload (G_OBJECT (centers[0]), "test.distributed.a", g_variant_new_string ("1"));
+  g_distributed_message_center_send (centers[0], msg);
+  g_object_unref (msg);
+  g_assert_cmpstr (names->str, ==, "a1");
+  msg = g_message_new (G_OBJECT (centers[0]), "test.distributed.b", NULL);
+  g_distributed_message_center_send (centers[0], msg);
+  g_object_unref (msg);
+  /* nothing is left waiting for a batch to complete */
+  g_distributed_message_center_flush (centers[0]);
+  iterate_until (centers, 3, 2, names, 8);
+  g_assert_cmpstr (names->str, ==, "a1ba1ba1b");
+
+  /* messages sent to the local center only are not forwarded */
+  g_message_center_send_full (G_MESSAGE_CENTER (centers[1]), G_OBJECT (centers[1]), "test.distributed.c", NULL);
+  g_assert_cmpuint (names->len, ==, 10);
+
+  /* the first one owns the rendezvous socket, which is taken over */
+  g_object_unref (centers[0]);
+  iterate_until (centers + 1, 2, 1, NULL, 0);
+  centers[0] = g_distributed_message_center_new (dir, &error);
+  g_assert_no_error (error);
+  iterate_until (centers, 3, 2, NULL, 0);
+
+  for (i = 0; i < 3; i++)
+    g_object_unref (centers[i]);
+  g_string_free (names, TRUE);
+
+  path = g_build_filename (dir, "rendezvous.lock", NULL);
+  g_unlink (path);
+  g_assert_cmpint (g_rmdir (dir), ==, 0);
+  g_free (path);
+  g_free (dir);
+}
+
+/* both a filter and a message-received handler */
+static void
+routing_received_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  GString *names = user_data;
+
+  g_string_append (names, g_message_get_name (msg) + strlen ("test.route."));
+}
+
+static void
+test_distributed_routing (void)
+{
+  GDistributedMessageCenter *centers[3];
+  GString *names[3];
+  GString *filtered[3];
+  GError *error = NULL;
+  gchar *dir, *path;
+  guint filter_id;
+  gint i;
+
+  dir = g_dir_make_tmp ("testmessagecenter-XXXXXX", &error);
+  g_assert_no_error (error);
+  for (i = 0; i < 3; i++)
+    {
+      centers[i] = g_distributed_message_center_new (dir, &error);
+      g_assert_no_error (error);
+      names[i] = g_string_new (NULL);
+      filtered[i] = g_string_new (NULL);
+      /* sees all the messages the center gets, filtered or not */
+      g_signal_connect (centers[i], "message-received", G_CALLBACK (routing_received_cb), names[i]);
+    }
+
+  g_message_center_filter (G_MESSAGE_CENTER (centers[1]), NULL, "test.route.a", routing_received_cb, filtered[1]);
+  filter_id = g_message_center_filter (G_MESSAGE_CENTER (centers[2]), G_OBJECT (centers[2]), "test.route.*", routing_received_cb, filtered[2]);
+  /* only for local messages, not listened to by other processes */
+  g_message_center_filter (G_MESSAGE_CENTER (centers[2]), G_OBJECT (centers[0]), "test.other", routing_received_cb, filtered[2]);
+  iterate_until (centers, 3, 2, NULL, 0);
+  wait_for_listeners (centers[0], "test.route.a", 2);
+  wait_for_listeners (centers[0], "test.route.b", 1);
+  g_assert_cmpuint (g_distributed_message_center_get_n_listeners (centers[0], "test.other"), ==, 0);
+
+  for (i = 0; i < 3; i++)
+    {
+      GMessage *msg = g_message_new (G_OBJECT (centers[0]), i == 0 ? "test.route.b" : i == 1 ? "test.other" : "test.route.a", NULL);
+
+      g_distributed_message_center_send (centers[0], msg);
+      g_object_unref (msg);
+    }
+  /* the last one went to both, after the others */
+  iterate_until (centers + 1, 2, 2, names[1], 1);
+  iterate_until (centers + 2, 1, 2, names[2], 2);
+  g_assert_cmpstr (names[1]->str, ==, "a");
+  g_assert_cmpstr (names[2]->str, ==, "ba");
+  g_assert_cmpstr (filtered[1]->str, ==, "a");
+  g_assert_cmpstr (filtered[2]->str, ==, "ba");
+
+  g_message_center_unfilter (G_MESSAGE_CENTER (centers[2]), filter_id);
+  wait_for_listeners (centers[0], "test.route.b", 0);
+  g_assert_cmpuint (g_distributed_message_center_get_n_listeners (centers[0], "test.route.a"), ==, 1);
+
+  for (i = 0; i < 3; i++)
+    {
+      g_object_unref (centers[i]);
+      g_string_free (names[i], TRUE);
+      g_string_free (filtered[i], TRUE);
+    }
+
+  path = g_build_filename (dir, "rendezvous.lock", NULL);
+  g_unlink (path);
+  g_assert_cmpint (g_rmdir (dir), ==, 0);
+  g_free (path);
+  g_free (dir);
+}
+
+#define N_RING_MESSAGES 2000
+
+typedef struct
+{
+  guint n_received;
+  GVariant *kept;
+} RingData;
+
+static void
+ring_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  RingData *data = user_data;
+  GVariant *payload = g_message_get_payload (msg);
+  GVariant *blob = g_variant_get_child_value (payload, 1);
+  guint32 index;
+
+  /* received in order, whichever way they came */
+  g_variant_get_child (payload, 0, "u", &index);
+  g_assert_cmpuint (index, ==, data->n_received);
+  g_assert_cmpuint (g_variant_n_children (blob), ==, index == N_RING_MESSAGES / 2 ? 512 * 1024 : 4096);
+  data->n_received++;
+
+  /* kept while much more than the ring holds goes through it */
+  if (index == 0)
+    data->kept = g_variant_ref (payload);
+
+  g_variant_unref (blob);
+}
+
+static void
+test_distributed_ring (void)
+{
+  GDistributedMessageCenter *centers[2];
+  static guint8 blob[512 * 1024];
+  RingData data = { 0, NULL };
+  GError *error = NULL;
+  gchar *dir, *path;
+  guint i;
+
+  dir = g_dir_make_tmp ("testmessagecenter-XXXXXX", &error);
+  g_assert_no_error (error);
+  for (i = 0; i < 2; i++)
+    {
+      centers[i] = g_distributed_message_center_new (dir, &error);
+      g_assert_no_error (error);
+    }
+  g_message_center_filter (G_MESSAGE_CENTER (centers[1]), NULL, "test.ring", ring_cb, &data);
+  iterate_until (centers, 2, 1, NULL, 0);
+  wait_for_listeners (centers[0], "test.ring", 1);
+
+  /* more than the ring holds at once, with one too big for it */
+  for (i = 0; i < N_RING_MESSAGES; i++)
+    {
+      GVariant *payload = g_variant_new ("(u@ay)", i,
+                                         g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                                                    blob,
+                                                                    i == N_RING_MESSAGES / 2 ? sizeof (blob) : 4096,
+                                                                    1));
+      GMessage *msg = g_message_new_with_payload (G_OBJECT (centers[0]), "test.ring", payload);
+
+      g_distributed_message_center_send (centers[0], msg);
+      g_object_unref (msg);
+    }
+
+  {
+    gint64 deadline = g_get_monotonic_time () + 5 * G_USEC_PER_SEC;
+
+    while (data.n_received < N_RING_MESSAGES)
+      {
+        g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+        if (!g_main_context_iteration (NULL, FALSE))
+          g_usleep (1000);
+      }
+  }
+
+  /* and is still intact */
+  {
+    GVariant *kept_blob = g_variant_get_child_value (data.kept, 1);
+    guint32 index;
+
+    g_variant_get_child (data.kept, 0, "u", &index);
+    g_assert_cmpuint (index, ==, 0);
+    g_assert_cmpuint (g_variant_n_children (kept_blob), ==, 4096);
+    g_variant_unref (kept_blob);
+    g_variant_unref (data.kept);
+  }
+
+  for (i = 0; i < 2; i++)
+    g_object_unref (centers[i]);
+
+  path = g_build_filename (dir, "rendezvous.lock", NULL);
+  g_unlink (path);
+  g_assert_cmpint (g_rmdir (dir), ==, 0);
+  g_free (path);
+  g_free (dir);
+}
+
+#define N_FLOW_MESSAGES   200
+#define FLOW_PAYLOAD_SIZE (16 * 1024)
+
+/* too big for the ring, so they go in blobs */
+#define N_FLOW_BLOBS      400
+#define FLOW_BLOB_SIZE    (128 * 1024)
+
+typedef struct
+{
+  guint n_received;
+  guint next_index;
+} FlowData;
+
+static void
+flow_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  FlowData *flow = user_data;
+  guint32 index;
+
+  /* dropped messages leave holes, nothing else changes the order */
+  g_variant_get_child (g_message_get_payload (msg), 0, "u", &index);
+  g_assert_cmpuint (index, >=, flow->next_index);
+  flow->next_index = index + 1;
+  flow->n_received++;
+}
+
+static void
+flow_send (GDistributedMessageCenter *center, guint n_messages, gsize size)
+{
+  static guint8 blob[FLOW_BLOB_SIZE];
+  guint i;
+
+  for (i = 0; i < n_messages; i++)
+    {
+      GVariant *payload = g_variant_new ("(u@ay)", i,
+                                         g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, blob, size, 1));
+      GMessage *msg = g_message_new_with_payload (G_OBJECT (center), "test.flow", payload);
+
+      g_distributed_message_center_send (center, msg);
+      g_object_unref (msg);
+    }
+}
+
+static gpointer
+flow_send_burst (gpointer data)
+{
+  flow_send (data, N_FLOW_MESSAGES, FLOW_PAYLOAD_SIZE);
+
+  return NULL;
+}
+
+static void
+flow_wait (FlowData *flow, guint n_received)
+{
+  gint64 deadline = g_get_monotonic_time () + 5 * G_USEC_PER_SEC;
+
+  while (flow->n_received < n_received)
+    {
+      g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+      if (!g_main_context_iteration (NULL, FALSE))
+        g_usleep (1000);
+    }
+  while (g_main_context_iteration (NULL, FALSE));
+  g_assert_cmpuint (flow->n_received, ==, n_received);
+}
+
+/* gets the statistics of the only peer of @center */
+static void
+flow_get_stats (GDistributedMessageCenter *center,
+                guint64 *buffered,
+                guint64 *n_dropped,
+                guint64 *n_spilled,
+                guint64 *send_stalled,
+                guint64 *receive_stalled)
+{
+  GVariant *stats = g_distributed_message_center_get_peer_stats (center);
+
+  g_assert_cmpuint (g_variant_n_children (stats), ==, 1);
+  g_variant_get_child (stats, 0, "(&sttttt)", NULL, buffered, n_dropped, n_spilled, send_stalled, receive_stalled);
+  g_variant_unref (stats);
+}
+
+static void
+test_ring_seals (void)
+{
+  GMessageRing *ring, *attached;
+  GError *error = NULL;
+  gint memfd, data_fd, space_fd, fd;
+  gchar *path;
+  guint8 *contents;
+  gsize size;
+
+  ring = g_message_ring_new (4096, &error);
+  g_assert_no_error (error);
+  g_message_ring_get_fds (ring, &memfd, &data_fd, &space_fd);
+  size = lseek (memfd, 0, SEEK_END);
+  contents = g_malloc (size);
+  g_assert_cmpint (pread (memfd, contents, size, 0), ==, size);
+
+  attached = g_message_ring_attach (dup (memfd), dup (data_fd), dup (space_fd), &error);
+  g_assert_no_error (error);
+  g_message_ring_unref (attached);
+
+  /* The same ring in a file the peer could still shrink */
+  fd = g_file_open_tmp ("testmessagecenter-XXXXXX", &path, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (write (fd, contents, size), ==, size);
+  attached = g_message_ring_attach (fd, dup (data_fd), dup (space_fd), &error);
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL);
+  g_assert_null (attached);
+  g_clear_error (&error);
+  g_unlink (path);
+
+  g_free (path);
+  g_free (contents);
+  g_message_ring_unref (ring);
+}
+
+static void
+test_distributed_flow (void)
+{
+  GDistributedMessageCenter *centers[2];
+  guint64 buffered, n_dropped, n_spilled, send_stalled, receive_stalled, total_dropped, unused;
+  FlowData flow = { 0, 0 };
+  GError *error = NULL;
+  GThread *thread;
+  gchar *dir, *path;
+  guint i;
+
+  dir = g_dir_make_tmp ("testmessagecenter-XXXXXX", &error);
+  g_assert_no_error (error);
+  for (i = 0; i < 2; i++)
+    {
+      centers[i] = g_distributed_message_center_new (dir, &error);
+      g_assert_no_error (error);
+    }
+  g_message_center_filter (G_MESSAGE_CENTER (centers[1]), NULL, "test.flow", flow_cb, &flow);
+  iterate_until (centers, 2, 1, NULL, 0);
+  wait_for_listeners (centers[0], "test.flow", 1);
+
+  /* the receiver doesn't run while the burst is sent, so what doesn't fit
+   * in the ring and the limit is dropped */
+  g_distributed_message_center_set_flow_control (centers[0], 64 * 1024, G_DISTRIBUTED_MESSAGE_CENTER_FLOW_DROP);
+  flow_send_burst (centers[0]);
+  flow_get_stats (centers[0], &buffered, &n_dropped, &n_spilled, &unused, &unused);
+  g_assert_cmpuint (buffered, <=, 64 * 1024);
+  g_assert_cmpuint (n_dropped, >, 0);
+  g_assert_cmpuint (n_spilled, ==, 0);
+  flow_wait (&flow, N_FLOW_MESSAGES - n_dropped);
+
+  /* both sides saw the sender wait */
+  flow_get_stats (centers[0], &buffered, &unused, &unused, &send_stalled, &unused);
+  g_assert_cmpuint (buffered, ==, 0);
+  g_assert_cmpuint (send_stalled, >, 0);
+  flow_get_stats (centers[1], &unused, &unused, &unused, &unused, &receive_stalled);
+  g_assert_cmpuint (receive_stalled, >, 0);
+
+  /* or spilled, and all of them are received in order */
+  flow.n_received = flow.next_index = 0;
+  g_distributed_message_center_set_flow_control (centers[0], 64 * 1024, G_DISTRIBUTED_MESSAGE_CENTER_FLOW_SPILL);
+  flow_send_burst (centers[0]);
+  flow_get_stats (centers[0], &buffered, &total_dropped, &n_spilled, &unused, &unused);
+  g_assert_cmpuint (buffered, <=, 64 * 1024);
+  g_assert_cmpuint (total_dropped, ==, n_dropped);
+  g_assert_cmpuint (n_spilled, >, 0);
+  flow_wait (&flow, N_FLOW_MESSAGES);
+  g_assert_cmpuint (flow.next_index, ==, N_FLOW_MESSAGES);
+
+  /* or the sender waits for the receiver */
+  flow.n_received = flow.next_index = 0;
+  g_distributed_message_center_set_flow_control (centers[0], 64 * 1024, G_DISTRIBUTED_MESSAGE_CENTER_FLOW_BLOCK);
+  thread = g_thread_new ("flow", flow_send_burst, centers[0]);
+  flow_wait (&flow, N_FLOW_MESSAGES);
+  g_thread_join (thread);
+  g_assert_cmpuint (flow.next_index, ==, N_FLOW_MESSAGES);
+  flow_get_stats (centers[0], &buffered, &total_dropped, &unused, &unused, &unused);
+  g_assert_cmpuint (buffered, ==, 0);
+  g_assert_cmpuint (total_dropped, ==, n_dropped);
+
+  /* blobs only take a marker in the ring, but count against the limit all
+   * the same, while they wait for the socket */
+  flow.n_received = flow.next_index = 0;
+  g_distributed_message_center_set_flow_control (centers[0], 256 * 1024, G_DISTRIBUTED_MESSAGE_CENTER_FLOW_DROP);
+  flow_send (centers[0], N_FLOW_BLOBS, FLOW_BLOB_SIZE);
+  flow_get_stats (centers[0], &buffered, &total_dropped, &unused, &unused, &unused);
+  g_assert_cmpuint (buffered, <=, 256 * 1024);
+  g_assert_cmpuint (total_dropped, >, n_dropped);
+  flow_wait (&flow, N_FLOW_BLOBS - (total_dropped - n_dropped));
+
+  for (i = 0; i < 2; i++)
+    g_object_unref (centers[i]);
+
+  path = g_build_filename (dir, "rendezvous.lock", NULL);
+  g_unlink (path);
+  g_assert_cmpint (g_rmdir (dir), ==, 0);
+  g_free (path);
+  g_free (dir);
+}
+
+#define N_THREADS            4
+#define N_MESSAGES_PER_THREAD 1000
+
+
+static void
+count_in_main_thread_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  gint *count = user_data;
+
+  g_assert_true (g_thread_self () == main_thread);
+  if (++(*count) == N_THREADS * N_MESSAGES_PER_THREAD)
+    g_main_loop_quit (main_loop);
+}
+
+static void
+count_atomic_cb (GMessageCenter *msg_center, GMessage *msg, gpointer user_data)
+{
+  g_atomic_int_inc ((gint *) user_data);
+}
+
+static gpointer
+send_thread_func (gpointer user_data)
+{
+  GMessageCenter *msg_center = G_MESSAGE_CENTER (user_data);
+  gint i;
+
+  for (i = 0; i < N_MESSAGES_PER_THREAD; i++)
+    {
+      /* register filters while others are being dispatched, in existing
+       * buckets and in new ones, so that the index grows */
+      if (i % 100 == 0)
+        g_message_center_filter (msg_center, NULL, "test.threads.never", count_atomic_cb, NULL);
+      if (i % 10 == 0)
+        {
+          gchar *name = g_strdup_printf ("test.threads.never.%p.%d", (gpointer) g_thread_self (), i);
+          g_message_center_filter (msg_center, NULL, name, count_atomic_cb, NULL);
+          g_free (name);
+        }
+
+      g_message_center_send_full (msg_center, G_OBJECT (msg_center), "test.threads", NULL);
+    }
+
+  return NULL;
+}
+
+static void
+test_threads (void)
+{
+  GMessageCenter *msg_center = g_object_new (G_TYPE_MESSAGE_CENTER, NULL);
+  GThread *threads[N_THREADS];
+  gint in_context_count = 0, inline_count = 0;
+  gint i;
+
+  main_thread = g_thread_self ();
+  main_loop = g_main_loop_new (NULL, FALSE);
+
+  g_message_center_filter_full (msg_center, NULL, "test.threads", count_in_main_thread_cb,
+                                &in_context_count, NULL, G_MESSAGE_CENTER_FILTER_INVOKE_IN_CONTEXT);
+  g_message_center_filter (msg_center, NULL, "test.threads", count_atomic_cb, &inline_count);
+
+  for (i = 0; i < N_THREADS; i++)
+    threads[i] = g_thread_new ("sender", send_thread_func, msg_center);
+
+  g_main_loop_run (main_loop);
+
+  for (i = 0; i < N_THREADS; i++)
+    g_thread_join (threads[i]);
+
+  g_assert_cmpint (in_context_count, ==, N_THREADS * N_MESSAGES_PER_THREAD);
+  g_assert_cmpint (g_atomic_int_get (&inline_count), ==, N_THREADS * N_MESSAGES_PER_THREAD);
+
+  g_main_loop_unref (main_loop);
+  g_object_unref (msg_center);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/messagecenter/filter-index", test_filter_index);
+  g_test_add_func ("/messagecenter/quark-names", test_quark_names);
+  g_test_add_func ("/messagecenter/wildcards", test_wildcards);
+  g_test_add_func ("/messagecenter/wildcards-deep", test_wildcards_deep);
+  g_test_add_func ("/messagecenter/unfilter", test_unfilter);
+  g_test_add_func ("/messagecenter/emit", test_emit);
+  g_test_add_func ("/messagecenter/delayed-last-ref", test_delayed_last_ref);
+  g_test_add_func ("/messagecenter/delayed", test_delayed);
+  g_test_add_func ("/messagecenter/coalesce", test_coalesce);
+  g_test_add_func ("/messagecenter/priority", test_priority);
+  g_test_add_func ("/messagecenter/async", test_async);
+  g_test_add_func ("/messagecenter/stats", test_stats);
+  g_test_add_func ("/messagecenter/send-many", test_send_many);
+  g_test_add_func ("/messagecenter/retained", test_retained);
+  g_test_add_func ("/messagecenter/distributed-routing", test_distributed_routing);
+  g_test_add_func ("/messagecenter/distributed-flow", test_distributed_flow);
+  g_test_add_func ("/messagecenter/distributed-ring", test_distributed_ring);
+  g_test_add_func ("/messagecenter/ring-seals", test_ring_seals);
+  g_test_add_func ("/messagecenter/distributed", test_distributed);
+  g_test_add_func ("/messagecenter/dispatch-budget", test_dispatch_budget);
+  g_test_add_func ("/messagecenter/journal", test_journal);
+  g_test_add_func ("/messagecenter/rate-limit", test_rate_limit);
+  g_test_add_func ("/messagecenter/payload", test_payload);
+  g_test_add_func ("/messagecenter/request", test_request);
+  g_test_add_func ("/messagecenter/threads", test_threads);
+  g_test_add_func ("/messagecenter/send-performance", test_send_performance);
+  g_test_add_func ("/messagecenter/send-with-delay", test_send_with_delay);
 
-  return 0;
+  return g_test_run ();
 }